@@ -0,0 +1,267 @@
+/*
+ * arena.c - Region allocation on top of memlib.
+ *
+ * Every chunk starts with a chunk header, and the first chunk also holds
+ * the arena itself, so a small arena costs a single mapping. A block is
+ * allocated by bumping "top" towards "end" in the current chunk. When it
+ * does not fit, the arena moves on to a new chunk, and the rest of the
+ * old one is wasted until the next reset. A block bigger than a quarter
+ * of a chunk gets a chunk of its own instead, so it wastes neither the
+ * current chunk nor most of a new one.
+ *
+ * arena_reset goes back to the first chunk and keeps up to KEEP_BYTES of
+ * the other ordinary chunks as spares, so an arena that is reset after
+ * every request stops mapping memory once it has seen the biggest one.
+ */
+#include <string.h>
+#include "arena.h"
+#include "memlib.h"
+
+#define ALIGNMENT 16
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+
+#define DEFAULT_CHUNK_SIZE (16 * 1024)
+#define KEEP_BYTES (256 * 1024)
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t size; /* Bytes mapped, including this header */
+} chunk;
+
+struct arena {
+  char *top;         /* Where the next block starts in the current chunk */
+  char *end;         /* The end of the current chunk */
+  char *last;        /* The last block allocated from the current chunk */
+  chunk *chunks;     /* Every chunk in use, the current one first */
+  chunk *spares;     /* Ordinary chunks that arena_reset kept */
+  size_t chunk_size; /* Bytes in an ordinary chunk */
+  size_t used;
+  size_t mapped;
+};
+
+#define CHUNK_HEADER_SIZE ALIGN(sizeof(chunk))
+#define ARENA_SIZE ALIGN(sizeof(struct arena))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEADER_SIZE)
+/* The chunk that holds the arena */
+#define FIRST_CHUNK(arena) ((chunk *)((char *)(arena) - CHUNK_HEADER_SIZE))
+/* Blocks bigger than this get a chunk of their own */
+#define BIG_BLOCK(arena) (((arena)->chunk_size - CHUNK_HEADER_SIZE) / 4)
+
+/*
+ * round_to_pages - Rounds "size" up to a multiple of the page size. Returns 0 if that overflows.
+ */
+static size_t round_to_pages(size_t size)
+{
+  size_t page = mem_pagesize();
+
+  if (size > (size_t)-1 - page)
+    return 0;
+  return (size + page - 1) & ~(page - 1);
+}
+
+arena_t *arena_create(size_t chunk_size)
+{
+  chunk *first;
+  arena_t *arena;
+
+  if (chunk_size == 0)
+    chunk_size = DEFAULT_CHUNK_SIZE;
+  if (chunk_size < CHUNK_HEADER_SIZE + ARENA_SIZE)
+    chunk_size = CHUNK_HEADER_SIZE + ARENA_SIZE;
+  chunk_size = round_to_pages(chunk_size);
+  if (chunk_size == 0 || (first = mem_map(chunk_size)) == NULL)
+    return NULL;
+
+  first->next = NULL;
+  first->size = chunk_size;
+  arena = (arena_t *)CHUNK_DATA(first);
+  arena->top = (char *)arena + ARENA_SIZE;
+  arena->end = (char *)first + chunk_size;
+  arena->last = NULL;
+  arena->chunks = first;
+  arena->spares = NULL;
+  arena->chunk_size = chunk_size;
+  arena->used = 0;
+  arena->mapped = chunk_size;
+  return arena;
+}
+
+/*
+ * unmap_chunks - Unmaps every chunk in a list except the one that holds the arena.
+ */
+static void unmap_chunks(arena_t *arena, chunk *c)
+{
+  chunk *next;
+
+  for (; c != NULL; c = next) {
+    next = c->next;
+    if (c != FIRST_CHUNK(arena))
+      mem_unmap(c, c->size);
+  }
+}
+
+void arena_destroy(arena_t *arena)
+{
+  if (arena == NULL)
+    return;
+  unmap_chunks(arena, arena->chunks);
+  unmap_chunks(arena, arena->spares);
+  mem_unmap(FIRST_CHUNK(arena), arena->chunk_size);
+}
+
+void arena_reset(arena_t *arena)
+{
+  chunk *first = FIRST_CHUNK(arena), *c, *next;
+  size_t kept = 0;
+
+  for (c = arena->spares; c != NULL; c = c->next)
+    kept += c->size;
+
+  for (c = arena->chunks; c != NULL; c = next) {
+    next = c->next;
+    if (c == first)
+      continue;
+    if (c->size == arena->chunk_size && kept + c->size <= KEEP_BYTES) {
+      c->next = arena->spares;
+      arena->spares = c;
+      kept += c->size;
+    } else {
+      arena->mapped -= c->size;
+      mem_unmap(c, c->size);
+    }
+  }
+
+  first->next = NULL;
+  arena->chunks = first;
+  arena->top = (char *)arena + ARENA_SIZE;
+  arena->end = (char *)first + first->size;
+  arena->last = NULL;
+  arena->used = 0;
+}
+
+/*
+ * big_alloc - Maps a chunk for a block of "size" (aligned) bytes alone and
+ * links it behind the current chunk, which stays current.
+ */
+static void *big_alloc(arena_t *arena, size_t size)
+{
+  size_t chunk_size = round_to_pages(size + CHUNK_HEADER_SIZE);
+  chunk *c;
+
+  if (chunk_size == 0 || (c = mem_map(chunk_size)) == NULL)
+    return NULL;
+  c->size = chunk_size;
+  c->next = arena->chunks->next;
+  arena->chunks->next = c;
+  arena->mapped += chunk_size;
+  arena->used += size;
+  return CHUNK_DATA(c);
+}
+
+/*
+ * next_chunk - Makes a spare or a newly mapped chunk the current one. Returns -1 if memory runs out.
+ */
+static int next_chunk(arena_t *arena)
+{
+  chunk *c = arena->spares;
+
+  if (c != NULL) {
+    arena->spares = c->next;
+  } else {
+    if ((c = mem_map(arena->chunk_size)) == NULL)
+      return -1;
+    c->size = arena->chunk_size;
+    arena->mapped += c->size;
+  }
+  c->next = arena->chunks;
+  arena->chunks = c;
+  arena->top = CHUNK_DATA(c);
+  arena->end = (char *)c + c->size;
+  arena->last = NULL;
+  return 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+  char *block;
+
+  if (size > (size_t)-1 / 2)
+    return NULL;
+  size = size ? ALIGN(size) : ALIGNMENT;
+
+  if (size > (size_t)(arena->end - arena->top)) {
+    if (size > BIG_BLOCK(arena))
+      return big_alloc(arena, size);
+    if (next_chunk(arena) < 0)
+      return NULL;
+  }
+
+  block = arena->top;
+  arena->top += size;
+  arena->last = block;
+  arena->used += size;
+  return block;
+}
+
+void *arena_calloc(arena_t *arena, size_t count, size_t size)
+{
+  size_t total;
+  void *block;
+
+  if (__builtin_mul_overflow(count, size, &total))
+    return NULL;
+  block = arena_alloc(arena, total);
+  if (block != NULL)
+    memset(block, 0, total);
+  return block;
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+  void *new_ptr;
+
+  if (ptr == NULL)
+    return arena_alloc(arena, new_size);
+
+  /* The last block grows or shrinks in place while it fits in the current chunk */
+  if (ptr == arena->last && new_size <= (size_t)(arena->end - arena->last)) {
+    new_size = new_size ? ALIGN(new_size) : ALIGNMENT;
+    arena->used = arena->used - (arena->top - arena->last) + new_size;
+    arena->top = arena->last + new_size;
+    return ptr;
+  }
+
+  if (new_size <= old_size)
+    return ptr;
+  new_ptr = arena_alloc(arena, new_size);
+  if (new_ptr != NULL)
+    memcpy(new_ptr, ptr, old_size);
+  return new_ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t n)
+{
+  size_t len = strnlen(s, n);
+  char *copy = arena_alloc(arena, len + 1);
+
+  if (copy != NULL) {
+    memcpy(copy, s, len);
+    copy[len] = 0;
+  }
+  return copy;
+}
+
+char *arena_strdup(arena_t *arena, const char *s)
+{
+  return arena_strndup(arena, s, strlen(s));
+}
+
+size_t arena_used(arena_t *arena)
+{
+  return arena->used;
+}
+
+size_t arena_mapped(arena_t *arena)
+{
+  return arena->mapped;
+}
@@ -0,0 +1,38 @@
+/*
+ * arena.h - Region allocation on top of memlib.
+ *
+ * An arena hands out memory by bumping a pointer through chunks it maps
+ * with mem_map, and everything allocated from it is freed at once by
+ * arena_reset or arena_destroy. It suits memory that lives exactly as
+ * long as one piece of work, such as one request in a server. An arena
+ * is not thread-safe; give each thread its own.
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+/* Creates an empty arena that maps chunks of at least "chunk_size" bytes (0 for the default). Returns NULL if memory runs out. */
+arena_t *arena_create(size_t chunk_size);
+/* Unmaps the arena and everything that was allocated from it */
+void arena_destroy(arena_t *arena);
+/* Frees everything that was allocated from the arena but keeps some of its chunks for what is allocated next */
+void arena_reset(arena_t *arena);
+
+/* Returns "size" bytes aligned to 16, or NULL if memory runs out. The block lives until the next reset. */
+void *arena_alloc(arena_t *arena, size_t size);
+/* Like arena_alloc, but the block is zeroed */
+void *arena_calloc(arena_t *arena, size_t count, size_t size);
+/* Resizes a block of "old_size" bytes, in place if it was the last one allocated. The old block is not reused otherwise. */
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+/* Copies a string (at most "n" characters of it) into the arena */
+char *arena_strdup(arena_t *arena, const char *s);
+char *arena_strndup(arena_t *arena, const char *s, size_t n);
+
+/* Bytes allocated since the last reset, and bytes the arena has mapped */
+size_t arena_used(arena_t *arena);
+size_t arena_mapped(arena_t *arena);
+
+#endif /* _ARENA_H_ */
@@ -0,0 +1,610 @@
+/*
+ * mdriver.c - Trace-driven driver for the malloc lab.
+ *
+ * usage: mdriver [-chv] [-f <file>] [-t <dir>] [-a <allocators>] [-r <repeats>]
+ *
+ *   -f <file>       replay only this trace file
+ *   -t <dir>        replay every *.rep file in <dir> (default "traces")
+ *   -a <list>       comma-separated allocators to run (default "mm,solution,libc")
+ *   -r <repeats>    timed replays of each trace; the fastest counts (default 5)
+ *   -c              run mm_check after every operation of mm's first replay
+ *   -v              also print each allocator's peak heap and, for mm, its own
+ *                   mm_report_utilization() and mm_report_fragmentation()
+ *                   after every trace
+ *
+ * The allocators are:
+ *   mm        mm.c
+ *   solution  Solution_mm.c, built with its mm_* functions renamed to sol_mm_*
+ *   libc      the C library's malloc, for reference
+ *
+ * Each trace is replayed by each allocator in a child process of its own,
+ * so that an allocator that crashes only loses that trace and every run
+ * starts from an empty heap. The first replay checks the allocator: every
+ * block must be 16-byte aligned and keep its contents until it is freed
+ * or reallocated. It also records the peak payload (the requested bytes of
+ * the live blocks) and the peak heap (bytes that mem_map had handed out,
+ * or, for libc, what mallinfo2 reports). Utilization is peak payload
+ * divided by peak heap. The remaining replays are timed.
+ *
+ * Trace files use the format of the CS:APP malloc lab:
+ *
+ *   <suggested heap size>   (ignored)
+ *   <number of block ids>
+ *   <number of operations>
+ *   <weight>                (ignored)
+ *   a <id> <bytes>          allocate a block for <id>
+ *   r <id> <bytes>          reallocate the block of <id>
+ *   f <id>                  free the block of <id>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include "mm.h"
+#include "memlib.h"
+
+#define ALIGNMENT 16
+#define MAX_TRACES 64
+#define MAX_ALLOCATORS 8
+
+/* Solution_mm.c, compiled with its mm_* functions renamed (see the Makefile) */
+extern int sol_mm_init(void);
+extern void *sol_mm_malloc(size_t size);
+extern void sol_mm_free(void *ptr);
+
+typedef struct {
+  char type;   /* 'a', 'r' or 'f' */
+  int id;
+  size_t size;
+} trace_op_t;
+
+typedef struct {
+  char *name;
+  int num_ids;
+  int num_ops;
+  trace_op_t *ops;
+  size_t max_size; /* biggest request in the trace */
+} trace_t;
+
+typedef struct {
+  char *name;
+  int (*init)(void);
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size); /* NULL to malloc, copy and free */
+  int uses_memlib;    /* gets its memory from mem_map, otherwise from the C library */
+  size_t max_request; /* biggest request it can serve, 0 for no limit */
+} allocator_t;
+
+/* What one allocator did with one trace */
+typedef struct {
+  int status;          /* one of the RUN_ values */
+  char error[128];     /* why the run was invalid */
+  size_t peak_payload;
+  size_t peak_heap;
+  double seconds;      /* fastest timed replay */
+} result_t;
+
+#define RUN_OK       0
+#define RUN_INVALID  1 /* the allocator misbehaved */
+#define RUN_CRASHED  2 /* the child process died */
+#define RUN_SKIPPED  3 /* the trace asks for more than the allocator can serve */
+
+static int libc_init(void)
+{
+  malloc_trim(0);
+  return 0;
+}
+
+static allocator_t allocators[] = {
+  { "mm",       mm_init,     mm_malloc,     mm_free,     mm_realloc, 1, 0 },
+  { "solution", sol_mm_init, sol_mm_malloc, sol_mm_free, NULL,       1, 384 * 1024 },
+  { "libc",     libc_init,   malloc,        free,        realloc,    0, 0 },
+};
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+static int repeats = 5;
+static int verbose = 0;
+static int check_heap = 0;
+
+/*
+ * now - Returns a monotonic timestamp in seconds
+ */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * read_trace - Loads a trace file. Exits with a message if it is malformed.
+ */
+static trace_t *read_trace(const char *path)
+{
+  trace_t *trace = calloc(1, sizeof(trace_t));
+  FILE *f = fopen(path, "r");
+  const char *base = strrchr(path, '/');
+  long heap_size, weight, id, size;
+  char type;
+  int i;
+
+  if (f == NULL) {
+    perror(path);
+    exit(1);
+  }
+  trace->name = strdup(base ? base + 1 : path);
+
+  if (fscanf(f, "%ld %d %d %ld", &heap_size, &trace->num_ids, &trace->num_ops, &weight) != 4 ||
+      trace->num_ids < 1 || trace->num_ops < 0) {
+    fprintf(stderr, "%s: bad header\n", path);
+    exit(1);
+  }
+  trace->ops = malloc(trace->num_ops * sizeof(trace_op_t) + 1);
+
+  for (i = 0; i < trace->num_ops; i++) {
+    size = 0;
+    if (fscanf(f, " %c %ld", &type, &id) != 2 || id < 0 || id >= trace->num_ids ||
+        (type != 'f' && (fscanf(f, "%ld", &size) != 1 || size < 0)) ||
+        (type != 'a' && type != 'r' && type != 'f')) {
+      fprintf(stderr, "%s: bad operation %d\n", path, i);
+      exit(1);
+    }
+    trace->ops[i].type = type;
+    trace->ops[i].id = id;
+    trace->ops[i].size = size;
+    if ((size_t)size > trace->max_size)
+      trace->max_size = size;
+  }
+  fclose(f);
+  return trace;
+}
+
+static void free_trace(trace_t *trace)
+{
+  free(trace->ops);
+  free(trace->name);
+  free(trace);
+}
+
+/* Orders trace names alphabetically for qsort */
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/*
+ * find_traces - Fills "paths" with every *.rep file in "dir", sorted by name
+ */
+static int find_traces(const char *dir, char **paths)
+{
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  size_t len;
+  int n = 0;
+
+  if (d == NULL) {
+    perror(dir);
+    exit(1);
+  }
+  while ((entry = readdir(d)) != NULL && n < MAX_TRACES) {
+    len = strlen(entry->d_name);
+    if (len > 4 && !strcmp(entry->d_name + len - 4, ".rep")) {
+      paths[n] = malloc(strlen(dir) + len + 2);
+      sprintf(paths[n++], "%s/%s", dir, entry->d_name);
+    }
+  }
+  closedir(d);
+  qsort(paths, n, sizeof(char *), compare_names);
+  return n;
+}
+
+/*
+ * Block contents - Every byte of a block gets a value that depends on its
+ * id and its offset, so a block that another block overwrote is caught.
+ */
+static unsigned char pattern(int id, size_t offset)
+{
+  return (unsigned char)(((unsigned)id * 2654435761u >> 24) ^ offset ^ (offset >> 8));
+}
+
+static void fill(unsigned char *p, int id, size_t from, size_t to)
+{
+  size_t k;
+  for (k = from; k < to; k++)
+    p[k] = pattern(id, k);
+}
+
+static int intact(unsigned char *p, int id, size_t size)
+{
+  size_t k;
+  for (k = 0; k < size; k++)
+    if (p[k] != pattern(id, k))
+      return 0;
+  return 1;
+}
+
+/*
+ * generic_realloc - mm_realloc for allocators that don't have one. The
+ * driver knows the old size, so it can copy just the live bytes.
+ */
+static void *generic_realloc(allocator_t *a, void *ptr, size_t old_size, size_t size)
+{
+  void *new_ptr = a->malloc(size);
+
+  if (new_ptr == NULL)
+    return NULL;
+  if (ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    a->free(ptr);
+  }
+  return new_ptr;
+}
+
+/*
+ * heap_bytes - How much memory an allocator holds right now
+ */
+static size_t heap_bytes(allocator_t *a)
+{
+  struct mallinfo2 info;
+
+  if (a->uses_memlib)
+    return mem_heap_bytes();
+  info = mallinfo2();
+  return info.arena + info.hblkhd;
+}
+
+/*
+ * check_trace - Replays a trace once, checking every block and recording
+ * the peak payload and peak heap. Returns 0 or fills in result->error.
+ */
+static int check_trace(allocator_t *a, trace_t *trace, result_t *result)
+{
+  unsigned char **blocks = calloc(trace->num_ids, sizeof(unsigned char *));
+  size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+  size_t payload = 0, heap, base;
+  unsigned char *p;
+  trace_op_t *op;
+  int i, ok = 1;
+
+  /*
+   * What mem_map hands out in init belongs to the allocator's heap. The C
+   * library's heap also holds the driver's own blocks, so only those are
+   * subtracted and any free space that it keeps counts against the trace.
+   * That makes its utilization approximate.
+   */
+  mem_reset_stats();
+  base = mem_heap_bytes();
+  if (a->init() < 0) {
+    sprintf(result->error, "init failed");
+    free(blocks);
+    free(sizes);
+    return -1;
+  }
+  if (!a->uses_memlib) {
+    struct mallinfo2 info = mallinfo2();
+    base = info.uordblks + info.hblkhd;
+  }
+
+  for (i = 0; i < trace->num_ops && ok; i++) {
+    op = &trace->ops[i];
+    switch (op->type) {
+    case 'a':
+      p = a->malloc(op->size);
+      if (p == NULL && op->size > 0) {
+        sprintf(result->error, "op %d: malloc(%zu) returned NULL", i, op->size);
+        ok = 0;
+        break;
+      }
+      fill(p, op->id, 0, op->size);
+      payload += op->size;
+      blocks[op->id] = p;
+      sizes[op->id] = op->size;
+      break;
+
+    case 'r':
+      if (!intact(blocks[op->id], op->id, sizes[op->id])) {
+        sprintf(result->error, "op %d: block %d was overwritten before realloc", i, op->id);
+        ok = 0;
+        break;
+      }
+      if (a->realloc != NULL)
+        p = a->realloc(blocks[op->id], op->size);
+      else
+        p = generic_realloc(a, blocks[op->id], sizes[op->id], op->size);
+      if (p == NULL && op->size > 0) {
+        sprintf(result->error, "op %d: realloc(%zu) returned NULL", i, op->size);
+        ok = 0;
+        break;
+      }
+      if (!intact(p, op->id, op->size < sizes[op->id] ? op->size : sizes[op->id])) {
+        sprintf(result->error, "op %d: realloc lost the contents of block %d", i, op->id);
+        ok = 0;
+        break;
+      }
+      if (op->size > sizes[op->id])
+        fill(p, op->id, sizes[op->id], op->size);
+      payload += op->size - sizes[op->id];
+      blocks[op->id] = p;
+      sizes[op->id] = op->size;
+      break;
+
+    case 'f':
+      if (!intact(blocks[op->id], op->id, sizes[op->id])) {
+        sprintf(result->error, "op %d: block %d was overwritten before free", i, op->id);
+        ok = 0;
+        break;
+      }
+      if (blocks[op->id] != NULL)
+        a->free(blocks[op->id]);
+      payload -= sizes[op->id];
+      blocks[op->id] = NULL;
+      sizes[op->id] = 0;
+      break;
+    }
+
+    if (ok && blocks[op->id] != NULL && (size_t)blocks[op->id] % ALIGNMENT != 0) {
+      sprintf(result->error, "op %d: block %d at %p is not %d-byte aligned", i, op->id, blocks[op->id], ALIGNMENT);
+      ok = 0;
+    }
+    if (ok && check_heap && a->init == mm_init && mm_check(stderr) < 0) {
+      sprintf(result->error, "op %d: mm_check failed", i);
+      ok = 0;
+    }
+
+    if (payload > result->peak_payload)
+      result->peak_payload = payload;
+    heap = heap_bytes(a);
+    if (heap > base && heap - base > result->peak_heap)
+      result->peak_heap = heap - base;
+  }
+
+  if (a->uses_memlib && mem_heap_peak() - base > result->peak_heap)
+    result->peak_heap = mem_heap_peak() - base;
+
+  if (ok && verbose && a->init == mm_init) {
+    mm_report_utilization(stdout);
+    mm_report_fragmentation(stdout);
+  }
+
+  free(blocks);
+  free(sizes);
+  return ok ? 0 : -1;
+}
+
+/*
+ * time_trace - Returns the seconds that one replay of a trace takes,
+ * including the allocator's init.
+ */
+static double time_trace(allocator_t *a, trace_t *trace)
+{
+  void **blocks = calloc(trace->num_ids, sizeof(void *));
+  size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+  trace_op_t *op;
+  double t;
+  int i;
+
+  t = now();
+  a->init();
+  for (i = 0; i < trace->num_ops; i++) {
+    op = &trace->ops[i];
+    switch (op->type) {
+    case 'a':
+      blocks[op->id] = a->malloc(op->size);
+      sizes[op->id] = op->size;
+      break;
+    case 'r':
+      if (a->realloc != NULL)
+        blocks[op->id] = a->realloc(blocks[op->id], op->size);
+      else
+        blocks[op->id] = generic_realloc(a, blocks[op->id], sizes[op->id], op->size);
+      sizes[op->id] = op->size;
+      break;
+    case 'f':
+      if (blocks[op->id] != NULL)
+        a->free(blocks[op->id]);
+      blocks[op->id] = NULL;
+      break;
+    }
+  }
+  t = now() - t;
+
+  free(blocks);
+  free(sizes);
+  return t;
+}
+
+/*
+ * run_trace - Checks and times one allocator on one trace in a child
+ * process, which sends its result back through a pipe.
+ */
+static void run_trace(allocator_t *a, trace_t *trace, result_t *result)
+{
+  int fds[2], status, i;
+  double t;
+  pid_t pid;
+
+  memset(result, 0, sizeof(result_t));
+  if (a->max_request != 0 && trace->max_size > a->max_request) {
+    result->status = RUN_SKIPPED;
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  if (pipe(fds) < 0 || (pid = fork()) < 0) {
+    perror("mdriver");
+    exit(1);
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    if (check_trace(a, trace, result) < 0)
+      result->status = RUN_INVALID;
+    else {
+      result->seconds = 1e30;
+      for (i = 0; i < repeats; i++) {
+        t = time_trace(a, trace);
+        if (t < result->seconds)
+          result->seconds = t;
+      }
+    }
+    fflush(stdout);
+    if (write(fds[1], result, sizeof(result_t)) != sizeof(result_t))
+      _exit(1);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], result, sizeof(result_t)) != sizeof(result_t))
+    result->status = RUN_CRASHED;
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    result->status = RUN_CRASHED;
+}
+
+/* Prints one "util Kops/s" cell of the table */
+static void print_cell(result_t *r, trace_t *trace)
+{
+  switch (r->status) {
+  case RUN_OK:
+    printf("  %5.1f%% %9.0f", r->peak_heap ? 100.0 * r->peak_payload / r->peak_heap : 0.0,
+           trace->num_ops / r->seconds / 1e3);
+    break;
+  case RUN_INVALID:
+    printf("  %16s", "invalid");
+    break;
+  case RUN_CRASHED:
+    printf("  %16s", "crashed");
+    break;
+  default:
+    printf("  %16s", "n/a");
+  }
+}
+
+static void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-chv] [-f <file>] [-t <dir>] [-a <allocators>] [-r <repeats>]\n", progname);
+  fprintf(stderr, "  -f <file>      replay only this trace\n");
+  fprintf(stderr, "  -t <dir>       replay every *.rep file in <dir> (default traces)\n");
+  fprintf(stderr, "  -a <list>      comma-separated allocators (default mm,solution,libc)\n");
+  fprintf(stderr, "  -r <repeats>   timed replays per trace (default 5)\n");
+  fprintf(stderr, "  -c             run mm_check after every operation of mm's first replay\n");
+  fprintf(stderr, "  -v             print peak heaps and mm's own reports\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  char *paths[MAX_TRACES], *dir = "traces", *list = strdup("mm,solution,libc"), *name;
+  allocator_t *chosen[MAX_ALLOCATORS];
+  result_t results[MAX_ALLOCATORS], *r;
+  trace_t *trace;
+  int num_traces = 0, num_chosen = 0, c, i, j, k;
+
+  /* Totals per allocator, over the traces that it ran correctly */
+  double util_sum[MAX_ALLOCATORS] = {0}, seconds[MAX_ALLOCATORS] = {0};
+  long ops[MAX_ALLOCATORS] = {0};
+  int valid[MAX_ALLOCATORS] = {0};
+
+  while ((c = getopt(argc, argv, "f:t:a:r:cvh")) != -1) {
+    switch (c) {
+    case 'f':
+      paths[0] = optarg;
+      num_traces = 1;
+      break;
+    case 't':
+      dir = optarg;
+      break;
+    case 'a':
+      list = optarg;
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    case 'c':
+      check_heap = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc || repeats < 1)
+    usage(argv[0]);
+
+  for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    for (k = 0; k < NUM_ALLOCATORS && strcmp(allocators[k].name, name); k++)
+      ;
+    if (k == NUM_ALLOCATORS || num_chosen == MAX_ALLOCATORS) {
+      fprintf(stderr, "unknown allocator %s\n", name);
+      usage(argv[0]);
+    }
+    chosen[num_chosen++] = &allocators[k];
+  }
+
+  if (num_traces == 0)
+    num_traces = find_traces(dir, paths);
+  if (num_traces == 0) {
+    fprintf(stderr, "no traces in %s\n", dir);
+    exit(1);
+  }
+
+  printf("%-20s %8s", "Trace", "Ops");
+  for (j = 0; j < num_chosen; j++)
+    printf("  %-16s", chosen[j]->name);
+  printf("\n%-20s %8s", "", "");
+  for (j = 0; j < num_chosen; j++)
+    printf("  %6s %9s", "util", "Kops/s");
+  printf("\n");
+
+  for (i = 0; i < num_traces; i++) {
+    trace = read_trace(paths[i]);
+    for (j = 0; j < num_chosen; j++)
+      run_trace(chosen[j], trace, &results[j]);
+
+    printf("%-20s %8d", trace->name, trace->num_ops);
+    for (j = 0; j < num_chosen; j++)
+      print_cell(&results[j], trace);
+    printf("\n");
+
+    for (j = 0; j < num_chosen; j++) {
+      r = &results[j];
+      if (r->status == RUN_INVALID)
+        fprintf(stderr, "  %s: %s\n", chosen[j]->name, r->error);
+      else if (verbose && r->status == RUN_OK)
+        printf("  %s: peak payload %zu KB, peak heap %zu KB\n", chosen[j]->name, r->peak_payload >> 10, r->peak_heap >> 10);
+
+      if (r->status == RUN_OK) {
+        util_sum[j] += r->peak_heap ? (double)r->peak_payload / r->peak_heap : 0.0;
+        seconds[j] += r->seconds;
+        ops[j] += trace->num_ops;
+        valid[j]++;
+      }
+    }
+    free_trace(trace);
+  }
+
+  /* Average utilization and overall throughput of the traces that ran */
+  printf("%-20s %8s", "Total", "");
+  for (j = 0; j < num_chosen; j++) {
+    if (valid[j] == 0)
+      printf("  %16s", "-");
+    else
+      printf("  %5.1f%% %9.0f", 100.0 * util_sum[j] / valid[j], ops[j] / seconds[j] / 1e3);
+  }
+  printf("\n");
+  for (j = 0; j < num_chosen; j++) {
+    if (valid[j] < num_traces)
+      printf("%s ran %d of %d traces\n", chosen[j]->name, valid[j], num_traces);
+  }
+
+  return 0;
+}
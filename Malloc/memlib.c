@@ -0,0 +1,110 @@
+/*
+ * memlib.c - Page-level memory for the malloc lab, backed by mmap.
+ *
+ * Every region is a private anonymous mapping. The counters are updated
+ * atomically because a thread-safe allocator may map memory under more
+ * than one lock at a time.
+ */
+#define _GNU_SOURCE /* for mremap */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "memlib.h"
+
+static size_t heap_bytes, heap_peak;
+
+/*
+ * Adds "delta" bytes (possibly negative) to the mapped total and raises the peak if needed.
+ */
+static void count(ptrdiff_t delta)
+{
+  size_t now = __atomic_add_fetch(&heap_bytes, (size_t)delta, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+
+  while (now > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Aborts if a size or address isn't a multiple of the page size, which
+ * mmap would either reject or silently round.
+ */
+static void check_aligned(const char *caller, void *addr, size_t size)
+{
+  size_t mask = mem_pagesize() - 1;
+
+  if (((size_t)addr & mask) != 0 || (size & mask) != 0 || size == 0) {
+    fprintf(stderr, "%s: %p, %zu bytes is not page-aligned\n", caller, addr, size);
+    abort();
+  }
+}
+
+void *mem_map(size_t size)
+{
+  void *addr;
+
+  check_aligned("mem_map", NULL, size);
+  addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED)
+    return NULL;
+  count(size);
+  return addr;
+}
+
+void mem_unmap(void *addr, size_t size)
+{
+  check_aligned("mem_unmap", addr, size);
+  if (munmap(addr, size) != 0) {
+    perror("mem_unmap");
+    abort();
+  }
+  count(-(ptrdiff_t)size);
+}
+
+void *mem_remap(void *addr, size_t old_size, size_t new_size)
+{
+#ifdef MREMAP_MAYMOVE
+  void *new_addr;
+
+  check_aligned("mem_remap", addr, old_size);
+  check_aligned("mem_remap", addr, new_size);
+  new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  if (new_addr == MAP_FAILED)
+    return NULL;
+  count((ptrdiff_t)new_size - (ptrdiff_t)old_size);
+  return new_addr;
+#else
+  (void)addr;
+  (void)old_size;
+  (void)new_size;
+  return NULL;
+#endif
+}
+
+size_t mem_pagesize(void)
+{
+  static size_t pagesize = 0;
+  size_t size = __atomic_load_n(&pagesize, __ATOMIC_RELAXED);
+
+  if (size == 0) {
+    size = sysconf(_SC_PAGESIZE);
+    __atomic_store_n(&pagesize, size, __ATOMIC_RELAXED);
+  }
+  return size;
+}
+
+size_t mem_heap_bytes(void)
+{
+  return __atomic_load_n(&heap_bytes, __ATOMIC_RELAXED);
+}
+
+size_t mem_heap_peak(void)
+{
+  return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+void mem_reset_stats(void)
+{
+  __atomic_store_n(&heap_peak, mem_heap_bytes(), __ATOMIC_RELAXED);
+}
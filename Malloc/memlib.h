@@ -0,0 +1,27 @@
+/*
+ * memlib.h - Page-level memory for the malloc lab.
+ *
+ * The allocators get all of their memory from these functions instead of
+ * calling mmap themselves, so that the driver can see how much memory
+ * each of them holds at any time.
+ */
+#ifndef _MEMLIB_H_
+#define _MEMLIB_H_
+
+#include <stddef.h>
+
+/* Maps "size" bytes (a multiple of the page size) of zeroed memory. Returns NULL on failure. */
+void *mem_map(size_t size);
+/* Unmaps a region from mem_map or mem_remap. "size" must be what was mapped. */
+void mem_unmap(void *addr, size_t size);
+/* Grows or shrinks a region to "new_size" bytes, moving it if it has to. Returns the region's new address, or NULL (the region is untouched). */
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+size_t mem_pagesize(void);
+
+/* Bytes that are mapped now, and the most that were mapped at once since the last mem_reset_stats() */
+size_t mem_heap_bytes(void);
+size_t mem_heap_peak(void);
+/* Lowers the peak to what is mapped now */
+void mem_reset_stats(void);
+
+#endif /* _MEMLIB_H_ */
@@ -1,28 +1,130 @@
-/* 
- * In this approach, I used an explicit-free list whose header is a struct containing an __int128_t size and two pointers to the previous and next 
- * structs in the explicit-free list. I used a best-fit method.
- * 
- * Since all sizes are 16-byte aligned, the lower 4 bits are always unused. Because of this, I used the bottom three blocks to indicate the allocation
- * of the previous, next, and current block in the free list. 
- * 
- * 
+/*
+ * In this approach, I used segregated explicit-free lists and a best-fit method.
+ *
+ * Every block starts with an 8-byte header that holds its size. Since all sizes are 16-byte aligned, the lower 4 bits are always unused.
+ * Because of this, I used them as flags:
+ *    ALLOCATED       - this block is allocated.
+ *    PREV_ALLOCATED  - the block physically before this one is allocated.
+ *    CHUNK_START     - this block is the first block of its chunk.
+ * An allocated block is nothing but that header and the payload. A free block also stores the prev and next pointers of its free list at the
+ * start of its payload and a footer with a copy of its size in its last 8 bytes, so the smallest block is 32 bytes.
+ *
+ * Headers sit 8 bytes below a multiple of 16 so that every payload is 16-byte aligned.
+ *
+ * mm_free finds both physical neighbours in constant time. The header just after the block belongs to the next block. If PREV_ALLOCATED is
+ * clear then the 8 bytes just before the block are the previous block's footer, which gives its size. The block merges with whichever of them
+ * are free.
+ *
+ * Each chunk returned by mem_map starts with a chunk_header that links it into the list of chunks and ends with an allocated header of size 0
+ * (the epilogue). Merging never crosses a chunk's edges because the first block of a chunk always has PREV_ALLOCATED set and the epilogue is
+ * allocated. When a chunk becomes completely free and it isn't the only one, it is handed back with mem_unmap, except that one such chunk is
+ * kept as a spare.
+ *
+ *
  * Some Performance improvements I made:
- *  - Minimum page size is 4096 bytes. Every time malloc is called, this number doubles unless the requested size is bigger. In which case, the 
- *    minumum page size will be changed to match the reqested size.
- *  - I Also keep track of biggest free block in the free list so that when the best fit method was called, it didn't waste time trying to find a 
- *      best fit that didn't exist.
- *  - Instead of adding and removing every time the explicit-free list changes, I made a function called "Replace_Free_Block".
- *    This function receives two pointers as parameters. The first is the item to remove and the second is the item to add. 
- *    Additionally, this method may receive NULL as one of the parameters to indicate that only one pointer is being added or removed.
- * 
- * 
+ *  - Free blocks under EXACT_CLASS_LIMIT (1024) bytes are kept in one list per 16-byte size instead of a single list, so every block in a list
+ *    fits equally well and Best_Fit just takes the first one.
+ *  - A bitmap records which of those lists are non-empty so that the next larger size is found with a single bit scan instead of walking empty
+ *    lists. This replaces the old "biggest free block" shortcut, which was never lowered when blocks were split.
+ *  - Bigger free blocks live in a red-black tree keyed by size (free_tree). Blocks of a size that is already in the tree hang off its node in a
+ *    list of twins, so the tree only grows with the number of distinct sizes. Best_Fit finds the smallest block that fits in O(log n) steps
+ *    however many large blocks there are, and the tree stays exact as blocks are split and merged.
+ *  - The heap grows geometrically. Each new chunk maps at least grow_size bytes, which doubles from MM_GROW_MIN up to MM_GROW_MAX with every
+ *    chunk and halves whenever one is unmapped, so a burst of allocations costs a few calls to mem_map instead of one per page. New pages
+ *    that land right next to an existing chunk are merged into it, so free space can span both. Keeping a spare empty chunk stops a heap
+ *    that shrinks and grows around the same size from mapping and unmapping a chunk every time. Its pages are released like any other
+ *    long-idle free block.
+ *  - The per-block overhead of an allocated block is 8 bytes. A 16-byte malloc takes a 32-byte block.
+ *  - Requests of up to SLAB_MAX_OBJECT bytes don't use blocks at all. They come from slabs: pages from mem_map that hold objects of a single
+ *    size class with no header. A slab_header at the start of the page keeps an embedded free list of its freed objects and a pointer to the
+ *    part of the page that was never handed out. mm_free masks the address down to the page to find the slab. A three-level page map with one
+ *    byte per page says which pages are slabs, so a heap block is never mistaken for a slab object. The first object of a slab starts at a
+ *    multiple of the largest power of two that divides the object size, so 64-byte objects fill whole cache lines.
+ *  - Slabs of objects up to TINY_MAX_OBJECT bytes, where most allocations are, track their objects with a bitmap in the slab header instead
+ *    of a free list: one 64-bit word per run of 64 objects, with the runs starting on cache lines. slab_malloc takes the first clear bit
+ *    of the first run that isn't full with a single __builtin_ctzll, and slab_free clears one bit. Neither touches the object itself.
+ *  - mm_memalign serves alignments stricter than ALIGNMENT without mapping more than it needs. Small requests take a slab class whose objects
+ *    are a multiple of the alignment, and there are extra slab classes for the multiples of CACHE_LINE up to ALIGNED_SLAB_MAX just for them.
+ *    Bigger ones are carved out of a free block at its first aligned address and the space before that goes back to the free lists.
+ *  - mm_realloc avoids copying whenever it can. A block shrinks by splitting off its tail, and grows by absorbing the free block after it.
+ *    A block of at least MREMAP_THRESHOLD bytes that has its chunk to itself grows by remapping the whole chunk with mem_remap (mremap), which
+ *    moves pages instead of bytes.
+ *  - Requests of at least MM_LARGE_THRESHOLD bytes bypass the heap. Each gets a mem_map region of its own with a large_header in front of the
+ *    payload (the LARGE flag in its size word tells mm_free), and goes straight back with mem_unmap when it is freed. mm_realloc resizes them
+ *    with mem_remap. They are linked into a list of their own so that mm_init can unmap them too. mm_memalign gives huge aligned requests the
+ *    same kind of region, with the payload placed at the first aligned address.
+ *  - mm_malloc_batch and mm_free_batch take each lock once per batch instead of once per block. Heap requests are laid out back to back in a
+ *    single free block, and mm_free_batch frees blocks that sit back to back as one, so the free lists are touched once per run of blocks.
+ *    mm_free_sized uses the size the block was allocated with to tell a slab object from a block, which saves the page map lookup of mm_free.
+ *  - Free blocks that span whole pages hand those pages back to the kernel with madvise(MADV_DONTNEED) once they have been free for
+ *    MM_RELEASE_IDLE frees of the heap. Every RELEASE_SCAN_INTERVAL frees the free tree is walked from RELEASE_MIN_BLOCK up for such blocks.
+ *    Each remembers when it was freed just after its tree_node, and is marked RELEASED so it isn't released twice. The memory stays mapped,
+ *    so the block can be handed out again as usual and the kernel supplies zeroed pages when it is touched.
+ *  - mm_calloc doesn't zero memory that is still zero from mem_map. Every free block in the free tree records where the part of it that
+ *    has never been written starts (FRESH_FROM). Splitting a block passes the mark on to the remainder and merging keeps the mark of the
+ *    block on the right, so a new chunk stays untouched however it is carved up. A block allocated from there is only zeroed below the
+ *    mark. Huge requests get fresh pages of their own and aren't zeroed at all.
+ *  - Freed blocks under EXACT_CLASS_LIMIT don't merge right away. They wait, still marked allocated, in a quick list of their size, and
+ *    heap_malloc takes the most recently freed block of the exact size before it searches the free lists. A program that frees and allocates
+ *    objects of the same sizes over and over then skips the merge and the split that undoes it. The quick lists are all merged once they
+ *    hold more than MM_QUICK_LIMIT bytes, or when an allocation finds no free block that fits. -DMM_QUICK_LIMIT=0 frees blocks eagerly.
+ *
+ *
+ * mm_check walks every chunk, slab and large block and checks the headers, footers and flags of every block, that no two free blocks are
+ * next to each other, and that the free lists and the free tree hold exactly the free blocks. mm_report_fragmentation prints a histogram of
+ * the free blocks, how much of the free space is in the largest one, and how full each chunk and slab class is. Both can be called at any
+ * time. Compiling with -DMM_DEBUG also makes mm_malloc and mm_free run mm_check every MM_CHECK_INTERVAL calls and abort if it fails.
+ *
+ * Compiling with -DMM_PROFILE samples allocations to show which call sites the heap grows from. A per-thread countdown of bytes picks about
+ * one allocation every MM_PROFILE_RATE bytes (the gaps are drawn from an exponential distribution, so every byte is equally likely to be
+ * picked). A picked allocation records its call stack in a fixed table of call sites and its address in a table of live samples, both
+ * filled with compare-and-swap so that sampling takes no lock. mm_free looks a block up in the live samples only when a small counting
+ * filter says the address may have been sampled, so the common path costs a countdown in mm_malloc and one byte load in mm_free.
+ * mm_report_profile prints the call sites with the estimated live and total bytes of each, and mm_dump_profile writes them in the heap
+ * profile format of pprof.
+ *
+ *
+ * Compiling with -DMM_THREAD_SAFE makes the package safe to call from many threads at once. Everything above becomes the central heap and is
+ * guarded by one lock. Each thread also gets a thread_cache that keeps up to TCACHE_LIMIT free blocks of every size up to TCACHE_MAX_BLOCK,
+ * so most small mallocs and frees never touch the lock:
+ *  - An empty bin is refilled with TCACHE_BATCH blocks under a single lock acquisition, and a full bin gives TCACHE_BATCH blocks back the
+ *    same way.
+ *  - Blocks handed out by a cache carry its id in the top bits of their header (OWNER_SHIFT). A thread that frees a block owned by another
+ *    cache pushes it onto that cache's remote_frees stack with one compare-and-swap. The owner takes the whole stack with one atomic exchange
+ *    the next time one of its bins runs empty, and keeps all of it even if a bin goes past TCACHE_LIMIT.
+ *  - When a thread exits its cache gives everything back to the central heap and is left for the next new thread to reuse. Until then,
+ *    blocks and slab objects that other threads free into it go straight back to the central heap and the slabs.
+ *  - Slab objects have no header to hold an owner, so each cache also keeps a bin of free objects per slab class. Slab bins refill from and
+ *    flush to the slabs in batches of TCACHE_BATCH under a lock of their own. A refill makes the cache the owner of the slabs it took
+ *    objects from. A thread that frees an object of a slab owned by another cache pushes it onto that cache's remote_slab_frees stack, and
+ *    the owner drains the stack into its bins before it next takes the slab lock. So when one thread allocates and another frees, as a
+ *    server's accept thread and its workers do, the objects go round between them without either one taking a lock.
+ *  - Both locks are held across fork, so the child gets a consistent heap. The caches of threads that the child doesn't have are handed to
+ *    its new threads.
+ *
+ *
  * @author: Shem Snow u1058151
  */
+#ifdef MM_PROFILE
+#define _GNU_SOURCE // for dladdr
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#ifdef MM_THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef MM_PROFILE
+#include <math.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <link.h>
+#endif
 #include "mm.h"
 #include "memlib.h"
 
@@ -34,427 +136,3737 @@
 /* rounds up to the nearest multiple of mem_pagesize() */
 #define PAGE_ALIGN(size) (((size) + (mem_pagesize()-1)) & ~(mem_pagesize()-1))
 
+/* Free blocks smaller than this get one size class per multiple of ALIGNMENT. Bigger ones go in the free tree. */
+#define EXACT_CLASS_LIMIT 1024
+#define NUM_SIZE_CLASSES (EXACT_CLASS_LIMIT / ALIGNMENT)
+/* One bit per size class that says whether its list is non-empty */
+#define CLASS_WORDS ((NUM_SIZE_CLASSES + 63) / 64)
+
+/* Freed blocks under EXACT_CLASS_LIMIT wait in a quick list of their size without being merged, until the quick lists hold more than this
+ * many bytes or an allocation finds no free block. 0 merges every block as soon as it is freed. */
+#ifndef MM_QUICK_LIMIT
+#define MM_QUICK_LIMIT (64 * 1024)
+#endif
+
+/* Flags in the low bits of a header */
+#define ALLOCATED      0x1
+#define PREV_ALLOCATED 0x2
+#define CHUNK_START    0x4
+#define LARGE          0x8 /* a block with a mem_map region of its own */
+#define FLAGS          0xF
+
+/* The top bits of an allocated header hold the id of the thread cache that handed it out (0 for none) */
+#define OWNER_SHIFT 48
+#define SIZE_MASK ((((size_t)1 << OWNER_SHIFT) - 1) & ~(size_t)FLAGS)
+
 typedef struct node_header {
-  __int128_t size; // 16-byte
-  struct node_header* prev; // 8-byte pointer
-  struct node_header* next; // 8-byte pointer
-} node_header; // 32 bytes is 16-byte aligned
+  size_t size; // 8-byte size and flags. This is all an allocated block has.
+  struct node_header* prev; // 8-byte pointer, only in free blocks
+  struct node_header* next; // 8-byte pointer, only in free blocks
+} node_header;
+
+/* A free block of at least EXACT_CLASS_LIMIT bytes belongs to the free tree instead */
+typedef struct tree_node {
+  size_t size; // 8-byte size and flags, as in node_header
+  struct tree_node* left;
+  struct tree_node* right;
+  struct tree_node* parent;
+  size_t red;
+  struct tree_node* next_twin; // the other free blocks of this size
+  struct tree_node* prev_twin; // NULL for the block that is in the tree itself
+} tree_node;
+
+typedef struct node_footer {
+  size_t size; // 8-byte copy of a free block's size
+} node_footer;
+
+typedef struct chunk_header {
+  struct chunk_header* prev; // 8-byte pointer
+  struct chunk_header* next; // 8-byte pointer
+  size_t size;               // bytes given by mem_map
+} chunk_header; // 24 bytes so the first payload is 16-byte aligned
+
+#define HEADER_SIZE sizeof(size_t)
+/* A free block needs room for its header, its two pointers and its footer */
+#define MIN_BLOCK_SIZE (sizeof(node_header) + sizeof(node_footer))
+
+#define BLOCK_SIZE(block) ((block)->size & SIZE_MASK)
+#define PAYLOAD(block) ((void*) ((char*)(block) + HEADER_SIZE))
+#define HEADER(ptr) ((node_header*) ((char*)(ptr) - HEADER_SIZE))
+/* The footer of a free "block", the header of the block after it, and the footer of the block before it (only valid if that block is free) */
+#define FOOTER(block) ((node_footer*) ((char*)(block) + BLOCK_SIZE(block)) - 1)
+#define NEXT_BLOCK(block) ((node_header*) ((char*)(block) + BLOCK_SIZE(block)))
+#define PREV_FOOTER(block) ((node_footer*) (block) - 1)
+
+/* Bytes of a chunk that can't be used for blocks: the chunk header and the epilogue header */
+#define CHUNK_OVERHEAD (sizeof(chunk_header) + HEADER_SIZE)
+
+/* A new chunk maps at least grow_size bytes. That starts at MM_GROW_MIN, doubles with every chunk up to MM_GROW_MAX, and halves again
+ * whenever a chunk is unmapped. */
+#ifndef MM_GROW_MIN
+#define MM_GROW_MIN (4 * 1024)
+#endif
+#ifndef MM_GROW_MAX
+#define MM_GROW_MAX (256 * 1024)
+#endif
+/* A request that is more than 1/GROW_PAD_LIMIT of grow_size maps only what it needs. Whatever a chunk has left over after it may end up
+ * stuck between allocated blocks, and for those requests that would be a large share of the chunk. */
+#define GROW_PAD_LIMIT 4
+
+/* mm_realloc grows blocks at least this big that fill their chunk with mem_remap */
+#define MREMAP_THRESHOLD (256 * 1024)
+
+/* Requests of at least this many bytes are mapped on their own instead of coming from the heap */
+#ifndef MM_LARGE_THRESHOLD
+#define MM_LARGE_THRESHOLD (128 * 1024)
+#endif
+
+typedef struct large_header {
+  struct large_header* prev; // 8-byte pointer, in the list of large blocks
+  struct large_header* next; // 8-byte pointer
+  void* mapping;             // start of the region from mem_map, which is before the header if the payload had to be aligned
+  size_t size;               // bytes mapped, with ALLOCATED and LARGE. Sits where a node_header's size would.
+} large_header; // 32 bytes so the payload is 16-byte aligned
+
+#define LARGE_HEADER(ptr) ((large_header*)(ptr) - 1)
+/* Bytes from the payload of a large block to the end of its region */
+#define LARGE_USABLE(header) ((size_t) ((char*)(header)->mapping + BLOCK_SIZE(header) - (char*)((header) + 1)))
+
+/* mm_malloc_batch carves consecutive heap requests out of one free block, up to this many bytes at a time */
+#define BATCH_RUN_LIMIT (64 * 1024)
+#define IS_HEAP_REQUEST(size) ((size) > SLAB_MAX_OBJECT && (size) < MM_LARGE_THRESHOLD)
+/* mm_free_batch sorts this many pointers at a time by where they go */
+#define BATCH_CHUNK 256
+/* Where mm_free_batch sends a pointer */
+#define FREE_NOTHING 0
+#define FREE_SLAB    1
+#define FREE_HEAP    2
+#define FREE_OTHER   3 /* a large block, or a block that goes back to a thread cache */
+
+/* How many calls to mm_malloc and mm_free a -DMM_DEBUG build makes between two runs of mm_check */
+#ifndef MM_CHECK_INTERVAL
+#define MM_CHECK_INTERVAL 1024
+#endif
+
+/* How many heap frees a free block must sit through before its whole pages are released, and how often to look for such blocks */
+#ifndef MM_RELEASE_IDLE
+#define MM_RELEASE_IDLE 1024
+#endif
+#define RELEASE_SCAN_INTERVAL 256
+/* Only free blocks this big remember when they were freed. They are all in the free tree, and the value of release_clock goes right after
+ * their tree_node. */
+#define RELEASE_MIN_BLOCK (2 * PAGE_SIZE)
+#define IDLE_SINCE(block) (*(size_t*) ((tree_node*)(block) + 1))
+#define RELEASED ((size_t)-1)
+
+/* Every free block in the free tree knows where the part of it that is still zero from mem_map starts, right after its idle stamp. From
+ * there up to its footer it has never been written. */
+#define FRESH_FROM(block) (((char**) ((tree_node*)(block) + 1))[1])
+/* What a free block of the tree may write at its start: its header, its tree links, its idle stamp and FRESH_FROM */
+#define FREE_METADATA (sizeof(tree_node) + 2 * sizeof(size_t))
+
+/* Requests up to SLAB_MAX_OBJECT bytes come from slabs, one class per multiple of ALIGNMENT */
+#define SLAB_MAX_OBJECT 128
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / ALIGNMENT)
+#define SLAB_CLASS(size) (((size) - 1) / ALIGNMENT)
+
+/* mm_memalign has slab classes of its own for the multiples of CACHE_LINE above SLAB_MAX_OBJECT, up to ALIGNED_SLAB_MAX bytes. They
+ * come after the classes of mm_malloc, which never uses them. */
+#define CACHE_LINE 64
+#define ALIGNED_SLAB_MAX 512
+#define ALL_SLAB_CLASSES (SLAB_CLASSES + (ALIGNED_SLAB_MAX - SLAB_MAX_OBJECT) / CACHE_LINE)
+#define ALIGNED_SLAB_CLASS(size) (SLAB_CLASSES + ((size) - SLAB_MAX_OBJECT - 1) / CACHE_LINE)
+#define SLAB_OBJECT_SIZE(class) \
+  (((class) < SLAB_CLASSES)? ((class) + 1) * ALIGNMENT: SLAB_MAX_OBJECT + ((class) - SLAB_CLASSES + 1) * CACHE_LINE)
+
+/* Slabs of objects up to TINY_MAX_OBJECT bytes keep a bitmap of the objects in use instead of a free list. Each word of it covers a run of
+ * 64 objects, so a free object is found with one bit scan and freeing one clears a bit without touching the object. */
+#define TINY_MAX_OBJECT 64
+#define RUN_OBJECTS 64
+
+typedef struct slab_header {
+  struct slab_header* prev; // 8-byte pointer, in the partial or full list of its class
+  struct slab_header* next; // 8-byte pointer
+  void* free_objects;       // freed objects, linked through their first 8 bytes (not in tiny slabs)
+  char* unused;             // objects from here to the end of the slab were never handed out (not in tiny slabs)
+  unsigned int object_size;
+  unsigned int in_use;
+  unsigned int capacity;
+  unsigned int size_class;
+  unsigned int runs;        // words in "occupied", 0 for a slab with a free list
+  unsigned int first_free;  // every run before this one is full
+  unsigned int owner;       // id of the thread cache that last refilled from this slab, 0 for none
+  uint64_t occupied[];      // one bit per object of a tiny slab, set while it is in use
+} slab_header; // 64 bytes and the bitmap, rounded up to the alignment of the first object
+
+/* Objects are aligned to the largest power of two that divides their size, because the first one starts at a multiple of it. That costs
+ * no capacity for any class, and it makes a 64-byte object a whole cache line. The objects of a tiny slab start on a cache line, so every
+ * run does too. */
+#define OBJECT_ALIGNMENT(size) ((size) & -(size))
+#define SLAB_ALIGNMENT(size) (((size) <= TINY_MAX_OBJECT)? CACHE_LINE: OBJECT_ALIGNMENT(size))
+#define SLAB_OBJECTS(slab) \
+  ((char*)(slab) + ((sizeof(slab_header) + (slab)->runs * sizeof(uint64_t) + SLAB_ALIGNMENT((slab)->object_size) - 1) & \
+                    ~(SLAB_ALIGNMENT((slab)->object_size) - 1)))
+
+typedef struct slab_class {
+  slab_header* partial; // slabs with at least one free object
+  slab_header* full;    // slabs with none
+  int empty;            // partial slabs with no object in use
+} slab_class;
+
+/* What each page of memory is used for, as recorded in the page map */
+#define PAGE_HEAP 0 /* a chunk of the block heap, or not ours */
+#define PAGE_SLAB 1
+
+/*
+ * The page map splits a page number into a root index, a middle index and a leaf index. The root is a static array of pointers to middle
+ * nodes of 2^PAGEMAP_MID_BITS pointers, which point to leaves of 2^PAGEMAP_LEAF_BITS bytes. Both are one 4K page, so a heap that only
+ * touches a few megabytes maps 8K of page map instead of a whole flat leaf. Together they cover 48-bit addresses with 4K pages.
+ */
+#define PAGEMAP_ROOT_BITS 15
+#define PAGEMAP_MID_BITS 9
+#define PAGEMAP_LEAF_BITS 12
+#define PAGEMAP_INDEX(page, shift, bits) (((page) >> (shift)) & ((1UL << (bits)) - 1))
+
+#ifdef MM_PROFILE
+/* Bytes allocated per sample on average; the environment variable of the same name overrides it at mm_init */
+#ifndef MM_PROFILE_RATE
+#define MM_PROFILE_RATE (512 * 1024)
+#endif
+/* Deepest call stack a call site keeps, and how many call sites and live samples fit in the tables */
+#define PROFILE_DEPTH 16
+/* Most frames of the allocator itself that are stripped from the top of a sampled call stack */
+#define PROFILE_SKIP 8
+#define PROFILE_SITES 2048
+#define PROFILE_SAMPLES 16384
+/* Slots that are tried for an address or a call stack before giving up; a sample that fits nowhere is dropped */
+#define PROFILE_PROBES 64
+#define PROFILE_FILTER_SIZE 65536
+/* Call sites shown by mm_report_profile */
+#define PROFILE_REPORT_SITES 20
+
+#define PROFILE_HASH(ptr) (((uintptr_t)(ptr) >> 4) * 0x9E3779B97F4A7C15UL)
+#define PROFILE_FILTER(ptr) profile_filter[PROFILE_HASH(ptr) >> 48]
+#define FREED_SAMPLE ((void*)1)
+
+/* Everything sampled from one call stack. "hash" is 0 while the slot is unused, and the stack is valid once "ready" is set. */
+typedef struct profile_site {
+  uint64_t hash;
+  int ready;
+  int depth;
+  void* stack[PROFILE_DEPTH];
+  size_t samples, bytes;            // every sample so far
+  size_t live_samples, live_bytes;  // the samples that haven't been freed
+} profile_site;
+
+/* A sampled block that is still allocated. "ptr" is NULL for a slot that was never used and FREED_SAMPLE for one that can be reused. */
+typedef struct profile_sample {
+  void* ptr;
+  profile_site* site;
+  size_t size;
+} profile_sample;
+
+#ifdef MM_THREAD_SAFE
+#define PROFILE_LOCAL __thread
+#else
+#define PROFILE_LOCAL
+#endif
+#define PROFILE_TICK(size) ((profile_countdown -= (long)(size)) < 0 && !profiling) // counts "size" bytes; true when a sample is due
+#define PROFILE_FREE(ptr) do { if(__atomic_load_n(&PROFILE_FILTER(ptr), __ATOMIC_RELAXED) != 0) Profile_Free(ptr); } while(0)
+#define PROFILE_MOVE(old_ptr, new_ptr) do { if((old_ptr) != (new_ptr)) Profile_Move(old_ptr, new_ptr); } while(0)
+#else
+#define PROFILE_FREE(ptr)
+#define PROFILE_MOVE(old_ptr, new_ptr)
+#endif
+
+#ifdef MM_THREAD_SAFE
+/* Blocks up to this size are cached per thread, one bin per multiple of ALIGNMENT */
+#define TCACHE_MAX_BLOCK 1024
+#define TCACHE_BINS (TCACHE_MAX_BLOCK / ALIGNMENT + 1)
+/* Most blocks a bin holds before it gives some back, and how many blocks move per refill or flush */
+#define TCACHE_LIMIT 64
+#define TCACHE_BATCH 32
+/* Most thread caches that can exist at once; ids must fit above OWNER_SHIFT */
+#define MAX_THREAD_CACHES 4096
+
+typedef struct thread_cache {
+  node_header* bins[TCACHE_BINS]; // cached blocks, linked through their "next" field
+  int counts[TCACHE_BINS];
+  node_header* remote_frees;      // blocks of this cache freed by other threads
+  void* remote_slab_frees;        // objects of slabs owned by this cache that other threads freed, linked through their first 8 bytes
+  unsigned long generation;       // heap_generation when the bins were last valid
+  void* slab_bins[ALL_SLAB_CLASSES]; // free slab objects, linked through their first 8 bytes
+  int slab_counts[ALL_SLAB_CLASSES];
+  size_t id;
+  int in_use;
+} thread_cache;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Every acquisition is counted, and so is every time the lock was held by another thread and the caller had to block */
+#define LOCK(lock) do {                                                                                  \
+    ADD_STAT(lock_acquisitions, 1);                                                                      \
+    if(pthread_mutex_trylock(lock) != 0) { ADD_STAT(lock_waits, 1); pthread_mutex_lock(lock); }          \
+  } while(0)
+#define LOCK_HEAP() LOCK(&heap_lock)
+#define UNLOCK_HEAP() pthread_mutex_unlock(&heap_lock)
+#define LOCK_SLABS() LOCK(&slab_lock)
+#define UNLOCK_SLABS() pthread_mutex_unlock(&slab_lock)
+
+/* Counters shared by the heap and the slabs, which have different locks */
+#define ADD_STAT(stat, n) __atomic_add_fetch(&(stat), (n), __ATOMIC_RELAXED)
+
+/*
+ * The central heap flips PREV_ALLOCATED in the header of an allocated block whenever the block before it changes, while the block's owner
+ * may be reading that header without the lock. Those two kinds of access are atomic; the size and owner bits never change under either.
+ */
+#define LOAD_HEADER(block) __atomic_load_n(&(block)->size, __ATOMIC_RELAXED)
+#define SET_FLAG(block, flag) __atomic_fetch_or(&(block)->size, (flag), __ATOMIC_RELAXED)
+#define CLEAR_FLAG(block, flag) __atomic_fetch_and(&(block)->size, ~(size_t)(flag), __ATOMIC_RELAXED)
+#define OWNER(block) (LOAD_HEADER(block) >> OWNER_SHIFT)
+#else
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#define LOCK_SLABS()
+#define UNLOCK_SLABS()
+
+#define ADD_STAT(stat, n) ((stat) += (n))
+
+#define LOAD_HEADER(block) ((block)->size)
+#define SET_FLAG(block, flag) ((block)->size |= (flag))
+#define CLEAR_FLAG(block, flag) ((block)->size &= ~(size_t)(flag))
+#endif
 
 
 /* ================================================== Global Variables ================================================================*/
-const int PAGE_SIZE = 4096; 
-struct node_header* free_list_head; // free_list_tail is the one whose "next" is null.
+const int PAGE_SIZE = 4096;
+static struct node_header* free_lists[NUM_SIZE_CLASSES]; // The tail of each list is the one whose "next" is null.
+static unsigned long non_empty_classes[CLASS_WORDS];
+static tree_node* free_tree; // root of the tree of bigger free blocks
 static size_t free_list_size;
 
-static size_t biggest_free_block_size; // Any time malloc requestes something bigger than this then don't bother finding the best fit
+static node_header* quick_lists[NUM_SIZE_CLASSES]; // freed blocks that are still marked allocated, linked through "next"
+static size_t quick_size, quick_count, quick_consolidations;
+
+static struct chunk_header* chunk_list; // every chunk that is currently mapped
+static size_t chunk_count;
+static size_t grow_size; // the least that the next chunk maps
+static chunk_header* spare_chunk; // a chunk that was kept when it became completely free, or NULL
+static size_t chunks_mapped, chunks_merged, chunks_unmapped;
+
+static slab_class slab_classes[ALL_SLAB_CLASSES];
+static size_t slab_size; // one page
+static size_t slab_count;
+
+static unsigned char** page_map[1UL << PAGEMAP_ROOT_BITS]; // nodes are mapped the first time one of their pages is marked
+static int page_shift;
+
+// Counters for mm_report_utilization(). heap_size and payload_size include the slabs.
+static size_t heap_size, peak_heap_size;
+static size_t allocated_size, allocated_blocks;
+static size_t payload_size, peak_payload_size;
+
+static large_header* large_list; // every block that has a region of its own
+static size_t large_count, large_size;
+
+// Heap frees so far, and what madvise has handed back
+static size_t release_clock;
+static size_t released_size, release_count;
+
+// Times that a thread took the heap lock or the slab lock, and times that it had to wait for it
+static size_t lock_acquisitions, lock_waits;
+
+// Where mm_check prints the problems it finds, and how many it has found
+static FILE* check_out;
+static int check_errors;
+#ifdef MM_DEBUG
+static size_t check_clock;
+#endif
+
+#ifdef MM_PROFILE
+static profile_site profile_sites[PROFILE_SITES];
+static profile_sample profile_samples[PROFILE_SAMPLES];
+static unsigned short profile_filter[PROFILE_FILTER_SIZE]; // live samples whose address hashes to each entry
+static size_t profile_rate = MM_PROFILE_RATE;
+static size_t profile_dropped;
+static PROFILE_LOCAL long profile_countdown; // bytes until the next sample
+static PROFILE_LOCAL uint64_t profile_random; // 0 until this thread's first allocation
+static PROFILE_LOCAL int profiling;           // set while a sample is taken, so that the profiler's own allocations aren't sampled
+#endif
+
+#ifdef MM_THREAD_SAFE
+static thread_cache* caches[MAX_THREAD_CACHES]; // indexed by id; id 0 is never used
+static size_t cache_count;
+static unsigned long heap_generation; // bumped by mm_init so caches drop blocks of an old heap
+static __thread thread_cache* my_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+#endif
 
 /* ==================================================== Helper Methods ==============================================================*/
-struct node_header* Best_Fit(size_t requested_size);
-static struct node_header* coalesce(node_header* new_free_block);
-void Replace_Free_Block(node_header* old, node_header* new);
-void* Allocate_Block(node_header* destination, size_t size);
-
-static void extend_free_list(int pg_size);
-
-// Debugging methods
-// void printstatus();
-// void print_free_list();
+static int Size_Class(size_t size);
+static struct node_header* Best_Fit(size_t requested_size);
+static void Insert_Free_Block(node_header* block);
+static void Remove_Free_Block(node_header* block);
+static void Tree_Insert(tree_node* node);
+static void Tree_Remove(tree_node* node);
+static tree_node* Tree_Best_Fit(size_t size);
+static tree_node* Tree_Next(tree_node* node);
+static void* Allocate_Block(node_header* destination, size_t size);
+static node_header* coalesce(node_header* block);
+static void Set_Free(node_header* block, size_t size, size_t flags);
+
+static node_header* extend_free_list(size_t requested_space);
+static node_header* Merge_Chunk(char* region, size_t size);
+static int Chunk_Is_Empty(chunk_header* chunk);
+
+static void* heap_malloc(size_t size_of_new_block);
+static void* heap_calloc(size_t size_of_new_block, size_t bytes, size_t* dirty);
+static node_header* Find_Fit(size_t size_of_new_block);
+static void* Quick_Malloc(size_t size_of_new_block);
+static char* Fresh_Of(node_header* block);
+static void Set_Fresh(node_header* block, char* fresh);
+static int heap_malloc_run(const size_t* sizes, void** out, size_t start, size_t end, size_t total);
+static void* heap_memalign(size_t size_of_new_block, size_t alignment);
+static size_t Aligned_Offset(node_header* block, size_t size, size_t alignment);
+static void heap_free(node_header* block);
+static void heap_free_run(node_header* block, size_t size, size_t count);
+static void Quick_Free(node_header* block);
+static size_t Consolidate_Quick_Lists(void);
+static void Free_Object(void* object);
+static void Free_Block(node_header* block);
+static void Raise_Peak(size_t* peak, size_t value);
+static void Release_Idle_Pages(void);
+
+static void* large_malloc(size_t size, size_t alignment);
+static void large_free(large_header* header);
+static void* large_realloc(large_header* header, size_t size);
+
+static void* heap_realloc(node_header* block, size_t size);
+static void Shrink_Block(node_header* block, size_t new_size);
+static void* Remap_Chunk(node_header* block, size_t new_size);
+
+static void* slab_malloc(int size_class);
+static void slab_free(void* object);
+static void Release_Slabs(void);
+static int Page_Kind(void* ptr);
+static int Set_Page_Kind(void* start, size_t size, int kind);
+static void* Page_Map_Node(void** slot, size_t size);
+
+static void Check_Failed(const char* format, ...);
+static void Check_Chunks(size_t* free_blocks);
+static size_t Check_Free_Lists(void);
+static void Check_Quick_Lists(void);
+static void Check_Fresh(node_header* block);
+static size_t Check_Tree(tree_node* node, tree_node* parent, size_t low, size_t high, int* black_height);
+static void Check_Free_Entry(node_header* block);
+static chunk_header* Find_Chunk(void* ptr);
+static void Check_Slabs(void);
+static void Check_Tiny_Slab(slab_header* slab);
+static void Check_Large_Blocks(void);
+#ifdef MM_DEBUG
+static void Debug_Check(void);
+#endif
+
+#ifdef MM_PROFILE
+static void* Sampled_Malloc(size_t size);
+static void* Profile_Allocation(void* payload, size_t size);
+static long Next_Sample_Gap(void);
+static profile_site* Find_Site(void** stack, int depth);
+static void Add_Sample(void* ptr, profile_site* site, size_t size);
+static profile_site* Take_Sample(void* ptr, size_t* size);
+static void Profile_Free(void* ptr);
+static void Profile_Move(void* old_ptr, void* new_ptr);
+static void Reset_Profile(void);
+static double Sample_Scale(size_t samples, size_t bytes);
+#endif
+
+#ifdef MM_THREAD_SAFE
+static thread_cache* Get_Cache(void);
+static void* Cache_Malloc(thread_cache* cache, size_t size_of_new_block);
+static void Cache_Free(node_header* block);
+static void* Cache_Slab_Malloc(thread_cache* cache, int size_class);
+static void Cache_Slab_Free(void* object);
+static void Register_Fork_Handlers(void);
+#endif
 
 /* ==================================================== Functions to Implement ==============================================================*/
 
-/* 
+/*
  * mm_init - initialize the malloc package.
- * 
+ *
  * Resets the implementation into its initial state in each case (because the testing program may call it multiple times even though only one init is called per run).
  * Performs any necessary initializations such as initial heap area.
- * 
+ *
  * @returns -1 if an error occured. 0 otherwise.
  */
 int mm_init(void) {
 
-  // Initialize the free list to be empty (this program may be called after another)
-  free_list_head = NULL;
+#ifdef MM_THREAD_SAFE
+  pthread_once(&fork_once, Register_Fork_Handlers);
+#endif
+
+  LOCK_SLABS();
+  Release_Slabs();
+  slab_size = mem_pagesize();
+  page_shift = __builtin_ctzl(slab_size);
+  UNLOCK_SLABS();
+
+  LOCK_HEAP();
+
+  // Give back every chunk of a previous run.
+  while(chunk_list != NULL) {
+    chunk_header* chunk = chunk_list;
+    chunk_list = chunk->next;
+    mem_unmap(chunk, chunk->size);
+  }
+  chunk_count = 0;
+  grow_size = MM_GROW_MIN;
+  spare_chunk = NULL;
+  chunks_mapped = chunks_merged = chunks_unmapped = 0;
+
+  while(large_list != NULL) {
+    large_header* header = large_list;
+    large_list = header->next;
+    mem_unmap(header->mapping, BLOCK_SIZE(header));
+  }
+  large_count = large_size = 0;
+
+  // Initialize the free lists to be empty (this program may be called after another)
+  memset(free_lists, 0, sizeof(free_lists));
+  memset(non_empty_classes, 0, sizeof(non_empty_classes));
+  free_tree = NULL;
   free_list_size = 0;
-  biggest_free_block_size = 0;
+  memset(quick_lists, 0, sizeof(quick_lists));
+  quick_size = quick_count = quick_consolidations = 0;
+
+  heap_size = peak_heap_size = 0;
+  allocated_size = allocated_blocks = 0;
+  payload_size = peak_payload_size = 0;
+  release_clock = released_size = release_count = 0;
+  lock_acquisitions = lock_waits = 0;
+
+#ifdef MM_PROFILE
+  Reset_Profile();
+#endif
+
+#ifdef MM_THREAD_SAFE
+  // Blocks that thread caches still hold belonged to the old chunks.
+  heap_generation++;
+#endif
 
   // Initialize the heap area into its original state (a single page of the minimum size).
-  extend_free_list(PAGE_SIZE);
+  node_header* first_block = extend_free_list(PAGE_SIZE);
 
-  return 0;
+  UNLOCK_HEAP();
+  return (first_block == NULL)? -1: 0;
 }
 
-/* 
- * mm_malloc - Allocate a block by using bytes from current_avail, grabbing a new page if necessary.
- * 
+/*
+ * mm_malloc - Allocate a block from the best-fitting free block, grabbing a new page if necessary.
+ *
  * The entire allocated block should lie within the heap region and should not overlap with any other allocated block.
- * 
- * 
- * @returns a 16-byte-aligned pointer to an allocated block payload of at least "size" bytes (less than 2^32). 
+ *
+ *
+ * @returns a 16-byte-aligned pointer to an allocated block payload of at least "size" bytes (less than 2^32).
  */
 void *mm_malloc(size_t size_of_new_data) {
-  
+
+#ifdef MM_DEBUG
+  Debug_Check();
+#endif
+
   if(size_of_new_data == 0)
     return NULL;
 
-  size_t size_of_new_block = ALIGN(size_of_new_data + 8*sizeof(struct node_header));
+#ifdef MM_PROFILE
+  if(PROFILE_TICK(size_of_new_data))
+    return Sampled_Malloc(size_of_new_data);
+#endif
+
+  // Small objects come from slabs.
+  if(size_of_new_data <= SLAB_MAX_OBJECT) {
+#ifdef MM_THREAD_SAFE
+    thread_cache* cache = Get_Cache();
+    if(cache != NULL)
+      return Cache_Slab_Malloc(cache, SLAB_CLASS(size_of_new_data));
+#endif
+    LOCK_SLABS();
+    void* object = slab_malloc(SLAB_CLASS(size_of_new_data));
+    UNLOCK_SLABS();
+    return object;
+  }
 
-  // If the free list can't hold the new data then expand it.
-  if (free_list_size < size_of_new_block) {
-    
-    size_t new_size = PAGE_ALIGN(size_of_new_block);
+  // Huge ones get a mapping of their own.
+  if(size_of_new_data >= MM_LARGE_THRESHOLD)
+    return large_malloc(size_of_new_data, ALIGNMENT);
 
-    // Append a new page to the start of the free list.
-    extend_free_list(new_size - free_list_size);
-    if (free_list_head == NULL)
-      return NULL;
+  size_t size_of_new_block = ALIGN(size_of_new_data + HEADER_SIZE);
+  if(size_of_new_block < MIN_BLOCK_SIZE)
+    size_of_new_block = MIN_BLOCK_SIZE;
+
+#ifdef MM_THREAD_SAFE
+  // Small blocks come from this thread's cache.
+  if(size_of_new_block <= TCACHE_MAX_BLOCK) {
+    thread_cache* cache = Get_Cache();
+    if(cache != NULL)
+      return Cache_Malloc(cache, size_of_new_block);
   }
+#endif
 
-  // Store the new data into the free-list
-  struct node_header* store_location;
-    
-  // If there's a best fit then place it there.
-  struct node_header* best_fit = Best_Fit(size_of_new_block);
-  if(best_fit != NULL)
-    store_location = best_fit;
+  LOCK_HEAP();
+  void* payload = heap_malloc(size_of_new_block);
+  UNLOCK_HEAP();
+  return payload;
+}
 
-  // Otherwise another page will have to be put at the beginning of the free-list.
-  else {
-    extend_free_list(size_of_new_block);
-    store_location = free_list_head;
-    biggest_free_block_size = size_of_new_block;
+/*
+ * mm_calloc - Allocates a zeroed block for "count" objects of "size" bytes each.
+ *
+ * Memory from mem_map is already zero, so only what has been handed out before needs a memset. Huge requests get fresh pages of their own
+ * and aren't touched at all. A heap block is only zeroed up to where the free block it came from was still untouched. Slab objects and
+ * blocks from thread caches are small and have been used before, so they are zeroed in full.
+ *
+ * @returns the zeroed payload, or NULL if "count" * "size" overflows, is 0, or there wasn't enough memory.
+ */
+void *mm_calloc(size_t count, size_t size) {
+
+  size_t total;
+  if(__builtin_mul_overflow(count, size, &total) || total == 0)
+    return NULL;
+
+  if(total >= MM_LARGE_THRESHOLD)
+    return mm_malloc(total);
+
+  size_t size_of_new_block = ALIGN(total + HEADER_SIZE);
+  if(size_of_new_block < MIN_BLOCK_SIZE)
+    size_of_new_block = MIN_BLOCK_SIZE;
+
+  int reused = (total <= SLAB_MAX_OBJECT);
+#ifdef MM_THREAD_SAFE
+  reused |= (size_of_new_block <= TCACHE_MAX_BLOCK && Get_Cache() != NULL);
+#endif
+#ifdef MM_PROFILE
+  // Let mm_malloc take the sample, and count the bytes here when the heap serves the block instead.
+  if(!reused && profile_countdown < (long)total && !profiling)
+    reused = 1;
+  else if(!reused)
+    profile_countdown -= (long)total;
+#endif
+  if(reused) {
+    void* payload = mm_malloc(total);
+    if(payload != NULL)
+      memset(payload, 0, total);
+    return payload;
   }
-  // Actually store the new block and make sure to propperly update headers and footers.
-  return Allocate_Block(store_location, size_of_new_block);
+
+#ifdef MM_DEBUG
+  Debug_Check();
+#endif
+
+  size_t dirty;
+  LOCK_HEAP();
+  void* payload = heap_calloc(size_of_new_block, total, &dirty);
+  UNLOCK_HEAP();
+  if(payload != NULL)
+    memset(payload, 0, dirty);
+  return payload;
 }
 
 /*
  * mm_free - Frees the block pointed to by "ptr".
- * 
+ *
  * This routine is only guaranteed to work when the passed a pointer (ptr) that was returned by an earlier call to mm_malloc and has not yet been freed.
- * 
+ *
  */
 void mm_free(void *ptr) {
 
-  // Obtain the block to remove.
-  struct  node_header* block_to_remove;
+#ifdef MM_DEBUG
+  Debug_Check();
+#endif
 
-  // If the block is not in the free list then do nothing.
-  struct node_header* runner;
-  for (runner = free_list_head; runner != NULL; runner = runner->next ) {
-    if(&runner == &ptr) {
-      block_to_remove = ptr;
-      break;
+  if(ptr == NULL)
+    return;
+  PROFILE_FREE(ptr);
+
+  if(Page_Kind(ptr) == PAGE_SLAB)
+    Free_Object(ptr);
+  else
+    Free_Block(HEADER(ptr));
+}
+
+/*
+ * mm_realloc - Changes the size of the block pointed to by "ptr" to "size" bytes, keeping its contents.
+ *
+ * Acts like mm_malloc if "ptr" is NULL and like mm_free if "size" is 0. Otherwise the block is resized in place if possible. Only when it
+ * can't grow there is a new block allocated, the contents copied and the old block freed.
+ *
+ * @returns a pointer to the resized payload, which may have moved, or NULL if there wasn't enough memory (the old block is then untouched).
+ */
+void *mm_realloc(void *ptr, size_t size) {
+
+  if(ptr == NULL)
+    return mm_malloc(size);
+  if(size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+
+  size_t old_size;
+
+  // A slab object can't change size, but it may already be big enough.
+  if(Page_Kind(ptr) == PAGE_SLAB) {
+    old_size = ((slab_header*) ((uintptr_t)ptr & ~(uintptr_t)(slab_size - 1)))->object_size;
+    if(size <= old_size)
+      return ptr;
+  }
+  else if(LOAD_HEADER(HEADER(ptr)) & LARGE) {
+    void* resized = large_realloc(LARGE_HEADER(ptr), size);
+    if(resized != NULL) {
+      PROFILE_MOVE(ptr, resized);
+      return resized;
     }
+    old_size = LARGE_USABLE(LARGE_HEADER(ptr));
   }
-  if(block_to_remove == NULL) {
-    
-    return;
+  else {
+    // A block that shrinks to slab size moves into a slab, so that mm_free_sized can tell slab objects by their size.
+    LOCK_HEAP();
+    void* resized = (size > SLAB_MAX_OBJECT)? heap_realloc(HEADER(ptr), size): NULL;
+    if(resized == NULL)
+      old_size = BLOCK_SIZE(HEADER(ptr)) - HEADER_SIZE;
+    UNLOCK_HEAP();
+    if(resized != NULL) {
+      PROFILE_MOVE(ptr, resized);
+      return resized;
+    }
+  }
+
+  // Otherwise copy it into a new block.
+  void* new_ptr = mm_malloc(size);
+  if(new_ptr == NULL)
+    return NULL;
+  memcpy(new_ptr, ptr, (size < old_size)? size: old_size);
+  mm_free(ptr);
+  return new_ptr;
+}
+
+/*
+ * mm_memalign - Allocates a block of at least "size" bytes whose payload starts at a multiple of "alignment", which must be a power of two.
+ *
+ * Small requests come from a slab class whose objects are a multiple of "alignment" bytes, since those are aligned to it. Bigger ones are
+ * carved out of a free block of the heap at its first aligned address, and the free space before that goes back to the free lists. Only
+ * requests that are huge together with their alignment get a region of their own.
+ *
+ * @returns the aligned payload, or NULL if "alignment" isn't a power of two or there wasn't enough memory.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+  if(alignment <= ALIGNMENT)
+    return mm_malloc(size);
+  if(size == 0)
+    return NULL;
+
+#ifdef MM_PROFILE
+  if(PROFILE_TICK(size)) {
+    profiling = 1;
+    return Profile_Allocation(mm_memalign(alignment, size), size);
+  }
+#endif
+
+  // Round small requests up to an object size that is a multiple of the alignment. Above SLAB_MAX_OBJECT that means a multiple of
+  // CACHE_LINE, which is also a multiple of any smaller alignment.
+  if(size <= ALIGNED_SLAB_MAX && alignment <= ALIGNED_SLAB_MAX) {
+    size_t object_size = (size + alignment - 1) & ~(alignment - 1);
+    int size_class = -1;
+
+    if(object_size <= SLAB_MAX_OBJECT)
+      size_class = SLAB_CLASS(object_size);
+    else if(object_size <= ALIGNED_SLAB_MAX)
+      size_class = ALIGNED_SLAB_CLASS(object_size);
+
+    if(size_class >= 0) {
+#ifdef MM_THREAD_SAFE
+      thread_cache* cache = Get_Cache();
+      if(cache != NULL)
+        return Cache_Slab_Malloc(cache, size_class);
+#endif
+      LOCK_SLABS();
+      void* object = slab_malloc(size_class);
+      UNLOCK_SLABS();
+      return object;
+    }
   }
-  // block_to_remove = (struct  node_header*) ptr; 
 
-  // Coalesce it.
-  struct node_header* remainder = coalesce(block_to_remove);
+  if(size >= MM_LARGE_THRESHOLD || alignment >= MM_LARGE_THRESHOLD - size)
+    return large_malloc(size, alignment);
 
-  // Remove it from the free list and update the size.
-  Replace_Free_Block(remainder, NULL);
-  free_list_size -= remainder->size;
+  size_t size_of_new_block = ALIGN(size + HEADER_SIZE);
+  if(size_of_new_block < MIN_BLOCK_SIZE)
+    size_of_new_block = MIN_BLOCK_SIZE;
 
-  // Unmap it.
-  mem_unmap(remainder, remainder->size);
+  LOCK_HEAP();
+  void* payload = heap_memalign(size_of_new_block, alignment);
+  UNLOCK_HEAP();
+  return payload;
 }
 
-/* =============================================== Helper Methods ===================================================================*/
+/*
+ * mm_aligned_alloc - The C11 name for mm_memalign. "size" doesn't have to be a multiple of "alignment".
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+  return mm_memalign(alignment, size);
+}
 
 /*
- * Iterates through the free list until it finds the best place to fit a new block of the "requested_size".
+ * mm_malloc_batch - Allocates "n" blocks at once, the i-th of at least "sizes[i]" bytes, and stores their payloads in "out".
  *
- * @returns a pointer to the start of the best-fitting free block for the "requested_size". That pointer will be NULL if no free block is large enough.
+ * The requests are served by kind rather than in order, so that each lock is taken once for the whole batch. The slab objects come first,
+ * then the heap blocks, which are laid out back to back in a few free blocks of up to BATCH_RUN_LIMIT bytes so that the free lists are
+ * searched and updated once per run instead of once per block, and then the large blocks. The blocks can be freed one by one or with
+ * mm_free_batch. A size of 0 gives NULL, as it does for mm_malloc.
+ *
+ * @returns 0, or -1 if memory ran out, in which case nothing is allocated.
  */
-struct node_header* Best_Fit(size_t requested_size) {
+int mm_malloc_batch(size_t n, const size_t* sizes, void** out) {
+
+#ifdef MM_DEBUG
+  Debug_Check();
+#endif
+
+  // Slab objects come from this thread's cache, or from the slabs under one lock acquisition. Every other entry starts out NULL.
+  int failed = 0;
+  size_t heap_requests = 0, large_requests = 0;
+#ifdef MM_THREAD_SAFE
+  thread_cache* cache = Get_Cache();
+  if(cache == NULL)
+#endif
+    LOCK_SLABS();
+  for(size_t i = 0; i < n; i++) {
+    out[i] = NULL;
+    if(IS_HEAP_REQUEST(sizes[i]))
+      heap_requests++;
+    else if(sizes[i] >= MM_LARGE_THRESHOLD)
+      large_requests++;
+    if(failed || sizes[i] == 0 || sizes[i] > SLAB_MAX_OBJECT)
+      continue;
+#ifdef MM_THREAD_SAFE
+    if(cache != NULL)
+      out[i] = Cache_Slab_Malloc(cache, SLAB_CLASS(sizes[i]));
+    else
+#endif
+      out[i] = slab_malloc(SLAB_CLASS(sizes[i]));
+    failed = (out[i] == NULL);
+  }
+#ifdef MM_THREAD_SAFE
+  if(cache == NULL)
+#endif
+    UNLOCK_SLABS();
+
+  // Heap blocks are carved in runs, all under one acquisition of the heap lock.
+  if(heap_requests != 0 && !failed) {
+    LOCK_HEAP();
+    for(size_t start = 0, end; start < n && !failed; start = end) {
+      size_t total = 0;
+
+      for(end = start; end < n; end++) {
+        if(!IS_HEAP_REQUEST(sizes[end]))
+          continue;
+        size_t block_size = ALIGN(sizes[end] + HEADER_SIZE);
+        if(total != 0 && total + block_size > BATCH_RUN_LIMIT)
+          break;
+        total += block_size;
+      }
+      if(total != 0)
+        failed = (heap_malloc_run(sizes, out, start, end, total) < 0);
+    }
+    UNLOCK_HEAP();
+  }
 
-  // Create a pointer that will move alongside the free list to find the best-fitting free block.
-  struct node_header* runner;
-  struct node_header* best_fit = NULL;
+  for(size_t i = 0; i < n && large_requests != 0 && !failed; i++) {
+    if(sizes[i] >= MM_LARGE_THRESHOLD) {
+      out[i] = large_malloc(sizes[i], ALIGNMENT);
+      failed = (out[i] == NULL);
+    }
+  }
 
-  // Don't bother checking for a best fit if there's not one.
-  if(requested_size > biggest_free_block_size)
-    return NULL;
+  if(failed) {
+    mm_free_batch(n, out);
+    return -1;
+  }
 
-  // Iterate through the free list.
-  for (runner = free_list_head; runner != NULL; runner = runner->next ) {
+#ifdef MM_PROFILE
+  // The samples are only taken once the whole batch has succeeded, so that a failed batch leaves none behind.
+  for(size_t i = 0; i < n; i++) {
+    if(sizes[i] != 0 && PROFILE_TICK(sizes[i])) {
+      profiling = 1;
+      Profile_Allocation(out[i], sizes[i]);
+    }
+  }
+#endif
+  return 0;
+}
 
-    // Get the size of the current free block.
-    size_t runner_size = ( runner->size & ~0xF );
+/*
+ * mm_free_batch - Frees the "n" payloads in "ptrs", any of which may be NULL. They may come from any of the allocation functions.
+ *
+ * The pointers are sorted BATCH_CHUNK at a time into slab objects, heap blocks and the rest before any of them is freed. Then the slab
+ * objects are freed under one acquisition of the slab lock and the heap blocks under one acquisition of the heap lock.
+ */
+void mm_free_batch(size_t n, void** ptrs) {
+
+  unsigned char kinds[BATCH_CHUNK];
+
+#ifdef MM_DEBUG
+  Debug_Check();
+#endif
+#ifdef MM_THREAD_SAFE
+  thread_cache* cache = Get_Cache();
+#endif
+
+  for(size_t start = 0; start < n; start += BATCH_CHUNK) {
+    void** batch = ptrs + start;
+    size_t count = (n - start < BATCH_CHUNK)? n - start: BATCH_CHUNK;
+    size_t slab_objects = 0, heap_blocks = 0, others = 0;
+
+    // Sort them while every header is still intact, since freeing a block may overwrite the header of its neighbour.
+    for(size_t i = 0; i < count; i++) {
+      if(batch[i] == NULL) {
+        kinds[i] = FREE_NOTHING;
+        continue;
+      }
+      PROFILE_FREE(batch[i]);
 
-    // Don't bother checking space that's too small.
-    if(requested_size > runner_size)
-      continue;
+      if(Page_Kind(batch[i]) == PAGE_SLAB) {
+        kinds[i] = FREE_SLAB;
+        slab_objects++;
+      }
+      else if((LOAD_HEADER(HEADER(batch[i])) & LARGE)
+#ifdef MM_THREAD_SAFE
+              || OWNER(HEADER(batch[i])) != 0
+#endif
+              ) {
+        kinds[i] = FREE_OTHER;
+        others++;
+      }
+      else {
+        kinds[i] = FREE_HEAP;
+        heap_blocks++;
+      }
+    }
 
-    // The first block that's large enough will start as the best fit.
-    if(best_fit == NULL)
-      best_fit = runner;
+    if(slab_objects != 0) {
+#ifdef MM_THREAD_SAFE
+      if(cache != NULL) {
+        for(size_t i = 0; i < count; i++) {
+          if(kinds[i] == FREE_SLAB)
+            Cache_Slab_Free(batch[i]);
+        }
+      }
+      else
+#endif
+      {
+        LOCK_SLABS();
+        for(size_t i = 0; i < count; i++) {
+          if(kinds[i] == FREE_SLAB)
+            slab_free(batch[i]);
+        }
+        UNLOCK_SLABS();
+      }
+    }
 
-    // Break out of the loop if the perfect-size free block is found.
-    if (runner_size == requested_size) { // To make this first-fit, just change the condition to >=
-      best_fit = runner;
-      break;
+    // Blocks that follow each other in memory, as the blocks of mm_malloc_batch do, are freed together as one.
+    if(heap_blocks != 0) {
+      node_header* run = NULL;
+      size_t run_size = 0, run_count = 0;
+
+      LOCK_HEAP();
+      for(size_t i = 0; i < count; i++) {
+        if(kinds[i] != FREE_HEAP)
+          continue;
+        node_header* block = HEADER(batch[i]);
+        if(run != NULL && (char*)run + run_size == (char*)block) {
+          run_size += BLOCK_SIZE(block);
+          run_count++;
+          continue;
+        }
+        if(run != NULL)
+          heap_free_run(run, run_size, run_count);
+        run = block;
+        run_size = BLOCK_SIZE(block);
+        run_count = 1;
+      }
+      heap_free_run(run, run_size, run_count);
+      UNLOCK_HEAP();
     }
 
-    // Continue the optimization loop and compare the sizes of the current block with the best fitting block so far.
-    if (runner_size < ( best_fit->size & ~0xF ) ) {
-        best_fit = runner;
+    for(size_t i = 0; others != 0 && i < count; i++) {
+      if(kinds[i] == FREE_OTHER)
+        Free_Block(HEADER(batch[i]));
     }
-    
   }
+}
+
+/*
+ * mm_free_sized - Frees "ptr", which was allocated by mm_malloc, mm_malloc_batch or mm_realloc with "size" bytes.
+ *
+ * Every request of up to SLAB_MAX_OBJECT bytes is a slab object, and every bigger one is a block with a header, so the size says which
+ * it is without looking "ptr" up in the page map. Blocks from mm_memalign don't follow that rule and must go to mm_free. A -DMM_DEBUG build
+ * checks the size against the block and aborts if it is wrong.
+ */
+void mm_free_sized(void *ptr, size_t size) {
+
+#ifdef MM_DEBUG
+  Debug_Check();
+  if(ptr != NULL && ((Page_Kind(ptr) == PAGE_SLAB) != (size <= SLAB_MAX_OBJECT) || size > mm_usable_size(ptr))) {
+    fprintf(stderr, "mm_free_sized: %p is not a block of %zu bytes\n", ptr, size);
+    abort();
+  }
+#endif
 
-  return best_fit;
+  if(ptr == NULL)
+    return;
+  PROFILE_FREE(ptr);
+
+  if(size <= SLAB_MAX_OBJECT)
+    Free_Object(ptr);
+  else
+    Free_Block(HEADER(ptr));
 }
 
+/*
+ * mm_usable_size - Returns how many bytes of the block at "ptr" may be used, which is at least what was asked for. 0 for NULL.
+ */
+size_t mm_usable_size(void *ptr) {
+
+  if(ptr == NULL)
+    return 0;
+  if(Page_Kind(ptr) == PAGE_SLAB)
+    return ((slab_header*) ((uintptr_t)ptr & ~(uintptr_t)(slab_size - 1)))->object_size;
+  if(LOAD_HEADER(HEADER(ptr)) & LARGE)
+    return LARGE_USABLE(LARGE_HEADER(ptr));
+  return (LOAD_HEADER(HEADER(ptr)) & SIZE_MASK) - HEADER_SIZE;
+}
 
+/*
+ * mm_lock_counts - Stores how many times since mm_init a thread took the heap lock or the slab lock, and how many of those times it found
+ * the lock held by another thread and waited.
+ */
+void mm_lock_counts(size_t* taken, size_t* waited) {
+  *taken = __atomic_load_n(&lock_acquisitions, __ATOMIC_RELAXED);
+  *waited = __atomic_load_n(&lock_waits, __ATOMIC_RELAXED);
+}
 
 /*
-* This method will be called only by free().
-* 
-* Coalesces multiple free blocks if they are next to each other.
-* @Returns a pointer to the new coalesced block (or NULL if there are none) and removes or extends the old ones.
-* 
-* Also calls helper methods to add to and remove from the free list.
-* 
-* @param new_free_block
-*/
-static struct node_header* coalesce(node_header* new_free_block) {
-  // determine which blocks are allocated.
-  int prev = (new_free_block->prev == NULL)? 1: new_free_block->prev->size & 0x1;
-  int next = (new_free_block->next == NULL)? 1: new_free_block->next->size & 0x1;
+ * mm_report_utilization - Prints how much of the mapped heap holds payload.
+ *
+ * "Payload" is the usable space of the allocated blocks, so the difference between it and the allocated bytes is the header overhead. Peak
+ * utilization is the peak payload divided by the peak heap size, the same way the lab's driver measures it. Blocks sitting in thread caches
+ * or quick lists count as allocated.
+ */
+void mm_report_utilization(FILE* out) {
+
+  LOCK_SLABS();
+  LOCK_HEAP();
+  fprintf(out, "Heap:        %zu bytes in %zu chunks, %zu slabs and %zu large blocks (peak %zu)\n",
+          heap_size, chunk_count, slab_count, large_count, peak_heap_size);
+  fprintf(out, "Allocated:   %zu blocks, %zu bytes, %zu bytes of payload in blocks and slabs\n",
+          allocated_blocks + large_count, allocated_size + large_size, payload_size);
+  fprintf(out, "Free:        %zu bytes\n", free_list_size);
+  fprintf(out, "Quick lists: %zu blocks, %zu bytes waiting to be merged (merged %zu times)\n", quick_count, quick_size, quick_consolidations);
+  fprintf(out, "Released:    %zu bytes of idle pages in %zu calls to madvise\n", released_size, release_count);
+  fprintf(out, "Growth:      %zu chunks mapped, %zu merged into a neighbour, %zu unmapped; the next maps at least %zu bytes\n",
+          chunks_mapped, chunks_merged, chunks_unmapped, grow_size);
+  fprintf(out, "Locks:       taken %zu times, %zu of them after waiting for another thread\n", lock_acquisitions, lock_waits);
+  fprintf(out, "Utilization: %.1f%% now, %.1f%% at peak\n",
+          heap_size ? 100.0 * payload_size / heap_size : 0.0,
+          peak_heap_size ? 100.0 * peak_payload_size / peak_heap_size : 0.0);
+  UNLOCK_HEAP();
+  UNLOCK_SLABS();
+}
+
+/*
+ * mm_check - Checks that the heap is consistent, printing every problem it finds to "out".
+ *
+ * Every chunk is walked block by block, then the free lists, the free tree, the slabs and the large blocks are checked against what the walk
+ * found and against the counters. This takes time in proportion to the whole heap, so it is meant for debugging. Blocks sitting in thread
+ * caches or quick lists look allocated.
+ *
+ * @returns 0 if the heap is consistent, -1 otherwise.
+ */
+int mm_check(FILE* out) {
+
+  size_t free_blocks = 0;
+
+  LOCK_SLABS();
+  LOCK_HEAP();
+  check_out = out;
+  check_errors = 0;
+
+  Check_Chunks(&free_blocks);
+
+  // The walk saw each free block once, so the lists and the tree hold all of them if they hold that many valid, distinct free blocks.
+  size_t listed = Check_Free_Lists();
+  if(listed != free_blocks)
+    Check_Failed("the free lists and tree hold %zu blocks but the chunks have %zu free blocks", listed, free_blocks);
+  Check_Quick_Lists();
+
+  Check_Slabs();
+  Check_Large_Blocks();
+
+#ifndef MM_THREAD_SAFE
+  // Large blocks update heap_size outside the heap lock in thread-safe builds, so this only adds up in the other build.
+  size_t chunk_bytes = 0;
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next)
+    chunk_bytes += chunk->size;
+  if(heap_size != chunk_bytes + slab_count * slab_size + large_size)
+    Check_Failed("heap_size is %zu but chunks, slabs and large blocks add up to %zu",
+                 heap_size, chunk_bytes + slab_count * slab_size + large_size);
+#endif
+
+  int errors = check_errors;
+  UNLOCK_HEAP();
+  UNLOCK_SLABS();
+  return (errors == 0)? 0: -1;
+}
 
-  // There are 4 cases:
+/*
+ * mm_report_fragmentation - Prints where the free space is and how full the heap's pieces are.
+ *
+ * The free blocks of the heap are counted by power-of-two size. External fragmentation is the share of the free bytes that are not in the
+ * largest free block, which is 0% when all of the free space could serve a single request. Then every chunk and slab class gets a line with
+ * how much of it is allocated.
+ */
+void mm_report_fragmentation(FILE* out) {
+
+  size_t counts[64] = {0}, bytes[64] = {0};
+  size_t largest = 0, total = 0;
+
+  LOCK_SLABS();
+  LOCK_HEAP();
+
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next) {
+    for(node_header* block = (node_header*) (chunk + 1); BLOCK_SIZE(block) != 0; block = NEXT_BLOCK(block)) {
+      if(block->size & ALLOCATED)
+        continue;
+      int power = 63 - __builtin_clzl(BLOCK_SIZE(block));
+      counts[power]++;
+      bytes[power] += BLOCK_SIZE(block);
+      total += BLOCK_SIZE(block);
+      if(BLOCK_SIZE(block) > largest)
+        largest = BLOCK_SIZE(block);
+    }
+  }
 
-  // Case 1: neither the previous nor next block are free.
-  if( prev && next) {
-    Replace_Free_Block(NULL, new_free_block); // Nothing to coalesce. Just add the "new_free_block" to the free list.
-    free_list_size += new_free_block->size;
-    return new_free_block;
+  fprintf(out, "Free blocks by size:\n");
+  for(int power = 0; power < 64; power++) {
+    if(counts[power] != 0)
+      fprintf(out, "  %9zu - %9zu bytes: %6zu blocks, %10zu bytes\n",
+              (size_t)1 << power, ((size_t)2 << power) - 1, counts[power], bytes[power]);
   }
-    
+  fprintf(out, "Largest free block: %zu of %zu free bytes (external fragmentation %.1f%%)\n",
+          largest, total, total ? 100.0 * (total - largest) / total : 0.0);
 
-  // Case 2: The previous block is free but the next one is not.
-  else if(!prev && next) {
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next) {
+    size_t allocated = 0, allocated_count = 0, free_count = 0;
 
-    // Update the allocation bits of the previous block.
-    new_free_block->prev->size += (new_free_block->size & ~0xf);
-    // Also update the free list size
-    free_list_size += new_free_block->size & ~0xF;
-    
-    // No need to adjust previous or next pointers. Also no need to change the free list.
-    return new_free_block->prev;
+    for(node_header* block = (node_header*) (chunk + 1); BLOCK_SIZE(block) != 0; block = NEXT_BLOCK(block)) {
+      if(block->size & ALLOCATED) {
+        allocated += BLOCK_SIZE(block);
+        allocated_count++;
+      }
+      else
+        free_count++;
+    }
+    fprintf(out, "Chunk %p: %8zu bytes, %5.1f%% allocated in %zu blocks, %zu free blocks\n",
+            (void*)chunk, chunk->size, 100.0 * allocated / (chunk->size - CHUNK_OVERHEAD), allocated_count, free_count);
   }
 
-  // Case 3: The next block is free but the previous is not.
-  else if( prev && !next) {
+  for(int size_class = 0; size_class < ALL_SLAB_CLASSES; size_class++) {
+    size_t slabs = 0, in_use = 0, capacity = 0;
+    slab_header* lists[2] = { slab_classes[size_class].partial, slab_classes[size_class].full };
 
-    // Update the size and allocation bits of the "new_free_block".
-    __int128_t size_of_block_to_remove = ( new_free_block->next->size & ~0xF);
-    free_list_size -= size_of_block_to_remove;
+    for(int i = 0; i < 2; i++) {
+      for(slab_header* slab = lists[i]; slab != NULL; slab = slab->next) {
+        slabs++;
+        in_use += slab->in_use;
+        capacity += slab->capacity;
+      }
+    }
+    if(slabs != 0)
+      fprintf(out, "Slabs of %3d bytes: %zu slabs, %zu of %zu objects in use (%.1f%%)\n",
+              SLAB_OBJECT_SIZE(size_class), slabs, in_use, capacity, 100.0 * in_use / capacity);
+  }
 
-    __int128_t new_size = new_free_block->size + size_of_block_to_remove;
-    new_free_block->size = (new_size | 0x6); // header
-    free_list_size += new_size;
+  UNLOCK_HEAP();
+  UNLOCK_SLABS();
+}
 
-    // Update the free list
-    Replace_Free_Block(new_free_block->next, new_free_block);
+/*
+ * mm_report_profile - Prints the PROFILE_REPORT_SITES call sites that the most sampled bytes are still allocated from, with their call
+ * stacks and the estimated bytes and blocks that each has allocated, live and in total.
+ *
+ * The estimates scale the samples up the same way pprof does. Only a -DMM_PROFILE build takes samples; any other says so and returns.
+ */
+void mm_report_profile(FILE* out) {
+
+#ifdef MM_PROFILE
+  double live_bytes[PROFILE_SITES];
+  int shown[PROFILE_SITES] = {0};
+  double live = 0, live_blocks = 0, total = 0, total_blocks = 0;
+  int sites = 0;
+
+  for(int i = 0; i < PROFILE_SITES; i++) {
+    profile_site* site = &profile_sites[i];
+    live_bytes[i] = -1;
+    if(!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE))
+      continue;
+    size_t samples = __atomic_load_n(&site->samples, __ATOMIC_RELAXED), bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+    size_t live_samples = __atomic_load_n(&site->live_samples, __ATOMIC_RELAXED);
+    size_t live_sampled = __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED);
+    live_bytes[i] = live_sampled * Sample_Scale(live_samples, live_sampled);
+    live += live_bytes[i];
+    live_blocks += live_samples * Sample_Scale(live_samples, live_sampled);
+    total += bytes * Sample_Scale(samples, bytes);
+    total_blocks += samples * Sample_Scale(samples, bytes);
+    sites++;
+  }
 
-    return new_free_block;
+  fprintf(out, "Profile: a sample every %zu bytes on average, %d call sites, %zu samples dropped\n",
+          profile_rate, sites, __atomic_load_n(&profile_dropped, __ATOMIC_RELAXED));
+  fprintf(out, "Live:    ~%.0f bytes in ~%.0f blocks\n", live, live_blocks);
+  fprintf(out, "Total:   ~%.0f bytes in ~%.0f blocks allocated so far\n", total, total_blocks);
+
+  // The biggest live sites first, found one at a time since only a few are shown.
+  for(int rank = 1; rank <= PROFILE_REPORT_SITES; rank++) {
+    int best = -1;
+    for(int i = 0; i < PROFILE_SITES; i++) {
+      if(!shown[i] && live_bytes[i] >= 0 && (best < 0 || live_bytes[i] > live_bytes[best]))
+        best = i;
+    }
+    if(best < 0)
+      break;
+    shown[best] = 1;
+
+    profile_site* site = &profile_sites[best];
+    size_t samples = __atomic_load_n(&site->samples, __ATOMIC_RELAXED), bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+    size_t live_samples = __atomic_load_n(&site->live_samples, __ATOMIC_RELAXED);
+    fprintf(out, "\nCall site %d: ~%.0f bytes in ~%.0f live blocks, ~%.0f bytes in ~%.0f blocks so far\n", rank, live_bytes[best],
+            live_samples * Sample_Scale(live_samples, __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED)),
+            bytes * Sample_Scale(samples, bytes), samples * Sample_Scale(samples, bytes));
+    // backtrace_symbols_fd writes straight to the file descriptor, so the stream is flushed around it.
+    for(int frame = 0; frame < site->depth; frame++) {
+      fputs("    ", out);
+      fflush(out);
+      backtrace_symbols_fd(&site->stack[frame], 1, fileno(out));
+    }
   }
+#else
+  fprintf(out, "Profile: mm.c was built without -DMM_PROFILE, so nothing was sampled\n");
+#endif
+}
+
+/*
+ * mm_dump_profile - Writes every call site that was sampled in the heap profile format of pprof (heap_v2), which holds both the live
+ * samples and all samples so far, followed by the memory map that pprof needs to symbolize the stacks. The counts are raw samples;
+ * pprof scales them up by itself.
+ *
+ * @returns 0, or -1 if this build doesn't take samples (it needs -DMM_PROFILE).
+ */
+int mm_dump_profile(FILE* out) {
 
-  // Case 4: Both the previous and the next block are free. This is just a combination of the logic in cases 2 and 3.
-  __int128_t size_of_prev = new_free_block->prev->size & ~0xF;
-  __int128_t size_of_next = new_free_block->next->size & ~0xF;
-  __int128_t new_size = size_of_prev + new_free_block->size + size_of_next;
+#ifdef MM_PROFILE
+  size_t live_samples = 0, live_bytes = 0, samples = 0, bytes = 0;
+  char line[512];
 
-  // Update the size and allocation bits of the the previous block
-  new_free_block->prev->size = (new_size | 0x6);
+  for(int i = 0; i < PROFILE_SITES; i++) {
+    if(!__atomic_load_n(&profile_sites[i].ready, __ATOMIC_ACQUIRE))
+      continue;
+    live_samples += __atomic_load_n(&profile_sites[i].live_samples, __ATOMIC_RELAXED);
+    live_bytes += __atomic_load_n(&profile_sites[i].live_bytes, __ATOMIC_RELAXED);
+    samples += __atomic_load_n(&profile_sites[i].samples, __ATOMIC_RELAXED);
+    bytes += __atomic_load_n(&profile_sites[i].bytes, __ATOMIC_RELAXED);
+  }
+  fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_samples, live_bytes, samples, bytes, profile_rate);
 
-  // Extend the previous block to contain all three blocks then update the free list size. Then remove the next free block.
-  free_list_size += new_free_block->size;
-  Replace_Free_Block(new_free_block->next, NULL);
+  for(int i = 0; i < PROFILE_SITES; i++) {
+    profile_site* site = &profile_sites[i];
+    if(!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE))
+      continue;
+    fprintf(out, "%zu: %zu [%zu: %zu] @", __atomic_load_n(&site->live_samples, __ATOMIC_RELAXED),
+            __atomic_load_n(&site->live_bytes, __ATOMIC_RELAXED), __atomic_load_n(&site->samples, __ATOMIC_RELAXED),
+            __atomic_load_n(&site->bytes, __ATOMIC_RELAXED));
+    for(int frame = 0; frame < site->depth; frame++)
+      fprintf(out, " %p", site->stack[frame]);
+    fputc('\n', out);
+  }
 
-  return new_free_block->prev;
+  fprintf(out, "\nMAPPED_LIBRARIES:\n");
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if(maps != NULL) {
+    while(fgets(line, sizeof(line), maps) != NULL)
+      fputs(line, out);
+    fclose(maps);
+  }
+  return 0;
+#else
+  (void)out;
+  return -1;
+#endif
 }
 
+/* =============================================== Helper Methods ===================================================================*/
+
 /*
-* Uses mem_map to allocate a new chunk of memory for the "requested_space".
-* Updates the free_list_head and free_list_size.
-* 
-* CALLER AGREEMENT: The exact amount of "requested_space" will be allocated so it is up to the caller to make sure it is page-aligned.
-* This method will make sure it is a multiple of 4096.
-*/
-static void extend_free_list(int requested_space) {
+ * The malloc of the central heap.
+ * CALLER AGREEMENT: "size_of_new_block" is aligned and at least MIN_BLOCK_SIZE, and the heap lock is held in thread-safe builds.
+ * @Returns the payload of the new block or NULL if the heap could not grow.
+ */
+static void* heap_malloc(size_t size_of_new_block) {
 
-  // Make sure the requested space is a multiple of 4096
-  int granted_space = (requested_space % 4096 == 0)? requested_space: ((requested_space / 4096) + 1) * 4096;
+  void* payload = Quick_Malloc(size_of_new_block);
+  if(payload != NULL)
+    return payload;
 
-  if(granted_space > biggest_free_block_size)
-    biggest_free_block_size = granted_space;
+  struct node_header* store_location = Find_Fit(size_of_new_block);
+  if(store_location == NULL)
+    return NULL;
 
-  // Create a pointer to the new head of the free list.
-  void* new_space = mem_map(granted_space);
-  if(new_space == NULL)
-    return;
-  
-  // Store its size and allocation bits in a header.
-  node_header* new_node = (node_header*) new_space;
-  new_node->size = (__int128_t) ((granted_space) | 0x6);
+  // Actually store the new block and make sure to propperly update headers.
+  return Allocate_Block(store_location, size_of_new_block);
+}
 
-  // Point the previous pointer in the free block to NULL (since it is the new head) and point the next pointer to the current free list head.
-  new_node->prev = NULL;
-  new_node-> next = free_list_head;
+/*
+ * The calloc of the central heap. Only the part of the new block below where the free block it came from was still zero needs zeroing.
+ * CALLER AGREEMENT: as for heap_malloc, and "bytes" is the size that was asked for.
+ * @Returns the payload of the new block or NULL if the heap could not grow. "*dirty" is set to how many bytes at the start of the payload the
+ * caller must still zero.
+ */
+static void* heap_calloc(size_t size_of_new_block, size_t bytes, size_t* dirty) {
 
-  // Set the head of the free list to this new block and update its size.
-  free_list_head = new_node;
-  free_list_size += granted_space;
+  *dirty = bytes;
+  void* payload = Quick_Malloc(size_of_new_block);
+  if(payload != NULL)
+    return payload;
 
+  node_header* block = Find_Fit(size_of_new_block);
+  if(block == NULL)
+    return NULL;
 
+  char* fresh = Fresh_Of(block);
+  char* footer = (char*)FOOTER(block);
+  payload = Allocate_Block(block, size_of_new_block);
 
-  // Coalesce if the block happens to be next to other free blocks.
-  // coalesce(new_head); // Assume this will never happen? If it does then ignore it?
+  if(fresh < (char*)payload + bytes) {
+    *dirty = (fresh > (char*)payload)? (size_t)(fresh - (char*)payload): 0;
+    // The old footer is the one word past "fresh" that was written, and it is in the payload if the block took the whole free block.
+    if(footer < (char*)payload + bytes)
+      *(size_t*)footer = 0;
+  }
+  return payload;
 }
 
 /*
- * Replaces one item in the free list with another.
- * CALLER AGREEMENT:
- *    This method does not update the "free_list_size" so it is the caller's responsibility to do that.
- * @param old
- * @param new
- *    NULL may be used as arguments. If "old" is NULL then that means we're adding to the free list.
- *    If "new" is NULL that means we're only removing the "old" value.
- *    Please don't call this method with (NULL, NULL) arguments because that will cause a null-pointer exception.
-*/
-void Replace_Free_Block(node_header* old, node_header* new) {
+ * Takes the most recently freed block of exactly "size_of_new_block" bytes off its quick list. It is still marked allocated, so it is
+ * handed out as it is.
+ * @Returns its payload, or NULL if the quick list is empty.
+ */
+static void* Quick_Malloc(size_t size_of_new_block) {
+
+  if(size_of_new_block >= EXACT_CLASS_LIMIT || quick_lists[Size_Class(size_of_new_block)] == NULL)
+    return NULL;
+
+  node_header* block = quick_lists[Size_Class(size_of_new_block)];
+  quick_lists[Size_Class(size_of_new_block)] = block->next;
+  quick_size -= size_of_new_block;
+  quick_count--;
+  return PAYLOAD(block);
+}
+
+/*
+ * Finds the free block that a heap block of "size_of_new_block" bytes goes in.
+ * @Returns the block, or NULL if the heap could not grow.
+ */
+static node_header* Find_Fit(size_t size_of_new_block) {
 
-  // If there's nothing to replace then just add the new block and return.
-  if(old == NULL) {
+  // If there's a best fit then place it there.
+  struct node_header* store_location = Best_Fit(size_of_new_block);
+
+  // Otherwise merge the quick lists into the free lists and look again.
+  if(store_location == NULL && Consolidate_Quick_Lists() != 0)
+    store_location = Best_Fit(size_of_new_block);
 
-    // Update the prev and next pointers
-    free_list_head->prev = new;
-    new->next = free_list_head;
-    new->prev = NULL;
+  // Otherwise map enough new pages to hold the block and the chunk's header and epilogue.
+  if(store_location == NULL)
+    store_location = extend_free_list(size_of_new_block + CHUNK_OVERHEAD);
+  return store_location;
+}
 
-    // Update the free list head.
-    free_list_head = new;
+/*
+ * Allocates a block for every heap request among "sizes[start]" to "sizes[end - 1]", one after another in a single free block of at least
+ * "total" bytes, so that the free lists are searched and updated once for all of them. Whatever is left after the last block stays free.
+ * CALLER AGREEMENT: "total" is the sum of the aligned block sizes of those requests and the heap lock is held in thread-safe builds.
+ * @Returns 0, or -1 if the heap could not grow.
+ */
+static int heap_malloc_run(const size_t* sizes, void** out, size_t start, size_t end, size_t total) {
+
+  node_header* block = Best_Fit(total);
+  if(block == NULL && Consolidate_Quick_Lists() != 0)
+    block = Best_Fit(total);
+  if(block == NULL) {
+    block = extend_free_list(total + CHUNK_OVERHEAD);
+    if(block == NULL)
+      return -1;
   }
-  
-  // If we're replacing the free list head
-  if(old->prev == NULL) {
 
-    // If we're removing the only item in the free list
-    if(new == NULL) {
-      mm_init();
-      return;
-    }
+  size_t space = BLOCK_SIZE(block);
+  size_t flags = block->size & (PREV_ALLOCATED | CHUNK_START);
+  char* fresh = Fresh_Of(block);
+  size_t count = 0;
+  node_header* next = block;
+  node_header* last = NULL;
 
-    // Otherewise give the remaining free block pointers to prev and next.
-    else {
-      
-      // Update the new block.
-      new->prev = NULL;
-      new->next = old->next;
-
-      // If this is the only item in the free list then don't try to dereference the NULL next pointer.
-      if(old->next != NULL) {
-        old->next->prev = new;
-      }
-      
-      // Update the free list head.
-      free_list_head = new;
+  Remove_Free_Block(block);
+  for(size_t i = start; i < end; i++) {
+    if(!IS_HEAP_REQUEST(sizes[i]))
+      continue;
+    next->size = ALIGN(sizes[i] + HEADER_SIZE) | flags | ALLOCATED;
+    flags = PREV_ALLOCATED;
+    out[i] = PAYLOAD(next);
+    last = next;
+    next = NEXT_BLOCK(next);
+    count++;
+  }
 
-      return;
+  // A remainder too small to be a block goes to the last block of the run.
+  if(space - total < MIN_BLOCK_SIZE) {
+    last->size += space - total;
+    next = NEXT_BLOCK(last);
+    total = space;
+  }
+  if(space > total) {
+    Set_Free(next, space - total, PREV_ALLOCATED);
+    Set_Fresh(next, fresh);
+    Insert_Free_Block(next);
+  }
+  else
+    SET_FLAG(next, PREV_ALLOCATED);
+
+  free_list_size -= total;
+  allocated_size += total;
+  allocated_blocks += count;
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, total - count * HEADER_SIZE));
+  return 0;
+}
+
+/*
+ * The memalign of the central heap. The best fit for the block itself is used if it happens to have room for it at an aligned address.
+ * Otherwise the block comes from the best fit for "alignment" + MIN_BLOCK_SIZE more bytes, which is enough wherever that block starts.
+ * Either way the free space before the aligned address becomes a free block of its own, and the space after the block is split off as usual.
+ * CALLER AGREEMENT: "size_of_new_block" is aligned and at least MIN_BLOCK_SIZE, "alignment" is a power of two bigger than ALIGNMENT, and the
+ * heap lock is held in thread-safe builds.
+ * @Returns the aligned payload of the new block or NULL if the heap could not grow.
+ */
+static void* heap_memalign(size_t size_of_new_block, size_t alignment) {
+
+  size_t padded_size = size_of_new_block + alignment + MIN_BLOCK_SIZE;
+  node_header* block = Best_Fit(size_of_new_block);
+
+  if(block == NULL || Aligned_Offset(block, size_of_new_block, alignment) == (size_t)-1) {
+    block = Best_Fit(padded_size);
+    if(block == NULL && Consolidate_Quick_Lists() != 0)
+      block = Best_Fit(padded_size);
+    if(block == NULL) {
+      block = extend_free_list(padded_size + CHUNK_OVERHEAD);
+      if(block == NULL)
+        return NULL;
     }
   }
 
-  // If we're removing a node.
-  if(new == NULL) {
-    new->next = NULL;
-    new->prev = old;
-    old->prev->next = new;
-    return;
+  size_t offset = Aligned_Offset(block, size_of_new_block, alignment);
+  if(offset != 0) {
+    size_t total_space = BLOCK_SIZE(block);
+    size_t flags = block->size & (PREV_ALLOCATED | CHUNK_START);
+    char* fresh = Fresh_Of(block);
+
+    // Both pieces stay free, so free_list_size doesn't change.
+    Remove_Free_Block(block);
+    Set_Free(block, offset, flags);
+    Insert_Free_Block(block);
+
+    block = (node_header*) ((char*)block + offset);
+    Set_Free(block, total_space - offset, 0);
+    Set_Fresh(block, fresh);
+    Insert_Free_Block(block);
   }
 
-  // Otherwise we're replacing some node in the free list.
-  new->prev = old->prev;
-  new->next = old->next;
-  
-  old->prev->next = new;
-  // If this is the end of the free list then immediately return to avoid NULL pointer error
-  if(old->next == NULL) 
-    return;
-  
-  // Otherwise update the prev and next pointers in the prev and next nodes.
-  old->next->prev = new;
+  return Allocate_Block(block, size_of_new_block);
 }
 
 /*
- * Caller Agreement: The block must be able to fit in the specified size and already be 16-byte aligned.
- * @param size is already it BITS (not bytes)
- * @Returns a pointer to the payload of the newly allocated block.
-*/
-void* Allocate_Block(node_header* destination, size_t size) {
+ * Finds how far into the free "block" a block of "size" bytes must start for its payload to be a multiple of "alignment". The bytes before
+ * it must be able to hold a free block, so an offset of less than MIN_BLOCK_SIZE is pushed on to the next aligned address.
+ * @Returns the offset, or (size_t)-1 if the aligned block doesn't fit.
+ */
+static size_t Aligned_Offset(node_header* block, size_t size, size_t alignment) {
 
-  // Determine if the new block will split an existing free block or occupy the entire thing.
-  size_t total_space = (destination->size & ~0xF); 
-  size_t remaining_free_space = total_space - size;
+  uintptr_t payload = (uintptr_t)PAYLOAD(block);
+  size_t offset = ((payload + alignment - 1) & ~(uintptr_t)(alignment - 1)) - payload;
 
-  // If the remaining space is too small to be useful then let the new data take up the whole block
-  if(remaining_free_space <= (8*sizeof(__int128_t) + 2*8*sizeof(__int128_t*)))
-    // Only change the change the allocation status and leave the rest of the size unchanged.
-    destination->size = (destination->size | 0x1);
+  if(offset != 0 && offset < MIN_BLOCK_SIZE)
+    offset += alignment;
+  return (offset + size <= BLOCK_SIZE(block))? offset: (size_t)-1;
+}
 
-  // Otherwise allocate the new block but also put the remaining free space back into the free list as a new node.
-  else {
+/*
+ * The free of the central heap. Blocks under EXACT_CLASS_LIMIT go to a quick list instead of being merged right away.
+ * CALLER AGREEMENT: "block" is an allocated block of the central heap and the heap lock is held in thread-safe builds.
+ */
+static void heap_free(node_header* block) {
+  if(MM_QUICK_LIMIT > 0 && BLOCK_SIZE(block) < EXACT_CLASS_LIMIT)
+    Quick_Free(block);
+  else
+    heap_free_run(block, BLOCK_SIZE(block), 1);
+}
 
-    // Create a new node header for the remaining free space.
-    node_header* remainder = (node_header*) ((char*)destination + size);
+/*
+ * Pushes a freed block onto the quick list of its size. The block stays marked allocated and is still counted as allocated, so its
+ * neighbours don't merge with it and heap_malloc can hand it out again without splitting anything. Churn of blocks of the same size then
+ * never merges a block only to split it apart again. Once the quick lists hold more than MM_QUICK_LIMIT bytes they are all merged.
+ * CALLER AGREEMENT: "block" is an allocated block of the central heap under EXACT_CLASS_LIMIT bytes and the heap lock is held in
+ * thread-safe builds.
+ */
+static void Quick_Free(node_header* block) {
 
-    // Udate its size and pointers to prev and next.
-    remainder->size = (remaining_free_space | 0x6);
-    remainder->prev = destination->prev;
-    remainder->next = destination->next;
+  size_t size = BLOCK_SIZE(block);
 
-    // Update the header of the allocated block.
-    destination->size = (size | 0x1); // header
+#ifdef MM_THREAD_SAFE
+  // A block that a thread cache gave back still carries the cache's id.
+  CLEAR_FLAG(block, ~(SIZE_MASK | FLAGS));
+#endif
+  block->next = quick_lists[Size_Class(size)];
+  quick_lists[Size_Class(size)] = block;
+  quick_size += size;
+  quick_count++;
 
-    // Replace the old larger free block with the new smaller one then update the free list size.
-    Replace_Free_Block(destination, remainder);
-    free_list_size -= size;
-  }
+  if(quick_size > MM_QUICK_LIMIT)
+    Consolidate_Quick_Lists();
+}
 
-  return (char*)destination + 8*sizeof(struct node_header);
+/*
+ * Frees every block of the quick lists for real, merging each with its free neighbours.
+ * CALLER AGREEMENT: the heap lock is held in thread-safe builds.
+ * @Returns the number of blocks that were freed.
+ */
+static size_t Consolidate_Quick_Lists(void) {
+
+  size_t count = quick_count;
+  if(count == 0)
+    return 0;
+
+  // Each block's link is read before it is freed, since freeing it may merge it away or unmap its chunk.
+  for(int size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+    node_header* block = quick_lists[size_class];
+    quick_lists[size_class] = NULL;
+    while(block != NULL) {
+      node_header* next = block->next;
+      heap_free_run(block, BLOCK_SIZE(block), 1);
+      block = next;
+    }
+  }
+  quick_size = quick_count = 0;
+  quick_consolidations++;
+  return count;
 }
 
-// ===================== methods for debugging =====================
+/*
+ * Frees "count" allocated blocks that lie back to back from "block" on and add up to "size" bytes, as a single free block.
+ * CALLER AGREEMENT: the blocks belong to the central heap and the heap lock is held in thread-safe builds.
+ */
+static void heap_free_run(node_header* block, size_t size, size_t count) {
 
+  allocated_size -= size;
+  allocated_blocks -= count;
+  ADD_STAT(payload_size, -(size - count * HEADER_SIZE));
 
+  // Mark it free, then merge it with its free neighbours.
+  Set_Free(block, size, block->size & (PREV_ALLOCATED | CHUNK_START));
+  CLEAR_FLAG(NEXT_BLOCK(block), PREV_ALLOCATED);
+  free_list_size += size;
+  block = coalesce(block);
 
-// void printstatus() {
-//   printf("\n ------------ STATUS -----------\n");
-//   printf("Free List size is %d \n", free_list_size);
-//   printf("head header: %d", free_list_head == NULL? 0:free_list_head->size);
-//   printf("      size: %d\n", free_list_head->size & ~0xf  );
+  // If that freed a whole chunk then give the chunk back, unless it is the last one. One empty chunk is kept in case the heap grows
+  // again soon, which saves mapping and unmapping a chunk over and over when the heap goes up and down in bursts.
+  if((block->size & CHUNK_START) && BLOCK_SIZE(NEXT_BLOCK(block)) == 0 && chunk_count > 1) {
 
-  
-//   printf("second free block:");
-//  node_header* second = free_list_head->next;
-//   printf("   head: %d", second == NULL? 0: second->size);
-//   printf("   size: %d\n", second == NULL? 0: second->size & ~0xf);
-//   printf("----------END STATUS---------\n\n");
-// }
+    chunk_header* chunk = (chunk_header*) ((char*)block - sizeof(chunk_header));
 
+    if(spare_chunk == NULL || spare_chunk == chunk || !Chunk_Is_Empty(spare_chunk))
+      spare_chunk = chunk;
+    else {
+      Remove_Free_Block(block);
+      free_list_size -= BLOCK_SIZE(block);
+
+      if(chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+      else
+        chunk_list = chunk->next;
+      if(chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+      chunk_count--;
+      chunks_unmapped++;
+      ADD_STAT(heap_size, -chunk->size);
+
+      // The heap is shrinking, so the next chunk can be smaller.
+      if(grow_size / 2 >= MM_GROW_MIN)
+        grow_size /= 2;
+
+      mem_unmap(chunk, chunk->size);
+    }
+  }
 
-// void print_free_list() {
+  size_t old_clock = release_clock;
+  release_clock += count;
+  if(release_clock / RELEASE_SCAN_INTERVAL != old_clock / RELEASE_SCAN_INTERVAL)
+    Release_Idle_Pages();
+}
 
-//   printf("\nFree list has size %d\n", free_list_size);
-//   int count = 0;
-//   for (struct node_header* runner = free_list_head; runner != NULL; runner = runner->next, count++ ) {
-//     printf("node %d:     ", count);
-//     printf("%d <-----------------------------\n", runner->size);
-//   }
-// }
\ No newline at end of file
+/*
+ * Frees a slab object into this thread's cache, or straight into its slab.
+ */
+static void Free_Object(void* object) {
+
+#ifdef MM_THREAD_SAFE
+  if(Get_Cache() != NULL) {
+    Cache_Slab_Free(object);
+    return;
+  }
+#endif
+  LOCK_SLABS();
+  slab_free(object);
+  UNLOCK_SLABS();
+}
+
+/*
+ * Frees a block with a header: a large block, a block of a thread cache or a block of the central heap.
+ * CALLER AGREEMENT: no lock is held.
+ */
+static void Free_Block(node_header* block) {
+
+  if(LOAD_HEADER(block) & LARGE) {
+    large_free(LARGE_HEADER(PAYLOAD(block)));
+    return;
+  }
+
+#ifdef MM_THREAD_SAFE
+  // Blocks that came from a thread cache go back to a thread cache.
+  if(OWNER(block) != 0) {
+    Cache_Free(block);
+    return;
+  }
+#endif
+
+  LOCK_HEAP();
+  heap_free(block);
+  UNLOCK_HEAP();
+}
+
+/*
+ * The in-place part of mm_realloc.
+ * CALLER AGREEMENT: "block" is an allocated block of the heap and the heap lock is held in thread-safe builds.
+ * @Returns the payload of the resized block, or NULL if it can't be resized without moving its contents.
+ */
+static void* heap_realloc(node_header* block, size_t size) {
+
+  size_t new_size = ALIGN(size + HEADER_SIZE);
+  if(new_size < MIN_BLOCK_SIZE)
+    new_size = MIN_BLOCK_SIZE;
+
+  size_t old_size = BLOCK_SIZE(block);
+  node_header* next = NEXT_BLOCK(block);
+  size_t available = old_size + ((next->size & ALLOCATED)? 0: BLOCK_SIZE(next));
+  void* resized = NULL;
+
+  // Grow into the free block after this one, then give back whatever isn't needed.
+  if(new_size <= available) {
+    if(available > old_size) {
+      Remove_Free_Block(next);
+      free_list_size -= available - old_size;
+      allocated_size += available - old_size;
+      Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, available - old_size));
+
+      block->size = available | (block->size & ~SIZE_MASK);
+      SET_FLAG(NEXT_BLOCK(block), PREV_ALLOCATED);
+    }
+    Shrink_Block(block, new_size);
+    resized = PAYLOAD(block);
+  }
+
+  // A huge block that fills its chunk (apart from a free tail) can take the whole chunk along with mem_remap.
+  else if(new_size >= MREMAP_THRESHOLD && (block->size & CHUNK_START) &&
+          (BLOCK_SIZE(next) == 0 || (!(next->size & ALLOCATED) && BLOCK_SIZE(NEXT_BLOCK(next)) == 0))) {
+    resized = Remap_Chunk(block, new_size);
+  }
+
+#ifdef MM_THREAD_SAFE
+  // Thread caches only hold small blocks, so a block that grew past that size goes back to the central heap when it is freed.
+  if(resized != NULL && BLOCK_SIZE(HEADER(resized)) > TCACHE_MAX_BLOCK)
+    CLEAR_FLAG(HEADER(resized), ~(((size_t)1 << OWNER_SHIFT) - 1));
+#endif
+
+  return resized;
+}
+
+/*
+ * Splits the tail off an allocated block so that it is "new_size" bytes long, if the tail is big enough to be a block of its own. The tail
+ * is freed and merged with the block after it.
+ */
+static void Shrink_Block(node_header* block, size_t new_size) {
+
+  size_t old_size = BLOCK_SIZE(block);
+  if(old_size - new_size < MIN_BLOCK_SIZE)
+    return;
+
+  block->size = new_size | (block->size & ~SIZE_MASK);
+  allocated_size -= old_size - new_size;
+  ADD_STAT(payload_size, -(old_size - new_size));
+
+  node_header* tail = NEXT_BLOCK(block);
+  Set_Free(tail, old_size - new_size, PREV_ALLOCATED);
+  CLEAR_FLAG(NEXT_BLOCK(tail), PREV_ALLOCATED);
+  free_list_size += old_size - new_size;
+  coalesce(tail);
+}
+
+/*
+ * Grows the chunk of a block that is the only allocated block in it with mem_remap, which may move the chunk. Any free tail of the chunk is
+ * absorbed and the block is left filling the whole chunk.
+ * @Returns the block's new payload, or NULL if mem_remap failed (nothing has changed then).
+ */
+static void* Remap_Chunk(node_header* block, size_t new_size) {
+
+  chunk_header* chunk = (chunk_header*) ((char*)block - sizeof(chunk_header));
+  size_t old_chunk_size = chunk->size;
+  size_t new_chunk_size = PAGE_ALIGN(new_size + CHUNK_OVERHEAD);
+  size_t old_size = BLOCK_SIZE(block);
+  node_header* tail = NEXT_BLOCK(block);
+
+  // The free tail's list neighbours point at its current address, so it has to leave the list before the chunk moves.
+  if(!(tail->size & ALLOCATED)) {
+    Remove_Free_Block(tail);
+    free_list_size -= BLOCK_SIZE(tail);
+  }
+  else
+    tail = NULL;
+
+  chunk_header* moved = mem_remap(chunk, old_chunk_size, new_chunk_size);
+  if(moved == NULL) {
+    if(tail != NULL) {
+      Insert_Free_Block(tail);
+      free_list_size += BLOCK_SIZE(tail);
+    }
+    return NULL;
+  }
+
+  // Point the chunk's neighbours at its new address.
+  if(moved->prev != NULL)
+    moved->prev->next = moved;
+  else
+    chunk_list = moved;
+  if(moved->next != NULL)
+    moved->next->prev = moved;
+  moved->size = new_chunk_size;
+  if(spare_chunk == chunk)
+    spare_chunk = moved;
+
+  block = (node_header*) (moved + 1);
+  new_size = new_chunk_size - CHUNK_OVERHEAD;
+  block->size = new_size | (block->size & ~SIZE_MASK);
+  NEXT_BLOCK(block)->size = ALLOCATED | PREV_ALLOCATED; // epilogue
+
+  Raise_Peak(&peak_heap_size, ADD_STAT(heap_size, new_chunk_size - old_chunk_size));
+  allocated_size += new_size - old_size;
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, new_size - old_size));
+
+  return PAYLOAD(block);
+}
+
+/*
+ * Maps the size of a block under EXACT_CLASS_LIMIT to the index of its free list.
+ */
+static int Size_Class(size_t size) {
+  return size / ALIGNMENT;
+}
+
+/*
+ * Finds the best place to fit a new block of the "requested_size".
+ *
+ * Every block in a size class has the same size, so the first block of the smallest non-empty class that is big enough is a perfect or best
+ * fit. If no class has one then the free tree gives the smallest bigger block.
+ *
+ * @returns a pointer to the start of the best-fitting free block for the "requested_size". That pointer will be NULL if no free block is large enough.
+ */
+static struct node_header* Best_Fit(size_t requested_size) {
+
+  // Use the bitmap to find the smallest class, starting with the requested size, that has a free block.
+  for(int class = (requested_size < EXACT_CLASS_LIMIT)? Size_Class(requested_size): NUM_SIZE_CLASSES; class < NUM_SIZE_CLASSES;
+      class = (class | 63) + 1) {
+
+    unsigned long bits = non_empty_classes[class / 64] & (~0UL << (class % 64));
+    if(bits != 0)
+      return free_lists[(class & ~63) + __builtin_ctzl(bits)];
+  }
+
+  // A twin fits just as well and is cheaper to take out of the tree.
+  tree_node* best_fit = Tree_Best_Fit(requested_size);
+  if(best_fit != NULL && best_fit->next_twin != NULL)
+    best_fit = best_fit->next_twin;
+  return (node_header*) best_fit;
+}
+
+/*
+* Uses mem_map to allocate a new chunk of memory for the "requested_space".
+* The chunk gets its header and epilogue and the space between them becomes a single free block in the free lists. free_list_size is updated.
+*
+* The requested space is rounded up to a multiple of the page size and must include CHUNK_OVERHEAD. Chunks grow geometrically: at least
+* grow_size bytes are mapped, and grow_size doubles up to MM_GROW_MAX, so a heap that keeps growing needs fewer and fewer calls to mem_map.
+* The pages past what is used yet are never touched, so they cost address space but no memory. If the new pages happen to sit right next
+* to a chunk that is already mapped, they become part of that chunk instead of a new one.
+* @Returns the new free block or NULL if mem_map failed.
+*/
+static node_header* extend_free_list(size_t requested_space) {
+
+  // Make sure the requested space is a multiple of the page size
+  size_t granted_space = PAGE_ALIGN(requested_space);
+  if(granted_space * GROW_PAD_LIMIT < grow_size)
+    granted_space = grow_size;
+
+  char* region = mem_map(granted_space);
+
+  // Settle for what was asked for if there isn't room to grow more.
+  if(region == NULL && granted_space > PAGE_ALIGN(requested_space)) {
+    granted_space = PAGE_ALIGN(requested_space);
+    region = mem_map(granted_space);
+  }
+  if(region == NULL)
+    return NULL;
+
+  chunks_mapped++;
+  if(grow_size * 2 <= MM_GROW_MAX)
+    grow_size *= 2;
+  Raise_Peak(&peak_heap_size, ADD_STAT(heap_size, granted_space));
+
+  node_header* merged = Merge_Chunk(region, granted_space);
+  if(merged != NULL)
+    return merged;
+
+  // Link the chunk in.
+  chunk_header* chunk = (chunk_header*) region;
+  chunk->prev = NULL;
+  chunk->next = chunk_list;
+  if(chunk_list != NULL)
+    chunk_list->prev = chunk;
+  chunk_list = chunk;
+  chunk->size = granted_space;
+  chunk_count++;
+
+  // Everything between the chunk header and the epilogue is one free block.
+  node_header* new_node = (node_header*) (chunk + 1);
+  Set_Free(new_node, granted_space - CHUNK_OVERHEAD, PREV_ALLOCATED | CHUNK_START);
+  NEXT_BLOCK(new_node)->size = ALLOCATED; // epilogue
+  Set_Fresh(new_node, (char*)new_node);
+  Insert_Free_Block(new_node);
+  free_list_size += BLOCK_SIZE(new_node);
+
+  return new_node;
+}
+
+/*
+ * Adds a newly mapped "region" of "size" bytes to a chunk that ends right where it starts or starts right where it ends. The region becomes
+ * a free block and is merged with the free block next to it, if any.
+ * - After a chunk, the old epilogue becomes the new block's header and a new epilogue goes at the end of the region.
+ * - Before a chunk, the chunk header moves to the start of the region, and the new block covers the rest of the region and the old header.
+ * @Returns the free block that holds the region, or NULL if no chunk is next to it.
+ */
+static node_header* Merge_Chunk(char* region, size_t size) {
+
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next) {
+
+    node_header* block;
+
+    if((char*)chunk + chunk->size == region) {
+      block = (node_header*) (region - HEADER_SIZE);
+      chunk->size += size;
+      Set_Free(block, size, block->size & PREV_ALLOCATED);
+      NEXT_BLOCK(block)->size = ALLOCATED; // epilogue
+    }
+    else if(region + size == (char*)chunk) {
+      chunk_header* moved = (chunk_header*) region;
+
+      *moved = *chunk;
+      moved->size += size;
+      if(moved->prev != NULL)
+        moved->prev->next = moved;
+      else
+        chunk_list = moved;
+      if(moved->next != NULL)
+        moved->next->prev = moved;
+      if(spare_chunk == chunk)
+        spare_chunk = moved;
+
+      // The old first block now follows a free block in the middle of the chunk. The old header ends up just before its footer, so it is
+      // cleared to leave the whole block zero.
+      memset(chunk, 0, sizeof(chunk_header));
+      block = (node_header*) (moved + 1);
+      Set_Free(block, size, PREV_ALLOCATED | CHUNK_START);
+      CLEAR_FLAG(NEXT_BLOCK(block), PREV_ALLOCATED | CHUNK_START);
+    }
+    else
+      continue;
+
+    Set_Fresh(block, (char*)block);
+    chunks_merged++;
+    free_list_size += size;
+    return coalesce(block);
+  }
+  return NULL;
+}
+
+/*
+ * @Returns 1 if "chunk" is a single free block, 0 otherwise.
+ */
+static int Chunk_Is_Empty(chunk_header* chunk) {
+
+  node_header* first = (node_header*) (chunk + 1);
+  return !(first->size & ALLOCATED) && BLOCK_SIZE(first) == chunk->size - CHUNK_OVERHEAD;
+}
+
+/*
+ * Writes the header and footer of a free block. "flags" may only hold PREV_ALLOCATED and CHUNK_START.
+ */
+static void Set_Free(node_header* block, size_t size, size_t flags) {
+  block->size = size | flags;
+  FOOTER(block)->size = size;
+  if(size >= EXACT_CLASS_LIMIT)
+    FRESH_FROM(block) = (char*)FOOTER(block);
+}
+
+/*
+* This method will be called only by free().
+*
+* Coalesces the newly freed block with the blocks physically before and after it if they are free. The header after the block belongs to
+* the next block, and if PREV_ALLOCATED is clear the footer before it belongs to the previous block, so both are found in constant time.
+* The merged block keeps the flags of whichever block comes first.
+*
+* CALLER AGREEMENT: "new_free_block" is marked free, is not in any free list and is already counted in free_list_size.
+* @Returns the coalesced block, which has been added to the free lists.
+*/
+static node_header* coalesce(node_header* new_free_block) {
+
+  size_t size = BLOCK_SIZE(new_free_block);
+  node_header* next = NEXT_BLOCK(new_free_block);
+  char* fresh = Fresh_Of(new_free_block);
+
+  // Absorb the next block. Whatever it had that was still zero is the merged block's.
+  if(!(next->size & ALLOCATED)) {
+    Remove_Free_Block(next);
+    size += BLOCK_SIZE(next);
+    fresh = Fresh_Of(next);
+  }
+
+  // Let the previous block absorb this one.
+  if(!(new_free_block->size & PREV_ALLOCATED)) {
+    new_free_block = (node_header*) ((char*)new_free_block - PREV_FOOTER(new_free_block)->size);
+    Remove_Free_Block(new_free_block);
+    size += BLOCK_SIZE(new_free_block);
+  }
+
+  Set_Free(new_free_block, size, new_free_block->size & (PREV_ALLOCATED | CHUNK_START));
+  Set_Fresh(new_free_block, fresh);
+  Insert_Free_Block(new_free_block);
+  return new_free_block;
+}
+
+/*
+ * Pushes a free block onto the front of the list for its size class, or puts it in the free tree if it is too big for the classes.
+ * CALLER AGREEMENT:
+ *    This method does not update the "free_list_size" so it is the caller's responsibility to do that.
+ */
+static void Insert_Free_Block(node_header* block) {
+
+  if(BLOCK_SIZE(block) >= EXACT_CLASS_LIMIT) {
+    Tree_Insert((tree_node*) block);
+    if(BLOCK_SIZE(block) >= RELEASE_MIN_BLOCK)
+      IDLE_SINCE(block) = release_clock;
+    return;
+  }
+
+  int size_class = Size_Class(BLOCK_SIZE(block));
+
+  block->prev = NULL;
+  block->next = free_lists[size_class];
+  if(block->next != NULL)
+    block->next->prev = block;
+
+  free_lists[size_class] = block;
+  non_empty_classes[size_class / 64] |= 1UL << (size_class % 64);
+}
+
+/*
+ * Unlinks a block from the list of its size class or from the free tree.
+ * CALLER AGREEMENT:
+ *    This method does not update the "free_list_size" so it is the caller's responsibility to do that.
+ */
+static void Remove_Free_Block(node_header* block) {
+
+  if(BLOCK_SIZE(block) >= EXACT_CLASS_LIMIT) {
+    Tree_Remove((tree_node*) block);
+    return;
+  }
+
+  int size_class = Size_Class(BLOCK_SIZE(block));
+
+  if(block->prev != NULL)
+    block->prev->next = block->next;
+  else
+    free_lists[size_class] = block->next;
+
+  if(block->next != NULL)
+    block->next->prev = block->prev;
+
+  // Clear the bit of the class if its list just became empty.
+  if(free_lists[size_class] == NULL)
+    non_empty_classes[size_class / 64] &= ~(1UL << (size_class % 64));
+}
+
+/*
+ * The free tree is a red-black tree of the free blocks of at least EXACT_CLASS_LIMIT bytes, keyed by size. Only one block of each size is
+ * in the tree, and the rest are its twins. Every path from the root to a leaf is at most twice as long as any other.
+ */
+#define IS_RED(node) ((node) != NULL && (node)->red)
+
+/* Puts "child" where "node" hangs from its parent */
+static void Tree_Replace(tree_node* node, tree_node* child) {
+
+  if(node->parent == NULL)
+    free_tree = child;
+  else if(node == node->parent->left)
+    node->parent->left = child;
+  else
+    node->parent->right = child;
+  if(child != NULL)
+    child->parent = node->parent;
+}
+
+static void Rotate_Left(tree_node* node) {
+
+  tree_node* child = node->right;
+
+  node->right = child->left;
+  if(child->left != NULL)
+    child->left->parent = node;
+  Tree_Replace(node, child);
+  child->left = node;
+  node->parent = child;
+}
+
+static void Rotate_Right(tree_node* node) {
+
+  tree_node* child = node->left;
+
+  node->left = child->right;
+  if(child->right != NULL)
+    child->right->parent = node;
+  Tree_Replace(node, child);
+  child->right = node;
+  node->parent = child;
+}
+
+/*
+ * Adds a free block to the tree and rebalances it, or makes it a twin of the block of its size if there is one.
+ */
+static void Tree_Insert(tree_node* node) {
+
+  tree_node* parent = NULL;
+  tree_node** link = &free_tree;
+  size_t size = BLOCK_SIZE(node);
+
+  while(*link != NULL) {
+    parent = *link;
+    if(size == BLOCK_SIZE(parent)) {
+      node->prev_twin = parent;
+      node->next_twin = parent->next_twin;
+      if(node->next_twin != NULL)
+        node->next_twin->prev_twin = node;
+      parent->next_twin = node;
+      return;
+    }
+    link = (size < BLOCK_SIZE(parent))? &parent->left: &parent->right;
+  }
+  *link = node;
+  node->parent = parent;
+  node->left = node->right = NULL;
+  node->next_twin = node->prev_twin = NULL;
+  node->red = 1;
+
+  // Two red nodes in a row are fixed by recoloring while the uncle is red, then by at most two rotations.
+  while(IS_RED(node->parent)) {
+    parent = node->parent;
+    tree_node* grandparent = parent->parent;
+
+    if(parent == grandparent->left) {
+      tree_node* uncle = grandparent->right;
+      if(IS_RED(uncle)) {
+        parent->red = uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+      if(node == parent->right) {
+        Rotate_Left(parent);
+        parent = node;
+      }
+      Rotate_Right(grandparent);
+    }
+    else {
+      tree_node* uncle = grandparent->left;
+      if(IS_RED(uncle)) {
+        parent->red = uncle->red = 0;
+        grandparent->red = 1;
+        node = grandparent;
+        continue;
+      }
+      if(node == parent->left) {
+        Rotate_Right(parent);
+        parent = node;
+      }
+      Rotate_Left(grandparent);
+    }
+    parent->red = 0;
+    grandparent->red = 1;
+    break;
+  }
+  free_tree->red = 0;
+}
+
+/*
+ * Takes a free block out of the tree. A twin is simply unlinked, and a block with twins hands its place in the tree to the first of them.
+ * Otherwise the tree is rebalanced.
+ */
+static void Tree_Remove(tree_node* node) {
+
+  if(node->prev_twin != NULL) {
+    node->prev_twin->next_twin = node->next_twin;
+    if(node->next_twin != NULL)
+      node->next_twin->prev_twin = node->prev_twin;
+    return;
+  }
+
+  tree_node* twin = node->next_twin;
+  if(twin != NULL) {
+    twin->prev_twin = NULL;
+    twin->left = node->left;
+    twin->right = node->right;
+    twin->red = node->red;
+    if(twin->left != NULL)
+      twin->left->parent = twin;
+    if(twin->right != NULL)
+      twin->right->parent = twin;
+    Tree_Replace(node, twin);
+    return;
+  }
+
+  tree_node* child;  // the node that moves into the place of the one taken out
+  tree_node* parent; // its new parent, since "child" may be NULL
+  size_t removed_red = node->red;
+
+  if(node->left == NULL || node->right == NULL) {
+    child = (node->left != NULL)? node->left: node->right;
+    parent = node->parent;
+    Tree_Replace(node, child);
+  }
+
+  // A node with two children swaps places with the next node in order, which has no left child.
+  else {
+    tree_node* next = node->right;
+    while(next->left != NULL)
+      next = next->left;
+
+    removed_red = next->red;
+    child = next->right;
+    if(next->parent == node)
+      parent = next;
+    else {
+      parent = next->parent;
+      Tree_Replace(next, next->right);
+      next->right = node->right;
+      next->right->parent = next;
+    }
+    Tree_Replace(node, next);
+    next->left = node->left;
+    next->left->parent = next;
+    next->red = node->red;
+  }
+
+  if(removed_red)
+    return;
+
+  // Taking out a black node leaves its side one black short, which is pushed up the tree until a red node or a rotation absorbs it.
+  while(child != free_tree && !IS_RED(child)) {
+    if(child == parent->left) {
+      tree_node* sibling = parent->right;
+      if(sibling->red) {
+        sibling->red = 0;
+        parent->red = 1;
+        Rotate_Left(parent);
+        sibling = parent->right;
+      }
+      if(!IS_RED(sibling->left) && !IS_RED(sibling->right)) {
+        sibling->red = 1;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+      if(!IS_RED(sibling->right)) {
+        sibling->left->red = 0;
+        sibling->red = 1;
+        Rotate_Right(sibling);
+        sibling = parent->right;
+      }
+      sibling->red = parent->red;
+      parent->red = 0;
+      sibling->right->red = 0;
+      Rotate_Left(parent);
+    }
+    else {
+      tree_node* sibling = parent->left;
+      if(sibling->red) {
+        sibling->red = 0;
+        parent->red = 1;
+        Rotate_Right(parent);
+        sibling = parent->left;
+      }
+      if(!IS_RED(sibling->left) && !IS_RED(sibling->right)) {
+        sibling->red = 1;
+        child = parent;
+        parent = child->parent;
+        continue;
+      }
+      if(!IS_RED(sibling->left)) {
+        sibling->right->red = 0;
+        sibling->red = 1;
+        Rotate_Left(sibling);
+        sibling = parent->left;
+      }
+      sibling->red = parent->red;
+      parent->red = 0;
+      sibling->left->red = 0;
+      Rotate_Right(parent);
+    }
+    child = free_tree;
+  }
+  if(child != NULL)
+    child->red = 0;
+}
+
+/*
+ * @Returns the node of the smallest size in the tree of at least "size" bytes, or NULL if there is none.
+ */
+static tree_node* Tree_Best_Fit(size_t size) {
+
+  tree_node* best_fit = NULL;
+
+  for(tree_node* node = free_tree; node != NULL; ) {
+    if(BLOCK_SIZE(node) == size) {
+      best_fit = node;
+      break;
+    }
+    if(BLOCK_SIZE(node) > size) {
+      best_fit = node;
+      node = node->left;
+    }
+    else
+      node = node->right;
+  }
+  return best_fit;
+}
+
+/*
+ * @Returns the node after "node" in the order of the tree, or NULL if it is the last.
+ */
+static tree_node* Tree_Next(tree_node* node) {
+
+  if(node->right != NULL) {
+    node = node->right;
+    while(node->left != NULL)
+      node = node->left;
+    return node;
+  }
+  while(node->parent != NULL && node == node->parent->right)
+    node = node->parent;
+  return node->parent;
+}
+
+/*
+ * Caller Agreement: The block must be able to fit in the specified size and already be 16-byte aligned.
+ * @param size is in bytes and includes the header.
+ * @Returns a pointer to the payload of the newly allocated block.
+*/
+static void* Allocate_Block(node_header* destination, size_t size) {
+
+  // Determine if the new block will split an existing free block or occupy the entire thing.
+  size_t total_space = BLOCK_SIZE(destination);
+  size_t remaining_free_space = total_space - size;
+  size_t flags = destination->size & (PREV_ALLOCATED | CHUNK_START);
+  char* fresh = Fresh_Of(destination);
+
+  Remove_Free_Block(destination);
+
+  // If the remaining space is too small to be a block then let the new data take up the whole block
+  if(remaining_free_space < MIN_BLOCK_SIZE) {
+    size = total_space;
+    destination->size = size | flags | ALLOCATED;
+    SET_FLAG(NEXT_BLOCK(destination), PREV_ALLOCATED);
+  }
+
+  // Otherwise allocate the new block but also put the remaining free space back into the free lists as a new node.
+  else {
+    destination->size = size | flags | ALLOCATED;
+
+    // Create a new free block for the remaining space, which will usually belong to a smaller class.
+    node_header* remainder = NEXT_BLOCK(destination);
+    Set_Free(remainder, remaining_free_space, PREV_ALLOCATED);
+    Set_Fresh(remainder, fresh);
+    Insert_Free_Block(remainder);
+  }
+
+  free_list_size -= size;
+  allocated_size += size;
+  allocated_blocks++;
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, size - HEADER_SIZE));
+
+  return PAYLOAD(destination);
+}
+
+/*
+ * @Returns where the part of a free "block" that is still zero from mem_map starts, or its footer if it has none.
+ */
+static char* Fresh_Of(node_header* block) {
+  return (BLOCK_SIZE(block) >= EXACT_CLASS_LIMIT)? FRESH_FROM(block): (char*)FOOTER(block);
+}
+
+/*
+ * Records that a free "block" is zero from "fresh" up to its footer, apart from what it writes at its start. A block outside the free tree
+ * has no room to remember it.
+ */
+static void Set_Fresh(node_header* block, char* fresh) {
+
+  if(BLOCK_SIZE(block) < EXACT_CLASS_LIMIT)
+    return;
+  if(fresh < (char*)block + FREE_METADATA)
+    fresh = (char*)block + FREE_METADATA;
+  if(fresh > (char*)FOOTER(block))
+    fresh = (char*)FOOTER(block);
+  FRESH_FROM(block) = fresh;
+}
+
+/*
+ * Raises "*peak" to "value" if it is bigger. The heap and the slabs may race here in thread-safe builds, so the update is a compare-and-swap.
+ */
+static void Raise_Peak(size_t* peak, size_t value) {
+#ifdef MM_THREAD_SAFE
+  size_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while(value > old && !__atomic_compare_exchange_n(peak, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+#else
+  if(value > *peak)
+    *peak = value;
+#endif
+}
+
+/*
+ * Hands the whole pages of long-idle free blocks back to the kernel with madvise(MADV_DONTNEED). The block's header, tree links, idle
+ * stamp, FRESH_FROM and footer are kept, so only the pages strictly between them go. Blocks smaller than RELEASE_MIN_BLOCK can't span such
+ * a page.
+ * CALLER AGREEMENT: the heap lock is held in thread-safe builds.
+ */
+static void Release_Idle_Pages(void) {
+#ifdef MADV_DONTNEED
+  for(tree_node* node = Tree_Best_Fit(RELEASE_MIN_BLOCK); node != NULL; node = Tree_Next(node)) {
+    for(tree_node* block = node; block != NULL; block = block->next_twin) {
+
+      if(IDLE_SINCE(block) == RELEASED || release_clock - IDLE_SINCE(block) < MM_RELEASE_IDLE)
+        continue;
+
+      uintptr_t start = PAGE_ALIGN((uintptr_t)block + FREE_METADATA);
+      uintptr_t end = (uintptr_t)FOOTER(block) & ~(uintptr_t)(mem_pagesize() - 1);
+      if(start < end && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+        released_size += end - start;
+        release_count++;
+      }
+      IDLE_SINCE(block) = RELEASED;
+    }
+  }
+#endif
+}
+
+/* ====================================================== Slabs =====================================================================*/
+
+/*
+ * Looks up what the page holding "ptr" is used for. This takes no lock: a leaf of the page map is published with a compare-and-swap and an
+ * entry only changes while nobody can hold a pointer into its page. Entries are still read and written atomically because a page can be
+ * unmapped by one allocator and mapped again by the other, and the ordering that the kernel gives them is invisible to the compiler.
+ */
+static int Page_Kind(void* ptr) {
+
+  uintptr_t page = (uintptr_t)ptr >> page_shift;
+  unsigned char** mid = __atomic_load_n(&page_map[PAGEMAP_INDEX(page, PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS, PAGEMAP_ROOT_BITS)], __ATOMIC_ACQUIRE);
+  unsigned char* leaf;
+
+  if(mid == NULL)
+    return PAGE_HEAP;
+  leaf = __atomic_load_n(&mid[PAGEMAP_INDEX(page, PAGEMAP_LEAF_BITS, PAGEMAP_MID_BITS)], __ATOMIC_ACQUIRE);
+  return (leaf == NULL)? PAGE_HEAP: __atomic_load_n(&leaf[PAGEMAP_INDEX(page, 0, PAGEMAP_LEAF_BITS)], __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the page map node in "slot", mapping a zeroed one of "size" bytes if there is none yet. mem_map memory is already zero, which
+ * is both a NULL pointer and PAGE_HEAP.
+ * @Returns NULL if a node was needed and could not be mapped.
+ */
+static void* Page_Map_Node(void** slot, size_t size) {
+
+  void* node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+  if(node == NULL) {
+    void* new_node = mem_map(PAGE_ALIGN(size));
+    if(new_node == NULL)
+      return NULL;
+
+    // Another thread may have published a node first.
+    if(__atomic_compare_exchange_n(slot, &node, new_node, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+      node = new_node;
+    else
+      mem_unmap(new_node, PAGE_ALIGN(size));
+  }
+  return node;
+}
+
+/*
+ * Records "kind" for every page from "start" to "start" + "size", mapping leaves of the page map as needed.
+ * @Returns -1 if a leaf could not be mapped. 0 otherwise.
+ */
+static int Set_Page_Kind(void* start, size_t size, int kind) {
+
+  uintptr_t page = (uintptr_t)start >> page_shift;
+  uintptr_t end = ((uintptr_t)start + size) >> page_shift;
+
+  for(; page < end; page++) {
+    // Nothing is PAGE_HEAP until its leaf exists, so clearing a page never maps one.
+    if(kind == PAGE_HEAP && Page_Kind((void*)(page << page_shift)) == PAGE_HEAP)
+      continue;
+
+    unsigned char** mid = Page_Map_Node((void**)&page_map[PAGEMAP_INDEX(page, PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS, PAGEMAP_ROOT_BITS)],
+                                        sizeof(unsigned char*) << PAGEMAP_MID_BITS);
+    if(mid == NULL)
+      return -1;
+    unsigned char* leaf = Page_Map_Node((void**)&mid[PAGEMAP_INDEX(page, PAGEMAP_LEAF_BITS, PAGEMAP_MID_BITS)], 1UL << PAGEMAP_LEAF_BITS);
+    if(leaf == NULL)
+      return -1;
+    __atomic_store_n(&leaf[PAGEMAP_INDEX(page, 0, PAGEMAP_LEAF_BITS)], kind, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+/*
+ * Unlinks a slab from a list of its class.
+ */
+static void Slab_Unlink(slab_header** list, slab_header* slab) {
+
+  if(slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if(slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+/*
+ * Pushes a slab onto the front of a list of its class.
+ */
+static void Slab_Push(slab_header** list, slab_header* slab) {
+
+  slab->prev = NULL;
+  slab->next = *list;
+  if(*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+/*
+ * Maps a page for a new, empty slab of "size_class" and puts it on the class's partial list. Its objects are carved out lazily from
+ * "unused", so nothing is written to the page besides the header.
+ * @Returns the slab or NULL if mem_map failed.
+ */
+static slab_header* New_Slab(int size_class) {
+
+  slab_header* slab = (slab_header*) mem_map(slab_size);
+  if(slab == NULL)
+    return NULL;
+  if(Set_Page_Kind(slab, slab_size, PAGE_SLAB) < 0) {
+    mem_unmap(slab, slab_size);
+    return NULL;
+  }
+
+  slab->free_objects = NULL;
+  slab->object_size = SLAB_OBJECT_SIZE(size_class);
+  slab->runs = 0;
+  if(slab->object_size <= TINY_MAX_OBJECT)
+    slab->runs = ((slab_size - sizeof(slab_header)) / slab->object_size + RUN_OBJECTS - 1) / RUN_OBJECTS;
+  slab->unused = SLAB_OBJECTS(slab);
+  slab->in_use = 0;
+  slab->capacity = ((char*)slab + slab_size - slab->unused) / slab->object_size;
+  slab->size_class = size_class;
+  slab->first_free = 0;
+  slab->owner = 0;
+
+  // The bits past the last object read as in use, so that the bit scan never picks them.
+  for(size_t index = slab->capacity; index < (size_t)slab->runs * RUN_OBJECTS; index++)
+    slab->occupied[index / RUN_OBJECTS] |= (uint64_t)1 << (index % RUN_OBJECTS);
+
+  Slab_Push(&slab_classes[size_class].partial, slab);
+  slab_classes[size_class].empty++;
+  slab_count++;
+  Raise_Peak(&peak_heap_size, ADD_STAT(heap_size, slab_size));
+
+  return slab;
+}
+
+/*
+ * Hands out one object of "size_class" from the first partial slab of the class, mapping a new slab if there are none.
+ * CALLER AGREEMENT: the slab lock is held in thread-safe builds.
+ * @Returns the object or NULL if mem_map failed.
+ */
+static void* slab_malloc(int size_class) {
+
+  slab_class* class = &slab_classes[size_class];
+  slab_header* slab = class->partial;
+  void* object;
+
+  if(slab == NULL) {
+    slab = New_Slab(size_class);
+    if(slab == NULL)
+      return NULL;
+  }
+
+  // A tiny slab hands out the first object that its bitmap has clear. Any other reuses a freed object if there is one, otherwise carves a
+  // new one.
+  if(slab->runs != 0) {
+    unsigned int run = slab->first_free;
+    while(slab->occupied[run] == ~(uint64_t)0)
+      run++;
+    int bit = __builtin_ctzll(~slab->occupied[run]);
+    slab->occupied[run] |= (uint64_t)1 << bit;
+    slab->first_free = run;
+    object = SLAB_OBJECTS(slab) + ((size_t)run * RUN_OBJECTS + bit) * slab->object_size;
+  }
+  else {
+    object = slab->free_objects;
+    if(object != NULL)
+      slab->free_objects = *(void**)object;
+    else {
+      object = slab->unused;
+      slab->unused += slab->object_size;
+    }
+  }
+
+  if(slab->in_use++ == 0)
+    class->empty--;
+  if(slab->in_use == slab->capacity) {
+    Slab_Unlink(&class->partial, slab);
+    Slab_Push(&class->full, slab);
+  }
+
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, slab->object_size));
+  return object;
+}
+
+/*
+ * Returns an object to the slab it came from, which is found by masking its address down to the start of the page. A slab that becomes
+ * empty is unmapped if its class already has an empty slab to fall back on.
+ * CALLER AGREEMENT: the slab lock is held in thread-safe builds.
+ */
+static void slab_free(void* object) {
+
+  slab_header* slab = (slab_header*) ((uintptr_t)object & ~(uintptr_t)(slab_size - 1));
+  slab_class* class = &slab_classes[slab->size_class];
+
+  if(slab->runs != 0) {
+    size_t index = ((char*)object - SLAB_OBJECTS(slab)) / slab->object_size;
+    slab->occupied[index / RUN_OBJECTS] &= ~((uint64_t)1 << (index % RUN_OBJECTS));
+    if(index / RUN_OBJECTS < slab->first_free)
+      slab->first_free = index / RUN_OBJECTS;
+  }
+  else {
+    *(void**)object = slab->free_objects;
+    slab->free_objects = object;
+  }
+  ADD_STAT(payload_size, -(size_t)slab->object_size);
+
+  if(slab->in_use-- == slab->capacity) {
+    Slab_Unlink(&class->full, slab);
+    Slab_Push(&class->partial, slab);
+  }
+
+  if(slab->in_use == 0) {
+    if(class->empty > 0) {
+      Slab_Unlink(&class->partial, slab);
+      Set_Page_Kind(slab, slab_size, PAGE_HEAP);
+      slab_count--;
+      ADD_STAT(heap_size, -slab_size);
+      mem_unmap(slab, slab_size);
+    }
+    else
+      class->empty++;
+  }
+}
+
+/*
+ * Unmaps every slab. Called by mm_init with the slab lock held.
+ */
+static void Release_Slabs(void) {
+
+  for(int size_class = 0; size_class < ALL_SLAB_CLASSES; size_class++) {
+    slab_header* lists[2] = { slab_classes[size_class].partial, slab_classes[size_class].full };
+
+    for(int i = 0; i < 2; i++) {
+      while(lists[i] != NULL) {
+        slab_header* slab = lists[i];
+        lists[i] = slab->next;
+        Set_Page_Kind(slab, slab_size, PAGE_HEAP);
+        mem_unmap(slab, slab_size);
+      }
+    }
+  }
+  memset(slab_classes, 0, sizeof(slab_classes));
+  slab_count = 0;
+}
+
+/* =================================================== Large Blocks =================================================================*/
+
+/*
+ * Maps a region of its own for a request of at least MM_LARGE_THRESHOLD bytes, or for one that needs more than ALIGNMENT. The large_header
+ * goes right before the payload and links the block into large_list so that mm_init can find it. To align the payload, the region is
+ * mapped "alignment" bytes bigger and the whole pages before the header's page and after the payload are unmapped again.
+ * @Returns the payload or NULL if mem_map failed.
+ */
+static void* large_malloc(size_t size, size_t alignment) {
+
+  size_t slack = (alignment > sizeof(large_header))? alignment: sizeof(large_header);
+  if(size > SIZE_MASK - slack - mem_pagesize())
+    return NULL;
+  size_t mapped = PAGE_ALIGN(size + slack);
+
+  char* mapping = mem_map(mapped);
+  if(mapping == NULL)
+    return NULL;
+
+  char* payload = (char*) (((uintptr_t)mapping + sizeof(large_header) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  large_header* header = LARGE_HEADER(payload);
+  if(alignment > ALIGNMENT) {
+    size_t lead = ((uintptr_t)header & ~(uintptr_t)(mem_pagesize() - 1)) - (uintptr_t)mapping;
+    size_t used = PAGE_ALIGN((uintptr_t)payload + size - (uintptr_t)mapping);
+
+    if(mapped > used)
+      mem_unmap(mapping + used, mapped - used);
+    if(lead != 0)
+      mem_unmap(mapping, lead);
+    mapping += lead;
+    mapped = used - lead;
+  }
+  header->mapping = mapping;
+  header->size = mapped | LARGE | ALLOCATED;
+
+  LOCK_HEAP();
+  header->prev = NULL;
+  header->next = large_list;
+  if(large_list != NULL)
+    large_list->prev = header;
+  large_list = header;
+  large_count++;
+  large_size += mapped;
+  UNLOCK_HEAP();
+
+  Raise_Peak(&peak_heap_size, ADD_STAT(heap_size, mapped));
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, LARGE_USABLE(header)));
+  return payload;
+}
+
+/*
+ * Unlinks a large block and unmaps its region.
+ */
+static void large_free(large_header* header) {
+
+  size_t mapped = BLOCK_SIZE(header);
+
+  LOCK_HEAP();
+  if(header->prev != NULL)
+    header->prev->next = header->next;
+  else
+    large_list = header->next;
+  if(header->next != NULL)
+    header->next->prev = header->prev;
+  large_count--;
+  large_size -= mapped;
+  UNLOCK_HEAP();
+
+  ADD_STAT(heap_size, -mapped);
+  ADD_STAT(payload_size, -LARGE_USABLE(header));
+  mem_unmap(header->mapping, mapped);
+}
+
+/*
+ * Resizes a large block with mem_remap, which moves pages instead of bytes when the region has to move. A block that shrinks below
+ * MM_LARGE_THRESHOLD is left to mm_realloc so that it moves into the heap, and so is an aligned block, whose header isn't at the start of
+ * its region.
+ * @Returns the resized payload, or NULL if mm_realloc has to copy it (the block is then untouched).
+ */
+static void* large_realloc(large_header* header, size_t size) {
+
+  if(size < MM_LARGE_THRESHOLD || size > SIZE_MASK - sizeof(large_header) - mem_pagesize() || header->mapping != header)
+    return NULL;
+
+  size_t old_mapped = BLOCK_SIZE(header);
+  size_t new_mapped = PAGE_ALIGN(size + sizeof(large_header));
+  if(new_mapped == old_mapped)
+    return header + 1;
+
+  // The list links point at the header, so nobody may follow them while it moves.
+  LOCK_HEAP();
+  large_header* moved = mem_remap(header, old_mapped, new_mapped);
+  if(moved == NULL) {
+    UNLOCK_HEAP();
+    return NULL;
+  }
+
+  moved->mapping = moved;
+  moved->size = new_mapped | LARGE | ALLOCATED;
+  if(moved->prev != NULL)
+    moved->prev->next = moved;
+  else
+    large_list = moved;
+  if(moved->next != NULL)
+    moved->next->prev = moved;
+  large_size += new_mapped - old_mapped;
+  UNLOCK_HEAP();
+
+  Raise_Peak(&peak_heap_size, ADD_STAT(heap_size, new_mapped - old_mapped));
+  Raise_Peak(&peak_payload_size, ADD_STAT(payload_size, new_mapped - old_mapped));
+  return moved + 1;
+}
+
+/* ================================================== Heap Checking =================================================================*/
+
+/*
+ * Prints one problem that mm_check found and counts it.
+ */
+static void Check_Failed(const char* format, ...) {
+
+  va_list args;
+
+  va_start(args, format);
+  fprintf(check_out, "mm_check: ");
+  vfprintf(check_out, format, args);
+  fprintf(check_out, "\n");
+  va_end(args);
+  check_errors++;
+}
+
+/*
+ * Walks the blocks of every chunk, checking the chunk list, each block's size, alignment, flags and footer, and that the block after a free
+ * block is allocated. The totals are compared with the counters that the heap keeps.
+ * "*free_blocks" gets the number of free blocks seen.
+ */
+static void Check_Chunks(size_t* free_blocks) {
+
+  size_t chunks = 0, free_bytes = 0, allocated_bytes = 0, allocated_count = 0;
+  int spare_found = 0;
+
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next) {
+
+    chunks++;
+    spare_found |= (chunk == spare_chunk);
+    if(chunk->next != NULL && chunk->next->prev != chunk)
+      Check_Failed("chunk %p: the next chunk's prev is %p", (void*)chunk, (void*)chunk->next->prev);
+    if(chunk->size % mem_pagesize() != 0 || chunk->size < mem_pagesize()) {
+      Check_Failed("chunk %p: size %zu is not a positive multiple of the page size", (void*)chunk, chunk->size);
+      continue;
+    }
+
+    char* end = (char*)chunk + chunk->size - HEADER_SIZE; // the epilogue
+    node_header* block = (node_header*) (chunk + 1);
+    int prev_allocated = 1;
+
+    if(!(block->size & CHUNK_START))
+      Check_Failed("chunk %p: the first block has no CHUNK_START flag", (void*)chunk);
+
+    while((char*)block < end) {
+      size_t size = BLOCK_SIZE(block);
+
+      if(size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 || (char*)block + size > end) {
+        Check_Failed("block %p: bad size %zu", (void*)block, size);
+        break;
+      }
+      if((uintptr_t)PAYLOAD(block) % ALIGNMENT != 0)
+        Check_Failed("block %p: payload is not %d-byte aligned", (void*)block, ALIGNMENT);
+      if(!(block->size & PREV_ALLOCATED) != !prev_allocated)
+        Check_Failed("block %p: PREV_ALLOCATED is %s but the block before it is %s", (void*)block,
+                     (block->size & PREV_ALLOCATED)? "set": "clear", prev_allocated? "allocated": "free");
+      if((block->size & CHUNK_START) && block != (node_header*) (chunk + 1))
+        Check_Failed("block %p: CHUNK_START in the middle of chunk %p", (void*)block, (void*)chunk);
+      if(block->size & LARGE)
+        Check_Failed("block %p: LARGE flag on a heap block", (void*)block);
+
+      if(block->size & ALLOCATED) {
+        allocated_bytes += size;
+        allocated_count++;
+      }
+      else {
+        if(!prev_allocated)
+          Check_Failed("block %p: two free blocks next to each other were not coalesced", (void*)block);
+        if(FOOTER(block)->size != size)
+          Check_Failed("block %p: footer says %zu but the header says %zu", (void*)block, FOOTER(block)->size, size);
+        if(block->size >> OWNER_SHIFT)
+          Check_Failed("block %p: free block has an owner", (void*)block);
+        if(size >= EXACT_CLASS_LIMIT)
+          Check_Fresh(block);
+        free_bytes += size;
+        (*free_blocks)++;
+      }
+      prev_allocated = block->size & ALLOCATED;
+      block = NEXT_BLOCK(block);
+    }
+
+    if((char*)block == end) {
+      if(BLOCK_SIZE(block) != 0 || !(block->size & ALLOCATED))
+        Check_Failed("chunk %p: bad epilogue %#zx", (void*)chunk, block->size);
+      if(!(block->size & PREV_ALLOCATED) != !prev_allocated)
+        Check_Failed("chunk %p: the epilogue's PREV_ALLOCATED is wrong", (void*)chunk);
+    }
+  }
+
+  if(chunks != chunk_count)
+    Check_Failed("chunk_count is %zu but %zu chunks are linked", chunk_count, chunks);
+  if(spare_chunk != NULL && !spare_found)
+    Check_Failed("the spare chunk %p is not linked", (void*)spare_chunk);
+  if(free_bytes != free_list_size)
+    Check_Failed("free_list_size is %zu but the chunks have %zu free bytes", free_list_size, free_bytes);
+  if(allocated_bytes != allocated_size || allocated_count != allocated_blocks)
+    Check_Failed("%zu blocks of %zu bytes are counted as allocated but the chunks have %zu blocks of %zu bytes",
+                 allocated_blocks, allocated_size, allocated_count, allocated_bytes);
+}
+
+/*
+ * Checks every list of free blocks under EXACT_CLASS_LIMIT and the free tree: the links both ways, the bitmap, that every entry is a free
+ * block of a chunk in the right place, and the order and balance of the tree.
+ * @Returns the number of blocks in the lists and the tree.
+ */
+static size_t Check_Free_Lists(void) {
+
+  size_t listed = 0;
+
+  for(int size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+    int bit = (non_empty_classes[size_class / 64] >> (size_class % 64)) & 1;
+    if(bit != (free_lists[size_class] != NULL))
+      Check_Failed("class %d: the bitmap says %s but the list is %s", size_class, bit? "non-empty": "empty",
+                   (free_lists[size_class] != NULL)? "non-empty": "empty");
+
+    node_header* prev = NULL;
+    for(node_header* block = free_lists[size_class]; block != NULL; block = block->next) {
+      if(block->prev != prev) {
+        Check_Failed("class %d: block %p has prev %p instead of %p", size_class, (void*)block, (void*)block->prev, (void*)prev);
+        break;
+      }
+      Check_Free_Entry(block);
+      if(BLOCK_SIZE(block) >= EXACT_CLASS_LIMIT || Size_Class(BLOCK_SIZE(block)) != size_class)
+        Check_Failed("block %p: %zu bytes is in the list of class %d", (void*)block, BLOCK_SIZE(block), size_class);
+      prev = block;
+      listed++;
+    }
+  }
+
+  int black_height;
+  if(IS_RED(free_tree))
+    Check_Failed("the root of the free tree is red");
+  if(free_tree != NULL && free_tree->parent != NULL)
+    Check_Failed("the root of the free tree has a parent");
+  return listed + Check_Tree(free_tree, NULL, EXACT_CLASS_LIMIT, SIZE_MASK, &black_height);
+}
+
+/*
+ * Checks that the part of a free block of the tree that is supposed to be zero from mem_map is.
+ */
+static void Check_Fresh(node_header* block) {
+
+  char* fresh = FRESH_FROM(block);
+  if(fresh < (char*)block + FREE_METADATA || fresh > (char*)FOOTER(block) || ((uintptr_t)fresh % sizeof(size_t)) != 0) {
+    Check_Failed("block %p: it is zero from %p on, which is outside the block", (void*)block, (void*)fresh);
+    return;
+  }
+  for(size_t* word = (size_t*)fresh; word < (size_t*)FOOTER(block); word++)
+    if(*word != 0) {
+      Check_Failed("block %p: %p should still be zero from mem_map but isn't", (void*)block, (void*)word);
+      return;
+    }
+}
+
+/*
+ * Checks that every entry of the quick lists is an allocated block of a chunk in the list of its size, and that the lists add up to
+ * quick_count blocks and quick_size bytes.
+ */
+static void Check_Quick_Lists(void) {
+
+  size_t count = 0, bytes = 0;
+
+  for(int size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+    for(node_header* block = quick_lists[size_class]; block != NULL; block = block->next) {
+      if(Find_Chunk(block) == NULL) {
+        Check_Failed("quick block %p is not in any chunk", (void*)block);
+        break;
+      }
+      if(!(block->size & ALLOCATED) || (block->size & LARGE))
+        Check_Failed("quick block %p is not marked allocated", (void*)block);
+      if(BLOCK_SIZE(block) >= EXACT_CLASS_LIMIT || Size_Class(BLOCK_SIZE(block)) != size_class)
+        Check_Failed("quick block %p: %zu bytes is in the quick list of class %d", (void*)block, BLOCK_SIZE(block), size_class);
+      if(++count > quick_count)
+        break;
+      bytes += BLOCK_SIZE(block);
+    }
+  }
+  if(count != quick_count || bytes != quick_size)
+    Check_Failed("the quick lists hold %zu blocks and %zu bytes but the counters say %zu and %zu", count, bytes, quick_count, quick_size);
+}
+
+/*
+ * Checks the subtree under "node": parent links, sizes from "low" to "high" so that the tree is in order and has no duplicates,
+ * no red node with a red child, the same number of black nodes on every path, and each node's twins.
+ * "*black_height" gets the number of black nodes on a path down from "node".
+ * @Returns the number of blocks in the subtree, twins included.
+ */
+static size_t Check_Tree(tree_node* node, tree_node* parent, size_t low, size_t high, int* black_height) {
+
+  *black_height = 1;
+  if(node == NULL)
+    return 0;
+
+  size_t size = BLOCK_SIZE(node);
+  size_t count = 1;
+  int left_height, right_height;
+
+  Check_Free_Entry((node_header*) node);
+  if(node->parent != parent)
+    Check_Failed("tree node %p has parent %p instead of %p", (void*)node, (void*)node->parent, (void*)parent);
+  if(size < low || size > high)
+    Check_Failed("tree node %p: %zu bytes is out of order (%zu to %zu)", (void*)node, size, low, high);
+  if(node->red && (IS_RED(node->left) || IS_RED(node->right)))
+    Check_Failed("tree node %p: a red node has a red child", (void*)node);
+  if(node->prev_twin != NULL)
+    Check_Failed("tree node %p is in the tree but has a prev twin", (void*)node);
+
+  tree_node* prev = node;
+  for(tree_node* twin = node->next_twin; twin != NULL; twin = twin->next_twin) {
+    if(twin->prev_twin != prev) {
+      Check_Failed("twin %p has prev twin %p instead of %p", (void*)twin, (void*)twin->prev_twin, (void*)prev);
+      break;
+    }
+    Check_Free_Entry((node_header*) twin);
+    if(BLOCK_SIZE(twin) != size)
+      Check_Failed("twin %p: %zu bytes is a twin of %zu bytes", (void*)twin, BLOCK_SIZE(twin), size);
+    prev = twin;
+    count++;
+  }
+
+  count += Check_Tree(node->left, node, low, size - 1, &left_height);
+  count += Check_Tree(node->right, node, size + 1, high, &right_height);
+  if(left_height != right_height)
+    Check_Failed("tree node %p: %d black nodes on the left and %d on the right", (void*)node, left_height, right_height);
+  *black_height = left_height + !node->red;
+  return count;
+}
+
+/*
+ * Checks that an entry of a free list or of the free tree is a free block inside some chunk.
+ */
+static void Check_Free_Entry(node_header* block) {
+
+  chunk_header* chunk = Find_Chunk(block);
+
+  if(chunk == NULL)
+    Check_Failed("free block %p is not in any chunk", (void*)block);
+  else if(block->size & ALLOCATED)
+    Check_Failed("free block %p is marked allocated", (void*)block);
+}
+
+/*
+ * @Returns the chunk whose blocks include "ptr", or NULL.
+ */
+static chunk_header* Find_Chunk(void* ptr) {
+
+  for(chunk_header* chunk = chunk_list; chunk != NULL; chunk = chunk->next) {
+    if((char*)ptr >= (char*)(chunk + 1) && (char*)ptr < (char*)chunk + chunk->size - HEADER_SIZE)
+      return chunk;
+  }
+  return NULL;
+}
+
+/*
+ * Checks the lists of every slab class: the links, the page map, how many objects are in use and that every freed object lies on an
+ * object boundary of a part of the slab that was handed out.
+ */
+static void Check_Slabs(void) {
+
+  size_t slabs = 0;
+
+  for(int size_class = 0; size_class < ALL_SLAB_CLASSES; size_class++) {
+    slab_header* lists[2] = { slab_classes[size_class].partial, slab_classes[size_class].full };
+    int empty = 0;
+
+    for(int i = 0; i < 2; i++) {
+      slab_header* prev = NULL;
+
+      for(slab_header* slab = lists[i]; slab != NULL; slab = slab->next) {
+        char* first = SLAB_OBJECTS(slab);
+
+        if(slab->prev != prev) {
+          Check_Failed("slab %p has prev %p instead of %p", (void*)slab, (void*)slab->prev, (void*)prev);
+          break;
+        }
+        prev = slab;
+        slabs++;
+
+        if(Page_Kind(slab) != PAGE_SLAB)
+          Check_Failed("slab %p is not marked in the page map", (void*)slab);
+        if((int)slab->size_class != size_class || slab->object_size != (unsigned)SLAB_OBJECT_SIZE(size_class))
+          Check_Failed("slab %p of %u-byte objects is in the lists of class %d", (void*)slab, slab->object_size, size_class);
+        if(i == 0 && slab->in_use >= slab->capacity)
+          Check_Failed("slab %p is partial with %u of %u objects in use", (void*)slab, slab->in_use, slab->capacity);
+        if(i == 1 && slab->in_use != slab->capacity)
+          Check_Failed("slab %p is full with %u of %u objects in use", (void*)slab, slab->in_use, slab->capacity);
+        if(slab->runs != 0) {
+          Check_Tiny_Slab(slab);
+          if(slab->in_use == 0)
+            empty++;
+          continue;
+        }
+        if(slab->unused < first || slab->unused > (char*)slab + slab_size || (slab->unused - first) % slab->object_size != 0) {
+          Check_Failed("slab %p: bad unused pointer %p", (void*)slab, (void*)slab->unused);
+          continue;
+        }
+
+        // Every object that was carved out is either in use or on the free list.
+        size_t carved = (slab->unused - first) / slab->object_size;
+        size_t freed = 0;
+        for(char* object = slab->free_objects; object != NULL && freed <= carved; object = *(void**)object) {
+          if(object < first || object >= slab->unused || (object - first) % slab->object_size != 0) {
+            Check_Failed("slab %p: bad free object %p", (void*)slab, (void*)object);
+            break;
+          }
+          freed++;
+        }
+        if(freed + slab->in_use != carved)
+          Check_Failed("slab %p: %zu objects were carved but %zu are free and %u in use", (void*)slab, carved, freed, slab->in_use);
+        if(slab->in_use == 0)
+          empty++;
+      }
+    }
+
+    if(empty != slab_classes[size_class].empty)
+      Check_Failed("class %d: %d empty slabs are counted but %d are linked", size_class, slab_classes[size_class].empty, empty);
+  }
+
+  if(slabs != slab_count)
+    Check_Failed("slab_count is %zu but %zu slabs are linked", slab_count, slabs);
+}
+
+/*
+ * Checks the bitmap of a tiny slab: the runs cover exactly its objects, the bits past the last object are set, as many bits as objects in
+ * use are set below it, and no run before "first_free" has a clear bit.
+ */
+static void Check_Tiny_Slab(slab_header* slab) {
+
+  size_t in_use = 0;
+
+  if(slab->object_size > TINY_MAX_OBJECT || (size_t)slab->runs * RUN_OBJECTS < slab->capacity ||
+     (size_t)(slab->runs - 1) * RUN_OBJECTS >= slab->capacity || slab->first_free >= slab->runs) {
+    Check_Failed("slab %p: %u runs and first free run %u for %u objects of %u bytes", (void*)slab, slab->runs, slab->first_free,
+                 slab->capacity, slab->object_size);
+    return;
+  }
+
+  for(size_t index = 0; index < (size_t)slab->runs * RUN_OBJECTS; index++) {
+    int set = (slab->occupied[index / RUN_OBJECTS] >> (index % RUN_OBJECTS)) & 1;
+    if(index >= slab->capacity && !set) {
+      Check_Failed("slab %p: bit %zu past the last object is clear", (void*)slab, index);
+      return;
+    }
+    if(index < slab->capacity && set)
+      in_use++;
+    if(index / RUN_OBJECTS < slab->first_free && !set) {
+      Check_Failed("slab %p: object %zu is free but its run is before the first free run %u", (void*)slab, index, slab->first_free);
+      return;
+    }
+  }
+  if(in_use != slab->in_use)
+    Check_Failed("slab %p: %zu bits are set but %u objects are in use", (void*)slab, in_use, slab->in_use);
+}
+
+/*
+ * Checks the list of large blocks and their flags against large_count and large_size.
+ */
+static void Check_Large_Blocks(void) {
+
+  size_t count = 0, size = 0;
+  large_header* prev = NULL;
+
+  for(large_header* header = large_list; header != NULL; header = header->next) {
+    if(header->prev != prev) {
+      Check_Failed("large block %p has prev %p instead of %p", (void*)header, (void*)header->prev, (void*)prev);
+      break;
+    }
+    if((header->size & FLAGS) != (LARGE | ALLOCATED))
+      Check_Failed("large block %p has flags %#zx", (void*)header, header->size & FLAGS);
+    if((char*)header->mapping > (char*)header || BLOCK_SIZE(header) % mem_pagesize() != 0 ||
+       (uintptr_t)header->mapping % mem_pagesize() != 0)
+      Check_Failed("large block %p: mapping %p of %zu bytes", (void*)header, header->mapping, BLOCK_SIZE(header));
+    prev = header;
+    count++;
+    size += BLOCK_SIZE(header);
+  }
+
+  if(count != large_count || size != large_size)
+    Check_Failed("%zu large blocks of %zu bytes are counted but %zu of %zu bytes are linked", large_count, large_size, count, size);
+}
+
+#ifdef MM_DEBUG
+/*
+ * Runs mm_check every MM_CHECK_INTERVAL calls to mm_malloc and mm_free, and aborts if the heap is broken.
+ */
+static void Debug_Check(void) {
+
+  if(ADD_STAT(check_clock, 1) % MM_CHECK_INTERVAL == 0 && mm_check(stderr) < 0)
+    abort();
+}
+#endif
+
+#ifdef MM_PROFILE
+/* ==================================================== Profiling ===================================================================*/
+
+/*
+ * Allocates a block that the countdown picked as a sample and records it.
+ */
+static void* Sampled_Malloc(size_t size) {
+
+  profiling = 1;
+  return Profile_Allocation(mm_malloc(size), size);
+}
+
+/*
+ * Records "payload", which was just allocated with "profiling" set, under the call stack it was allocated from, restarts the countdown
+ * and clears "profiling". The first allocation of a thread only seeds its random numbers and starts its countdown.
+ *
+ * The frames at the top of the stack that lie in the same object as this function are the allocator's, and those of mm_preload.c when
+ * it is preloaded, so they are stripped to keep every entry point from hashing to a call site of its own. When the allocator is linked
+ * into the program itself the program's frames lie in that object too, and only the frame of this function is stripped.
+ *
+ * @returns "payload"
+ */
+static void* Profile_Allocation(void* payload, size_t size) {
+
+  void* stack[PROFILE_DEPTH + PROFILE_SKIP];
+  int first = (profile_random == 0);
+
+  if(first)
+    profile_random = ((uintptr_t)&profile_random * 0x9E3779B97F4A7C15UL) | 1;
+  profile_countdown = Next_Sample_Gap();
+
+  if(payload != NULL && !first) {
+    int depth = backtrace(stack, PROFILE_DEPTH + PROFILE_SKIP);
+    int skip = 1;
+    Dl_info self, frame;
+    struct link_map* map;
+    // The program itself is always the first object in the list of loaded ones.
+    if(dladdr1((void*)Profile_Allocation, &self, (void**)&map, RTLD_DL_LINKMAP) != 0 && map->l_prev != NULL) {
+      int own = 0;
+      while(own < depth && own < PROFILE_SKIP && dladdr(stack[own], &frame) != 0 && frame.dli_fbase == self.dli_fbase)
+        own++;
+      if(own < depth)
+        skip = (own > skip)? own: skip;
+    }
+    depth -= skip;
+    if(depth > PROFILE_DEPTH)
+      depth = PROFILE_DEPTH;
+
+    profile_site* site = (depth > 0)? Find_Site(stack + skip, depth): NULL;
+    if(site != NULL) {
+      ADD_STAT(site->samples, 1);
+      ADD_STAT(site->bytes, size);
+      Add_Sample(payload, site, size);
+    }
+    else
+      ADD_STAT(profile_dropped, 1);
+  }
+  profiling = 0;
+  return payload;
+}
+
+/*
+ * Draws the bytes until this thread's next sample from an exponential distribution with a mean of profile_rate, with xorshift64* as the
+ * source of uniform numbers.
+ */
+static long Next_Sample_Gap(void) {
+
+  profile_random ^= profile_random >> 12;
+  profile_random ^= profile_random << 25;
+  profile_random ^= profile_random >> 27;
+  double uniform = ((profile_random * 0x2545F4914F6CDD1DUL) >> 11) * 0x1.0p-53;
+  return (long)(-log(1.0 - uniform) * profile_rate);
+}
+
+/*
+ * Returns the call site of "stack", claiming an unused slot of profile_sites for it the first time it is seen, or NULL if none of the
+ * PROFILE_PROBES slots it may live in are left.
+ */
+static profile_site* Find_Site(void** stack, int depth) {
+
+  uint64_t hash = 0xCBF29CE484222325UL;
+  for(int i = 0; i < depth; i++)
+    hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001B3UL;
+  hash |= 1;
+
+  for(int probe = 0; probe < PROFILE_PROBES; probe++) {
+    profile_site* site = &profile_sites[(hash + probe) % PROFILE_SITES];
+    uint64_t found = __atomic_load_n(&site->hash, __ATOMIC_ACQUIRE);
+
+    if(found == 0 && __atomic_compare_exchange_n(&site->hash, &found, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      memcpy(site->stack, stack, depth * sizeof(void*));
+      site->depth = depth;
+      __atomic_store_n(&site->ready, 1, __ATOMIC_RELEASE);
+      return site;
+    }
+    if(found != hash)
+      continue;
+
+    // The thread that claimed the slot may still be copying its stack.
+    while(!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE))
+      ;
+    if(site->depth == depth && memcmp(site->stack, stack, depth * sizeof(void*)) == 0)
+      return site;
+  }
+  return NULL;
+}
+
+/*
+ * Remembers that the block at "ptr" is a live sample of "site", in the first free one of the PROFILE_PROBES slots of profile_samples
+ * that its address hashes to. The sample is dropped if they are all taken.
+ */
+static void Add_Sample(void* ptr, profile_site* site, size_t size) {
+
+  size_t slot = PROFILE_HASH(ptr) >> 32;
+
+  for(int probe = 0; probe < PROFILE_PROBES; probe++) {
+    profile_sample* sample = &profile_samples[(slot + probe) % PROFILE_SAMPLES];
+    void* old = __atomic_load_n(&sample->ptr, __ATOMIC_RELAXED);
+
+    if((old == NULL || old == FREED_SAMPLE)
+       && __atomic_compare_exchange_n(&sample->ptr, &old, ptr, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      sample->site = site;
+      sample->size = size;
+      ADD_STAT(site->live_samples, 1);
+      ADD_STAT(site->live_bytes, size);
+      __atomic_add_fetch(&PROFILE_FILTER(ptr), 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  ADD_STAT(profile_dropped, 1);
+}
+
+/*
+ * Forgets the live sample at "ptr" if there is one.
+ * @returns the sample's call site, with its size in "*size", or NULL if "ptr" wasn't sampled.
+ */
+static profile_site* Take_Sample(void* ptr, size_t* size) {
+
+  size_t slot = PROFILE_HASH(ptr) >> 32;
+
+  if(__atomic_load_n(&PROFILE_FILTER(ptr), __ATOMIC_RELAXED) == 0)
+    return NULL;
+
+  for(int probe = 0; probe < PROFILE_PROBES; probe++) {
+    profile_sample* sample = &profile_samples[(slot + probe) % PROFILE_SAMPLES];
+
+    if(__atomic_load_n(&sample->ptr, __ATOMIC_ACQUIRE) == ptr) {
+      profile_site* site = sample->site;
+      *size = sample->size;
+      __atomic_store_n(&sample->ptr, FREED_SAMPLE, __ATOMIC_RELEASE);
+      ADD_STAT(site->live_samples, -1);
+      ADD_STAT(site->live_bytes, -*size);
+      __atomic_sub_fetch(&PROFILE_FILTER(ptr), 1, __ATOMIC_RELAXED);
+      return site;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Called by every free for a block whose address the filter says may be a live sample.
+ */
+static void Profile_Free(void* ptr) {
+
+  size_t size;
+  Take_Sample(ptr, &size);
+}
+
+/*
+ * Moves a live sample along with a block that mm_realloc moved without going through mm_malloc and mm_free.
+ */
+static void Profile_Move(void* old_ptr, void* new_ptr) {
+
+  size_t size;
+  profile_site* site = Take_Sample(old_ptr, &size);
+  if(site != NULL)
+    Add_Sample(new_ptr, site, size);
+}
+
+/*
+ * Forgets the live samples of the previous heap, keeping the call sites and their totals. Called by mm_init.
+ */
+static void Reset_Profile(void) {
+
+  const char* rate = getenv("MM_PROFILE_RATE");
+  if(rate != NULL && atol(rate) > 0)
+    profile_rate = atol(rate);
+
+  memset(profile_samples, 0, sizeof(profile_samples));
+  memset(profile_filter, 0, sizeof(profile_filter));
+  for(int i = 0; i < PROFILE_SITES; i++)
+    profile_sites[i].live_samples = profile_sites[i].live_bytes = 0;
+}
+
+/*
+ * A block of "size" bytes is sampled with probability 1 - exp(-size / profile_rate), so a sample stands for 1 / that many such blocks.
+ * @returns that factor for samples whose average size is "bytes" / "samples".
+ */
+static double Sample_Scale(size_t samples, size_t bytes) {
+
+  if(samples == 0)
+    return 0;
+  return 1 / (1 - exp(-((double)bytes / samples) / profile_rate));
+}
+#endif
+
+#ifdef MM_THREAD_SAFE
+/* ================================================== Thread Caches =================================================================*/
+
+/*
+ * Gives TCACHE_BATCH blocks of a bin back to the central heap under one acquisition of the lock.
+ */
+static void Flush_Bin(thread_cache* cache, int bin) {
+
+  LOCK_HEAP();
+  for(int i = 0; i < TCACHE_BATCH && cache->bins[bin] != NULL; i++) {
+    node_header* block = cache->bins[bin];
+    cache->bins[bin] = block->next;
+    cache->counts[bin]--;
+    heap_free(block);
+  }
+  UNLOCK_HEAP();
+}
+
+/*
+ * Fills an empty bin with up to TCACHE_BATCH blocks of "size" bytes from the central heap under one acquisition of the lock.
+ */
+static void Refill_Bin(thread_cache* cache, int bin, size_t size) {
+
+  LOCK_HEAP();
+  for(int i = 0; i < TCACHE_BATCH; i++) {
+    void* payload = heap_malloc(size);
+    if(payload == NULL)
+      break;
+
+    node_header* block = HEADER(payload);
+    SET_FLAG(block, cache->id << OWNER_SHIFT);
+    block->next = cache->bins[bin];
+    cache->bins[bin] = block;
+    cache->counts[bin]++;
+  }
+  UNLOCK_HEAP();
+}
+
+/*
+ * Puts a block of this cache back into the bin for its size. A block may be up to MIN_BLOCK_SIZE bigger than the size it was asked for, so
+ * the biggest ones go into the last bin.
+ */
+static void Cache_Push(thread_cache* cache, node_header* block) {
+
+  size_t size = LOAD_HEADER(block) & SIZE_MASK;
+  int bin = ((size < TCACHE_MAX_BLOCK)? size: TCACHE_MAX_BLOCK) / ALIGNMENT;
+
+  block->next = cache->bins[bin];
+  cache->bins[bin] = block;
+  if(++cache->counts[bin] > TCACHE_LIMIT)
+    Flush_Bin(cache, bin);
+}
+
+/*
+ * Takes every block that other threads freed into this cache with one atomic exchange and puts them into their bins. The bins may grow past
+ * TCACHE_LIMIT here without flushing, because the blocks are this cache's own and it never holds more than it handed out. Flushing them
+ * would send a thread that only allocates, while others free, to the heap lock once to give blocks back and once more to get them again.
+ */
+static void Drain_Remote_Frees(thread_cache* cache) {
+
+  node_header* block = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+  while(block != NULL) {
+    node_header* next = block->next;
+    size_t size = LOAD_HEADER(block) & SIZE_MASK;
+    int bin = ((size < TCACHE_MAX_BLOCK)? size: TCACHE_MAX_BLOCK) / ALIGNMENT;
+    block->next = cache->bins[bin];
+    cache->bins[bin] = block;
+    cache->counts[bin]++;
+    block = next;
+  }
+}
+
+/*
+ * Frees everything on the remote stacks of a cache that no thread uses, which nobody else would ever drain: the slab objects under the slab
+ * lock and the blocks under the heap lock.
+ */
+static void Free_Remote_Frees(thread_cache* cache) {
+
+  node_header* block = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_SEQ_CST);
+  void* object = __atomic_exchange_n(&cache->remote_slab_frees, NULL, __ATOMIC_SEQ_CST);
+
+  if(object != NULL) {
+    LOCK_SLABS();
+    while(object != NULL) {
+      void* next = *(void**)object;
+      slab_free(object);
+      object = next;
+    }
+    UNLOCK_SLABS();
+  }
+  if(block != NULL) {
+    LOCK_HEAP();
+    while(block != NULL) {
+      node_header* next = block->next;
+      heap_free(block);
+      block = next;
+    }
+    UNLOCK_HEAP();
+  }
+}
+
+/*
+ * Destructor of cache_key, run when a thread exits. Everything the cache holds goes back to the central heap and the cache is marked unused so
+ * that the next new thread takes it over. Blocks and objects that other threads free into it after that are freed by them directly.
+ */
+static void Cache_Exit(void* arg) {
+
+  thread_cache* cache = arg;
+  node_header* remote = __atomic_exchange_n(&cache->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  void* remote_object = __atomic_exchange_n(&cache->remote_slab_frees, NULL, __ATOMIC_ACQUIRE);
+
+  LOCK_SLABS();
+  while(cache->generation == heap_generation && remote_object != NULL) {
+    void* next = *(void**)remote_object;
+    slab_free(remote_object);
+    remote_object = next;
+  }
+  for(int size_class = 0; size_class < ALL_SLAB_CLASSES; size_class++) {
+    while(cache->generation == heap_generation && cache->slab_bins[size_class] != NULL) {
+      void* object = cache->slab_bins[size_class];
+      cache->slab_bins[size_class] = *(void**)object;
+      slab_free(object);
+    }
+  }
+  memset(cache->slab_bins, 0, sizeof(cache->slab_bins));
+  memset(cache->slab_counts, 0, sizeof(cache->slab_counts));
+  UNLOCK_SLABS();
+
+  LOCK_HEAP();
+  if(cache->generation == heap_generation) {
+    for(int bin = 0; bin < TCACHE_BINS; bin++) {
+      while(cache->bins[bin] != NULL) {
+        node_header* block = cache->bins[bin];
+        cache->bins[bin] = block->next;
+        heap_free(block);
+      }
+    }
+    while(remote != NULL) {
+      node_header* next = remote->next;
+      heap_free(remote);
+      remote = next;
+    }
+  }
+  memset(cache->bins, 0, sizeof(cache->bins));
+  memset(cache->counts, 0, sizeof(cache->counts));
+  __atomic_store_n(&cache->in_use, 0, __ATOMIC_SEQ_CST);
+  UNLOCK_HEAP();
+
+  // Other threads free into the stacks directly once they see the cache unused, but they may have pushed onto them since the exchange above.
+  Free_Remote_Frees(cache);
+
+  my_cache = NULL;
+}
+
+static void Create_Cache_Key(void) {
+  pthread_key_create(&cache_key, Cache_Exit);
+}
+
+/*
+ * Returns the calling thread's cache, taking over the cache of an exited thread or mapping a new one the first time a thread allocates.
+ * @Returns NULL if there is no cache to be had, in which case the caller uses the central heap directly.
+ */
+static thread_cache* Get_Cache(void) {
+
+  thread_cache* cache = my_cache;
+
+  if(cache == NULL) {
+    pthread_once(&cache_key_once, Create_Cache_Key);
+
+    LOCK_HEAP();
+    for(size_t id = 1; id <= cache_count && cache == NULL; id++) {
+      if(!caches[id]->in_use)
+        cache = caches[id];
+    }
+    if(cache == NULL && cache_count + 1 < MAX_THREAD_CACHES) {
+      cache = (thread_cache*) mem_map(PAGE_ALIGN(sizeof(thread_cache)));
+      if(cache != NULL) {
+        memset(cache, 0, sizeof(thread_cache));
+        cache->id = ++cache_count;
+        cache->generation = heap_generation;
+        caches[cache->id] = cache;
+      }
+    }
+    if(cache != NULL)
+      __atomic_store_n(&cache->in_use, 1, __ATOMIC_RELAXED);
+    UNLOCK_HEAP();
+
+    if(cache == NULL)
+      return NULL;
+    my_cache = cache;
+    pthread_setspecific(cache_key, cache);
+  }
+
+  // Forget blocks of a heap that mm_init has thrown away.
+  if(cache->generation != heap_generation) {
+    memset(cache->bins, 0, sizeof(cache->bins));
+    memset(cache->counts, 0, sizeof(cache->counts));
+    memset(cache->slab_bins, 0, sizeof(cache->slab_bins));
+    memset(cache->slab_counts, 0, sizeof(cache->slab_counts));
+    __atomic_store_n(&cache->remote_frees, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->remote_slab_frees, NULL, __ATOMIC_RELAXED);
+    cache->generation = heap_generation;
+  }
+
+  return cache;
+}
+
+/*
+ * Pops a block of "size" bytes from the cache. An empty bin first takes back the cache's remote frees and then refills from the central heap.
+ * @Returns the payload or NULL if the central heap is out of memory.
+ */
+static void* Cache_Malloc(thread_cache* cache, size_t size) {
+
+  int bin = size / ALIGNMENT;
+
+  if(cache->bins[bin] == NULL) {
+    Drain_Remote_Frees(cache);
+    if(cache->bins[bin] == NULL)
+      Refill_Bin(cache, bin, size);
+    if(cache->bins[bin] == NULL)
+      return NULL;
+  }
+
+  node_header* block = cache->bins[bin];
+  cache->bins[bin] = block->next;
+  cache->counts[bin]--;
+  return PAYLOAD(block);
+}
+
+/*
+ * Frees a block that a thread cache handed out. The owner's own blocks go straight into its bins. Anyone else pushes the block onto the
+ * owner's remote_frees stack, which only takes a compare-and-swap.
+ */
+static void Cache_Free(node_header* block) {
+
+  thread_cache* cache = my_cache;
+  size_t owner = OWNER(block);
+
+  if(cache != NULL && cache->id == owner && cache->generation == heap_generation) {
+    Cache_Push(cache, block);
+    return;
+  }
+
+  // The cache of a thread that has exited would never drain its stack, so its blocks go straight back to the central heap.
+  thread_cache* owner_cache = caches[owner];
+  if(!__atomic_load_n(&owner_cache->in_use, __ATOMIC_ACQUIRE)) {
+    LOCK_HEAP();
+    heap_free(block);
+    UNLOCK_HEAP();
+    return;
+  }
+
+  node_header* head = __atomic_load_n(&owner_cache->remote_frees, __ATOMIC_RELAXED);
+  do {
+    block->next = head;
+  } while(!__atomic_compare_exchange_n(&owner_cache->remote_frees, &head, block, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  // If the owner exited in the meantime, its last drain may have come before the push.
+  if(!__atomic_load_n(&owner_cache->in_use, __ATOMIC_SEQ_CST))
+    Free_Remote_Frees(owner_cache);
+}
+
+/*
+ * Puts a free slab object into the cache's bin for its class. A bin that grows past TCACHE_LIMIT gives TCACHE_BATCH objects back to their
+ * slabs under one acquisition of the slab lock.
+ */
+static void Cache_Slab_Push(thread_cache* cache, void* object) {
+
+  int size_class = ((slab_header*) ((uintptr_t)object & ~(uintptr_t)(slab_size - 1)))->size_class;
+
+  *(void**)object = cache->slab_bins[size_class];
+  cache->slab_bins[size_class] = object;
+
+  if(++cache->slab_counts[size_class] > TCACHE_LIMIT) {
+    LOCK_SLABS();
+    for(int i = 0; i < TCACHE_BATCH; i++) {
+      object = cache->slab_bins[size_class];
+      cache->slab_bins[size_class] = *(void**)object;
+      slab_free(object);
+    }
+    cache->slab_counts[size_class] -= TCACHE_BATCH;
+    UNLOCK_SLABS();
+  }
+}
+
+/*
+ * Takes every slab object that other threads freed into this cache with one atomic exchange and puts them into their bins. As with
+ * Drain_Remote_Frees, the bins may grow past TCACHE_LIMIT here: the objects were all in use, and the bins shrink as this thread frees.
+ */
+static void Drain_Remote_Slab_Frees(thread_cache* cache) {
+
+  void* object = __atomic_exchange_n(&cache->remote_slab_frees, NULL, __ATOMIC_ACQUIRE);
+
+  while(object != NULL) {
+    void* next = *(void**)object;
+    int size_class = ((slab_header*) ((uintptr_t)object & ~(uintptr_t)(slab_size - 1)))->size_class;
+    *(void**)object = cache->slab_bins[size_class];
+    cache->slab_bins[size_class] = object;
+    cache->slab_counts[size_class]++;
+    object = next;
+  }
+}
+
+/*
+ * Pops a slab object of "size_class" from the cache. An empty bin first takes back the cache's remote slab frees and then refills with
+ * TCACHE_BATCH objects under one acquisition of the slab lock, which makes the cache the owner of the slabs they come from.
+ * @Returns the object or NULL if no slab could be mapped.
+ */
+static void* Cache_Slab_Malloc(thread_cache* cache, int size_class) {
+
+  void* object = cache->slab_bins[size_class];
+
+  if(object == NULL && __atomic_load_n(&cache->remote_slab_frees, __ATOMIC_RELAXED) != NULL) {
+    Drain_Remote_Slab_Frees(cache);
+    object = cache->slab_bins[size_class];
+  }
+  if(object == NULL) {
+    LOCK_SLABS();
+    for(int i = 0; i < TCACHE_BATCH; i++) {
+      void* new_object = slab_malloc(size_class);
+      if(new_object == NULL)
+        break;
+      slab_header* slab = (slab_header*) ((uintptr_t)new_object & ~(uintptr_t)(slab_size - 1));
+      if(slab->owner != cache->id)
+        __atomic_store_n(&slab->owner, cache->id, __ATOMIC_RELEASE);
+      *(void**)new_object = cache->slab_bins[size_class];
+      cache->slab_bins[size_class] = new_object;
+      cache->slab_counts[size_class]++;
+    }
+    UNLOCK_SLABS();
+
+    object = cache->slab_bins[size_class];
+    if(object == NULL)
+      return NULL;
+  }
+
+  cache->slab_bins[size_class] = *(void**)object;
+  cache->slab_counts[size_class]--;
+  return object;
+}
+
+/*
+ * Frees a slab object. An object of a slab that another cache owns is pushed onto that cache's remote_slab_frees stack with one
+ * compare-and-swap. Any other object stays in the calling thread's cache.
+ */
+static void Cache_Slab_Free(void* object) {
+
+  thread_cache* cache = my_cache;
+  slab_header* slab = (slab_header*) ((uintptr_t)object & ~(uintptr_t)(slab_size - 1));
+  size_t owner = __atomic_load_n(&slab->owner, __ATOMIC_ACQUIRE); // pairs with the store in Cache_Slab_Malloc, after caches[owner] was set
+
+  if(owner == 0 || owner == cache->id) {
+    Cache_Slab_Push(cache, object);
+    return;
+  }
+
+  // As in Cache_Free, the objects of an exited thread's slabs go straight back to them.
+  thread_cache* owner_cache = caches[owner];
+  if(!__atomic_load_n(&owner_cache->in_use, __ATOMIC_ACQUIRE)) {
+    LOCK_SLABS();
+    slab_free(object);
+    UNLOCK_SLABS();
+    return;
+  }
+
+  void* head = __atomic_load_n(&owner_cache->remote_slab_frees, __ATOMIC_RELAXED);
+  do {
+    *(void**)object = head;
+  } while(!__atomic_compare_exchange_n(&owner_cache->remote_slab_frees, &head, object, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  if(!__atomic_load_n(&owner_cache->in_use, __ATOMIC_SEQ_CST))
+    Free_Remote_Frees(owner_cache);
+}
+
+/*
+ * fork copies the heap as it is at that moment into the child, but only the thread that called fork. Both locks are taken around fork so
+ * that no other thread can be halfway through changing the heap. In the child they are made new, and the caches of the threads that didn't
+ * come along are left, with their blocks, for the child's new threads to take over.
+ */
+static void Fork_Prepare(void) {
+  LOCK_SLABS();
+  LOCK_HEAP();
+}
+
+static void Fork_Parent(void) {
+  UNLOCK_HEAP();
+  UNLOCK_SLABS();
+}
+
+static void Fork_Child(void) {
+
+  for(size_t id = 1; id <= cache_count; id++) {
+    if(caches[id] != my_cache)
+      caches[id]->in_use = 0;
+  }
+  pthread_mutex_init(&heap_lock, NULL);
+  pthread_mutex_init(&slab_lock, NULL);
+}
+
+static void Register_Fork_Handlers(void) {
+  pthread_atfork(Fork_Prepare, Fork_Parent, Fork_Child);
+}
+#endif
@@ -0,0 +1,42 @@
+/*
+ * mm.h - Interface of the malloc package in mm.c.
+ */
+#ifndef _MM_H_
+#define _MM_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+extern int mm_init(void);
+extern void *mm_malloc(size_t size);
+extern void *mm_calloc(size_t count, size_t size);
+extern void mm_free(void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* Allocates n blocks of sizes[i] bytes into out[i]. Returns -1 and allocates nothing if memory runs out. */
+extern int mm_malloc_batch(size_t n, const size_t *sizes, void **out);
+/* Frees the n blocks in ptrs */
+extern void mm_free_batch(size_t n, void **ptrs);
+/* Frees a block that was allocated with "size" bytes (not by mm_memalign) */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* Prints the heap size, the allocated and free bytes and the utilization */
+extern void mm_report_utilization(FILE *out);
+
+/* How often since mm_init a lock was taken, and how often that meant waiting for another thread (both 0 without -DMM_THREAD_SAFE) */
+extern void mm_lock_counts(size_t *taken, size_t *waited);
+
+/* Prints every inconsistency in the heap to "out". Returns 0 if there were none, -1 otherwise. */
+extern int mm_check(FILE *out);
+/* Prints a histogram of the free blocks, the external fragmentation and how full each chunk and slab class is */
+extern void mm_report_fragmentation(FILE *out);
+
+/* Prints the call sites that the most sampled bytes are live from, with estimated live and total bytes (needs -DMM_PROFILE) */
+extern void mm_report_profile(FILE *out);
+/* Writes every sampled call site in pprof's heap profile format. Returns -1 if mm.c was built without -DMM_PROFILE. */
+extern int mm_dump_profile(FILE *out);
+
+#endif /* _MM_H_ */
@@ -0,0 +1,254 @@
+/*
+ * mm_preload.c - The C library's allocation functions on top of mm.c.
+ *
+ * Built into libmm.so together with the thread-safe build of mm.c, this
+ * replaces malloc for a whole program without recompiling it:
+ *
+ *   LD_PRELOAD=./libmm.so <program> ...
+ *
+ * Every function that glibc lets a replacement malloc define is defined
+ * here, so no block from glibc's own heap ever reaches mm_free. The heap
+ * is set up by the first call. The dynamic loader and mm_init itself may
+ * allocate before that has finished (pthread_atfork does), so those calls
+ * are served from a small static bootstrap area that is never freed.
+ *
+ * Built with -DMM_PROFILE (libmm-profile.so), the profile is written when
+ * the program exits: in pprof's format to the file named by MM_PROFILE_OUT
+ * and as text to the file named by MM_PROFILE_REPORT, when they are set.
+ * A forked child that exits writes its own, with ".<pid>" appended.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "mm.h"
+
+#define ALIGNMENT 16
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(4096)));
+static size_t bootstrap_used;
+
+static int initialized;
+static __thread int initializing;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define IN_BOOTSTRAP(ptr) ((char *)(ptr) >= bootstrap && (char *)(ptr) < bootstrap + BOOTSTRAP_SIZE)
+/* Each bootstrap block keeps its size in the 8 bytes before it */
+#define BOOTSTRAP_SIZE_OF(ptr) (((size_t *)(ptr))[-1])
+
+#ifdef MM_PROFILE
+static pid_t profiled_pid;
+
+/*
+ * write_profile - Runs "write" into the file named by the environment
+ * variable "name", if it is set.
+ */
+static void write_profile(const char *name, void (*write)(FILE *))
+{
+  const char *path = getenv(name);
+  char child_path[4096];
+  FILE *out;
+
+  if (path == NULL)
+    return;
+  if (getpid() != profiled_pid) {
+    snprintf(child_path, sizeof(child_path), "%s.%d", path, (int)getpid());
+    path = child_path;
+  }
+  if ((out = fopen(path, "w")) == NULL)
+    return;
+  write(out);
+  fclose(out);
+}
+
+static void dump_profile(FILE *out)
+{
+  mm_dump_profile(out);
+}
+
+/*
+ * write_profiles - Registered with atexit once the heap is set up.
+ */
+static void write_profiles(void)
+{
+  write_profile("MM_PROFILE_OUT", dump_profile);
+  write_profile("MM_PROFILE_REPORT", mm_report_profile);
+}
+#endif
+
+/*
+ * ready - Sets up mm.c the first time it is called. Returns 0 if mm.c can
+ * be used, or -1 if this thread is in the middle of setting it up.
+ */
+static int ready(void)
+{
+  if (__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+    return 0;
+  if (initializing)
+    return -1;
+
+  initializing = 1;
+  pthread_mutex_lock(&init_lock);
+  if (!initialized) {
+    if (mm_init() < 0)
+      abort();
+#ifdef MM_PROFILE
+    profiled_pid = getpid();
+    atexit(write_profiles);
+#endif
+    __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&init_lock);
+  initializing = 0;
+  return 0;
+}
+
+/*
+ * bootstrap_alloc - Carves "size" bytes aligned to "alignment" out of the
+ * bootstrap area, which is already zero. Returns NULL once it is used up.
+ */
+static void *bootstrap_alloc(size_t alignment, size_t size)
+{
+  size_t start, end, used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED);
+
+  if (alignment < ALIGNMENT)
+    alignment = ALIGNMENT;
+  do {
+    start = (used + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+    end = start + size;
+    if (end > BOOTSTRAP_SIZE || end < start) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&bootstrap_used, &used, end, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  BOOTSTRAP_SIZE_OF(bootstrap + start) = size;
+  return bootstrap + start;
+}
+
+/*
+ * aligned - The common part of the aligned allocation functions.
+ * "alignment" is a power of two.
+ */
+static void *aligned(size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (ready() < 0)
+    return bootstrap_alloc(alignment, size);
+  ptr = mm_memalign(alignment, size ? size : 1);
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+void *malloc(size_t size)
+{
+  void *ptr;
+
+  if (ready() < 0)
+    return bootstrap_alloc(ALIGNMENT, size);
+
+  /* glibc returns a unique pointer for 0 bytes, and programs count on it */
+  ptr = mm_malloc(size ? size : 1);
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+void free(void *ptr)
+{
+  if (ptr == NULL || IN_BOOTSTRAP(ptr))
+    return;
+  mm_free(ptr);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  size_t total;
+  void *ptr;
+
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (ready() < 0)
+    return bootstrap_alloc(ALIGNMENT, total);
+
+  /* mm_calloc only zeroes what isn't zero already */
+  ptr = total ? mm_calloc(count, size) : mm_malloc(1);
+  if (ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  void *new_ptr;
+
+  if (ptr == NULL)
+    return malloc(size);
+
+  /* A bootstrap block moves into the heap the first time it is resized */
+  if (IN_BOOTSTRAP(ptr)) {
+    new_ptr = malloc(size);
+    if (new_ptr != NULL)
+      memcpy(new_ptr, ptr, size < BOOTSTRAP_SIZE_OF(ptr) ? size : BOOTSTRAP_SIZE_OF(ptr));
+    return new_ptr;
+  }
+
+  new_ptr = mm_realloc(ptr, size);
+  if (new_ptr == NULL && size != 0)
+    errno = ENOMEM;
+  return new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  ptr = aligned(alignment, size);
+  if (ptr == NULL)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+  return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+  if (ptr != NULL && IN_BOOTSTRAP(ptr))
+    return BOOTSTRAP_SIZE_OF(ptr);
+  return mm_usable_size(ptr);
+}
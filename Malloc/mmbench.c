@@ -0,0 +1,438 @@
+/*
+ * mmbench.c - Microbenchmarks for the mm.c allocator.
+ *
+ * usage: mmbench [-n ops] [-t threads] <benchmark>
+ *
+ *   threads - Every thread mallocs and frees small blocks through a
+ *             private ring of 64 slots. Runs with 1, 2, 4, ... up to
+ *             -t threads and prints the total rate and the speedup over
+ *             one thread. Needs mm.c built with -DMM_THREAD_SAFE.
+ *   pipe    - Pairs of threads where one mallocs small blocks and passes
+ *             them through a ring to the other, which frees them, the way
+ *             a server's accept thread hands buffers to its workers. Runs
+ *             with 1, 2, 4, ... up to -t / 2 pairs and prints the total
+ *             rate, how often mm.c took a lock and how often that meant
+ *             waiting for another thread. Then one thread mallocs -n
+ *             blocks and exits before the main thread frees them, and
+ *             mm_report_utilization shows whether they all came back.
+ *             Needs mm.c built with -DMM_THREAD_SAFE.
+ *   batch   - Allocates and frees blocks in batches of 1, 2, 4, ... up
+ *             to 1024, first one at a time with mm_malloc and mm_free,
+ *             then with mm_free_sized, then with mm_malloc_batch and
+ *             mm_free_batch, and prints the best time per block of
+ *             three runs of each.
+ *   arena   - Allocates blocks the way one request of a server does and
+ *             frees them all, for 16, 64, 256 and 1024 blocks per
+ *             request, once with mm_malloc and mm_free and once from an
+ *             arena that is reset after every request, and prints the
+ *             best time per block of three runs of each.
+ *   calloc  - Allocates 16 MB worth of zeroed tables of 1 KB to 1 MB,
+ *             writes a byte to every page of each and frees them all,
+ *             once with mm_malloc and memset and once with mm_calloc, and
+ *             prints the best time per table of three runs of each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "mm.h"
+#include "arena.h"
+
+#define RING_SLOTS 64
+#define PIPE_SLOTS 1024
+#define MAX_BATCH 1024
+#define CALLOC_BYTES (16 * 1024 * 1024)
+
+static long ops = 1000000;   /* operations per thread */
+static int max_threads = 16;
+
+static pthread_barrier_t start_line;
+
+/* A ring with one writer and one reader; each side only moves its own index */
+typedef struct pipe_ring {
+  char *slots[PIPE_SLOTS];
+  long head __attribute__((aligned(64))); /* next slot to read */
+  long tail __attribute__((aligned(64))); /* next slot to write */
+} pipe_ring;
+
+static pipe_ring *pipes;
+static char **orphans;
+
+/* Sizes used by the small-object benchmarks */
+static const size_t small_sizes[16] = {
+  8, 16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 200, 256, 320, 400, 512
+};
+
+/*
+ * now - Returns a monotonic timestamp in seconds
+ */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Body of one thread of the "threads" benchmark */
+static void *ring_worker(void *arg)
+{
+  char *ring[RING_SLOTS] = {NULL};
+  long i, seed = (long)arg;
+  int slot;
+
+  pthread_barrier_wait(&start_line);
+  for (i = 0; i < ops; i++) {
+    slot = i % RING_SLOTS;
+    if (ring[slot] != NULL)
+      mm_free(ring[slot]);
+    ring[slot] = mm_malloc(small_sizes[(i * 7 + seed) % 16]);
+    ring[slot][0] = (char)i;
+  }
+  for (slot = 0; slot < RING_SLOTS; slot++)
+    mm_free(ring[slot]);
+  return NULL;
+}
+
+/*
+ * run_threads - Runs `worker` on `nthreads` threads at once and returns
+ *     the elapsed time in seconds
+ */
+static double run_threads(void *(*worker)(void *), int nthreads)
+{
+  pthread_t threads[nthreads];
+  double t;
+  int i;
+
+  pthread_barrier_init(&start_line, NULL, nthreads + 1);
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+
+  pthread_barrier_wait(&start_line);
+  t = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  t = now() - t;
+
+  pthread_barrier_destroy(&start_line);
+  return t;
+}
+
+static void bench_threads(void)
+{
+  double t, rate, base = 0.0;
+  int n;
+
+  printf("threads: %ld malloc/free pairs per thread, sizes 8-512\n", ops);
+  printf("Threads\tTime(ms)\tMops/s\t\tSpeedup\n");
+  for (n = 1; n <= max_threads; n *= 2) {
+    mm_init();
+    t = run_threads(ring_worker, n);
+    rate = n * ops / t;
+    if (n == 1)
+      base = rate;
+    printf("%d\t%.1f\t\t%.2f\t\t%.2fx\n", n, t * 1e3, rate / 1e6, rate / base);
+  }
+  printf("(%ld CPUs online)\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/* Producer of the "pipe" benchmark: even thread 2i writes into pipe i */
+static void *pipe_producer(pipe_ring *ring, long seed)
+{
+  long i, head;
+  char *block;
+
+  for (i = 0; i < ops; i++) {
+    block = mm_malloc(small_sizes[(i * 7 + seed) % 16]);
+    block[0] = (char)i;
+    while (i - (head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) >= PIPE_SLOTS)
+      sched_yield();
+    ring->slots[i % PIPE_SLOTS] = block;
+    __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* Consumer of the "pipe" benchmark: odd thread 2i + 1 frees what comes out of pipe i */
+static void *pipe_consumer(pipe_ring *ring)
+{
+  long i;
+  char *block;
+
+  for (i = 0; i < ops; i++) {
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) <= i)
+      sched_yield();
+    block = ring->slots[i % PIPE_SLOTS];
+    __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+    block[1] = block[0];
+    mm_free(block);
+  }
+  return NULL;
+}
+
+static void *pipe_worker(void *arg)
+{
+  long id = (long)arg;
+
+  pthread_barrier_wait(&start_line);
+  if (id % 2 == 0)
+    return pipe_producer(&pipes[id / 2], id);
+  return pipe_consumer(&pipes[id / 2]);
+}
+
+/* Allocates the blocks that the main thread frees after this thread has exited */
+static void *orphan_producer(void *arg)
+{
+  long i;
+
+  pthread_barrier_wait(&start_line);
+  for (i = 0; i < ops; i++) {
+    orphans[i] = mm_malloc(small_sizes[i % 16]);
+    orphans[i][0] = (char)i;
+  }
+  return NULL;
+}
+
+static void bench_pipe(void)
+{
+  double t;
+  size_t taken, waited;
+  long i;
+  int n;
+
+  printf("pipe: %ld blocks per producer/consumer pair, sizes 8-512\n", ops);
+  printf("Pairs\tTime(ms)\tMops/s\t\tLocks taken\tWaited\n");
+  for (n = 1; 2 * n <= max_threads || n == 1; n *= 2) {
+    pipes = calloc(n, sizeof(pipe_ring));
+    mm_init();
+    t = run_threads(pipe_worker, 2 * n);
+    mm_lock_counts(&taken, &waited);
+    printf("%d\t%.1f\t\t%.2f\t\t%zu\t\t%zu\n", n, t * 1e3, n * ops / t / 1e6, taken, waited);
+    free(pipes);
+  }
+  printf("(%ld CPUs online)\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+  orphans = malloc(ops * sizeof(char *));
+  mm_init();
+  run_threads(orphan_producer, 1);
+  t = now();
+  for (i = 0; i < ops; i++)
+    mm_free(orphans[i]);
+  t = now() - t;
+  free(orphans);
+  printf("Freed %ld blocks of a thread that exited in %.1f ms, leaving:\n", ops, t * 1e3);
+  mm_report_utilization(stdout);
+  printf("\n");
+}
+
+/* Body of the "batch" benchmark: the seconds that "rounds" batches of "n" blocks take to allocate and free one way */
+static double batch_run(int how, size_t n, long rounds)
+{
+  static char *blocks[MAX_BATCH];
+  static size_t sizes[MAX_BATCH];
+  double t;
+  long r;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    sizes[i] = small_sizes[(i * 7) % 16];
+
+  mm_init();
+  t = now();
+  for (r = 0; r < rounds; r++) {
+    if (how == 2) {
+      mm_malloc_batch(n, sizes, (void **)blocks);
+    } else {
+      for (i = 0; i < n; i++)
+        blocks[i] = mm_malloc(sizes[i]);
+    }
+    for (i = 0; i < n; i++)
+      blocks[i][0] = (char)i;
+
+    if (how == 0) {
+      for (i = 0; i < n; i++)
+        mm_free(blocks[i]);
+    } else if (how == 1) {
+      for (i = 0; i < n; i++)
+        mm_free_sized(blocks[i], sizes[i]);
+    } else {
+      mm_free_batch(n, (void **)blocks);
+    }
+  }
+  return now() - t;
+}
+
+static void bench_batch(void)
+{
+  double t[3];
+  long rounds;
+  size_t n;
+  int how, best;
+
+  printf("batch: %ld blocks of 8-512 bytes, allocated and freed in batches\n", ops);
+  printf("Batch\tOne by one(ns)\tSized free(ns)\tBatch API(ns)\n");
+  for (n = 1; n <= MAX_BATCH; n *= 2) {
+    rounds = (ops + n - 1) / n;
+    for (how = 0; how < 3; how++) {
+      t[how] = batch_run(how, n, rounds);
+      for (best = 1; best < 3; best++) {
+        double again = batch_run(how, n, rounds);
+        if (again < t[how])
+          t[how] = again;
+      }
+      t[how] *= 1e9 / (rounds * n);
+    }
+    printf("%zu\t%.1f\t\t%.1f\t\t%.1f\n", n, t[0], t[1], t[2]);
+  }
+  printf("\n");
+}
+
+/* Body of the "arena" benchmark: the seconds that "rounds" requests of "n" blocks take with mm.c, or with "arena" if it is not NULL */
+static double arena_run(arena_t *arena, size_t n, long rounds)
+{
+  static char *blocks[MAX_BATCH];
+  double t;
+  long r;
+  size_t i, size;
+
+  mm_init();
+  t = now();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < n; i++) {
+      size = small_sizes[(i * 7) % 16];
+      blocks[i] = arena ? arena_alloc(arena, size) : mm_malloc(size);
+      blocks[i][0] = (char)i;
+    }
+
+    if (arena) {
+      arena_reset(arena);
+    } else {
+      for (i = 0; i < n; i++)
+        mm_free(blocks[i]);
+    }
+  }
+  return now() - t;
+}
+
+static void bench_arena(void)
+{
+  arena_t *arena = arena_create(0);
+  double t[2], again;
+  long rounds;
+  size_t n;
+  int how, best;
+
+  printf("arena: %ld blocks of 8-512 bytes, allocated a request at a time and freed together\n", ops);
+  printf("Blocks\tmm_malloc(ns)\tArena(ns)\n");
+  for (n = 16; n <= MAX_BATCH; n *= 4) {
+    rounds = (ops + n - 1) / n;
+    for (how = 0; how < 2; how++) {
+      t[how] = arena_run(how ? arena : NULL, n, rounds);
+      for (best = 1; best < 3; best++) {
+        again = arena_run(how ? arena : NULL, n, rounds);
+        if (again < t[how])
+          t[how] = again;
+      }
+      t[how] *= 1e9 / (rounds * n);
+    }
+    printf("%zu\t%.1f\t\t%.1f\n", n, t[0], t[1]);
+  }
+  printf("(the arena mapped %zu KB)\n\n", arena_mapped(arena) / 1024);
+  arena_destroy(arena);
+}
+
+/* Body of the "calloc" benchmark: the seconds that CALLOC_BYTES of tables of "size" bytes take to allocate zeroed, use and free */
+static double calloc_run(int use_calloc, size_t size)
+{
+  static char *tables[CALLOC_BYTES / 1024];
+  size_t i, j, n = CALLOC_BYTES / size;
+  double t;
+
+  mm_init();
+  t = now();
+  for (i = 0; i < n; i++) {
+    if (use_calloc) {
+      tables[i] = mm_calloc(1, size);
+    } else {
+      tables[i] = mm_malloc(size);
+      memset(tables[i], 0, size);
+    }
+    for (j = 0; j < size; j += 4096)
+      tables[i][j] += 1;
+  }
+  for (i = 0; i < n; i++)
+    mm_free(tables[i]);
+  return now() - t;
+}
+
+static void bench_calloc(void)
+{
+  double t[2], again;
+  size_t size;
+  int how, best;
+
+  printf("calloc: %d MB of zeroed tables, one byte written per page\n", CALLOC_BYTES / (1024 * 1024));
+  printf("Size(KB)\tmalloc+memset(us)\tmm_calloc(us)\n");
+  for (size = 1024; size <= 1024 * 1024; size *= 4) {
+    for (how = 0; how < 2; how++) {
+      t[how] = calloc_run(how, size);
+      for (best = 1; best < 3; best++) {
+        again = calloc_run(how, size);
+        if (again < t[how])
+          t[how] = again;
+      }
+      t[how] *= 1e6 / (CALLOC_BYTES / size);
+    }
+    printf("%zu\t\t%.2f\t\t\t%.2f\n", size / 1024, t[0], t[1]);
+  }
+  printf("\n");
+}
+
+static void usage(char *progname)
+{
+  fprintf(stderr, "usage: %s [-n ops] [-t threads] <benchmark>\n", progname);
+  fprintf(stderr, "benchmarks:\n");
+  fprintf(stderr, "  threads   per-thread malloc/free scaling\n");
+  fprintf(stderr, "  pipe      malloc on one thread, free on another\n");
+  fprintf(stderr, "  batch     cost per block of the batch and sized APIs\n");
+  fprintf(stderr, "  arena     cost per block of request-scoped allocation with an arena\n");
+  fprintf(stderr, "  calloc    cost per table of zeroed allocation\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "n:t:h")) != -1) {
+    switch (c) {
+    case 'n':
+      ops = atol(optarg);
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || ops < 1 || max_threads < 1)
+    usage(argv[0]);
+
+  if (!strcmp(argv[optind], "threads"))
+    bench_threads();
+  else if (!strcmp(argv[optind], "pipe"))
+    bench_pipe();
+  else if (!strcmp(argv[optind], "batch"))
+    bench_batch();
+  else if (!strcmp(argv[optind], "arena"))
+    bench_arena();
+  else if (!strcmp(argv[optind], "calloc"))
+    bench_calloc();
+  else
+    usage(argv[0]);
+
+  return 0;
+}
@@ -0,0 +1,89 @@
+#!/bin/bash
+
+# Runs the friendlist server and the tsh shell once with the C library's
+# malloc and once with mm.c preloaded (libmm.so), and prints the wall time
+# of each workload and the server's peak resident memory.
+#
+# Usage: ./preload-bench.sh [rounds]
+#
+# friendlist: curl sends every request of a round with up to 8 connections
+# at once, so the server runs 8 threads. A round befriends 40 users with
+# 200 friends each, lists every user's friends 10 times and unfriends
+# them all again.
+# tsh: the shell reads a script of simple commands and two-command pipes,
+# so every line forks and execs (and the children are preloaded too).
+#
+# Needs curl. Everything is built into a temporary directory.
+
+ROUNDS=${1:-3}
+MALLOC_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$MALLOC_DIR")
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+make -C "$MALLOC_DIR" -s libmm.so || exit 1
+gcc -O2 -I"$REPO/Networking" -I"$MALLOC_DIR" -o "$BUILD/friendlist" "$REPO/Networking/friendlist.c" "$REPO/Networking/dictionary.c" \
+    "$REPO/Networking/more_string.c" "$REPO/Networking/csapp.c" "$MALLOC_DIR/arena.c" "$MALLOC_DIR/memlib.c" -pthread || exit 1
+gcc -O2 -o "$BUILD/tsh" "$REPO/Shell/tsh.c" || exit 1
+
+now() {
+    date +%s.%N
+}
+
+# Prints the seconds that ROUNDS rounds of requests took, then the server's peak RSS in KB
+friendlist_run() {
+    local preload=$1 port=$((20000 + RANDOM % 20000)) pid start end url
+
+    env ${preload:+LD_PRELOAD=$preload} "$BUILD/friendlist" $port > /dev/null 2>&1 &
+    pid=$!
+    until curl -s "http://localhost:$port/friends?user=nobody" > /dev/null; do
+        sleep 0.1
+    done
+
+    url="http://localhost:$port"
+    start=$(now)
+    for round in $(seq "$ROUNDS"); do
+        curl -s --no-progress-meter -Z --parallel-max 8 "$url/befriend?user=u[1-40]&friends=f[1-200]" > /dev/null
+        for i in $(seq 10); do
+            curl -s --no-progress-meter -Z --parallel-max 8 "$url/friends?user=u[1-40]" > /dev/null
+        done
+        curl -s --no-progress-meter -Z --parallel-max 8 "$url/unfriend?user=u[1-40]&friends=f[1-200]" > /dev/null
+    done
+    end=$(now)
+
+    echo "$start $end" | awk '{ printf("%.2f", $2 - $1) }'
+    awk '/^VmHWM/ { printf(" %d", $2) }' /proc/$pid/status
+    kill $pid
+    wait $pid 2> /dev/null
+}
+
+# Prints the seconds that tsh took to run its script ROUNDS times
+tsh_run() {
+    local preload=$1 start end
+
+    for i in $(seq 100); do
+        echo "/bin/echo hello world"
+        echo "/bin/ls $REPO"
+        echo "/bin/cat $REPO/Shell/text.txt | /usr/bin/wc -c"
+    done > "$BUILD/script"
+
+    start=$(now)
+    for round in $(seq "$ROUNDS"); do
+        env ${preload:+LD_PRELOAD=$preload} "$BUILD/tsh" -p < "$BUILD/script" > /dev/null
+    done
+    end=$(now)
+    echo "$start $end" | awk '{ printf("%.2f", $2 - $1) }'
+}
+
+printf "%-10s %-8s %10s %14s\n" "Program" "malloc" "Seconds" "Peak RSS (KB)"
+for name in libc mm; do
+    preload=
+    [ $name = mm ] && preload="$MALLOC_DIR/libmm.so"
+    read seconds rss <<< "$(friendlist_run "$preload")"
+    printf "%-10s %-8s %10s %14s\n" friendlist $name "$seconds" "$rss"
+done
+for name in libc mm; do
+    preload=
+    [ $name = mm ] && preload="$MALLOC_DIR/libmm.so"
+    printf "%-10s %-8s %10s %14s\n" tsh $name "$(tsh_run "$preload")" -
+done
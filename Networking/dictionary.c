@@ -3,6 +3,7 @@
 #include <strings.h>
 #include <ctype.h>
 #include "dictionary.h"
+#include "arena.h"
 
 static int same_key(const char *key1, const char *key2, int compare_mode);
 
@@ -13,10 +14,21 @@ struct dictionary_t {
   size_t alloc;
   const char **keys;
   void **values;
+  arena_t *arena; /* NULL unless the dictionary lives in an arena */
 };
 
 static void no_free(void *p) { }
 
+/* Copies and frees keys with malloc, or in the dictionary's arena: */
+static const char *copy_key(dictionary_t *d, const char *key) {
+  return (d->arena ? arena_strdup(d->arena, key) : strdup(key));
+}
+
+static void free_key(dictionary_t *d, const char *key) {
+  if (!d->arena)
+    free((void *)key);
+}
+
 dictionary_t *make_dictionary(int compare_mode, free_proc_t free_value) {
   dictionary_t *dict = calloc(1, sizeof(dictionary_t));
 
@@ -26,8 +38,22 @@ dictionary_t *make_dictionary(int compare_mode, free_proc_t free_value) {
   return dict;
 }
 
+dictionary_t *make_dictionary_in(arena_t *arena, int compare_mode) {
+  dictionary_t *dict = arena_calloc(arena, 1, sizeof(dictionary_t));
+
+  dict->compare_mode = compare_mode;
+  dict->free_value = no_free;
+  dict->arena = arena;
+
+  return dict;
+}
+
 void free_dictionary(dictionary_t *d) {
   int i;
+
+  /* Everything goes when the arena is reset */
+  if (d->arena)
+    return;
   
   for (i = 0; i < d->count; i++) {
     free((void *)d->keys[i]);
@@ -54,11 +80,16 @@ void dictionary_set(dictionary_t *d, const char *key, void *value) {
 
   if (d->count == d->alloc) {
     d->alloc = 2 * (d->alloc + 1);
-    d->keys = realloc(d->keys, d->alloc*sizeof(const char*));
-    d->values = realloc(d->values, d->alloc*sizeof(void*));
+    if (d->arena) {
+      d->keys = arena_realloc(d->arena, d->keys, d->count*sizeof(const char*), d->alloc*sizeof(const char*));
+      d->values = arena_realloc(d->arena, d->values, d->count*sizeof(void*), d->alloc*sizeof(void*));
+    } else {
+      d->keys = realloc(d->keys, d->alloc*sizeof(const char*));
+      d->values = realloc(d->values, d->alloc*sizeof(void*));
+    }
   }
 
-  d->keys[d->count] = strdup(key);
+  d->keys[d->count] = copy_key(d, key);
   d->values[d->count] = value;
   d->count++;
 }
@@ -68,7 +99,7 @@ void dictionary_remove(dictionary_t *d, const char *key) {
 
   for (i = 0; i < d->count; i++) {
     if (same_key(key, d->keys[i], d->compare_mode)) {
-      free((void *)d->keys[i]);
+      free_key(d, d->keys[i]);
       d->free_value(d->values[i]);
       for (j = i + 1; j < d->count; j++) {
         d->keys[j-1] = d->keys[j];
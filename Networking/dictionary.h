@@ -1,6 +1,8 @@
 /* A dictionary maps a string to a pointer. The pointer can be
    anything, such as another string. */
 
+#include "arena.h"
+
 /* Opaque type for a dictionary instance: */
 typedef struct dictionary_t dictionary_t;
 
@@ -19,9 +21,16 @@ typedef void (*free_proc_t)(void*);
    can be NULL: */
 dictionary_t *make_dictionary(int compare_mode, free_proc_t free_value);
 
+/* Creates a dictionary that lives in `arena`, together with its
+   copies of the keys. The values are not destroyed by the dictionary,
+   so they should live in the arena too. The whole dictionary goes
+   away when the arena is reset or destroyed: */
+dictionary_t *make_dictionary_in(arena_t *arena, int compare_mode);
+
 /* Destroys a dictionary, which frees all key strings -- and also
    destroys all values using the function provided to
-   make_dictionary() if that function is not NULL: */
+   make_dictionary() if that function is not NULL. It does nothing
+   for a dictionary from make_dictionary_in(): */
 void free_dictionary(dictionary_t *d);
 
 /* Sets the dictionary's mapping for `key` to `value`, destroying the
@@ -22,6 +22,7 @@
 #include "csapp.h"
 #include "dictionary.h"
 #include "more_string.h"
+#include "arena.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,9 +31,9 @@
 // ================================================================================================ function_declarations
 
 // Provided methods.
-static void doit(int fd);
-static dictionary_t *read_requesthdrs(rio_t *rp);
-static void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d);
+static void doit(int fd, arena_t *arena);
+static dictionary_t *read_requesthdrs(rio_t *rp, arena_t *arena);
+static void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *d, arena_t *arena);
 static void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
 static void print_stringdictionary(dictionary_t *d);
 static char *ok_header(size_t len, const char *content_type);
@@ -40,21 +41,23 @@ static char *ok_header(size_t len, const char *content_type);
 
 // Added helper methods.
 void* drive_doit(void* p_thread);
-static void Enumerate_Friends(int fd, char* user);
+static arena_t* Get_Arena(void);
+static void Put_Arena(arena_t* arena);
+static void Enumerate_Friends(int fd, char* user, arena_t* arena);
 static int Dict_Has(const char* target);
-static dictionary_t* Make_Query(int fd, char* user, char* friend);
+static dictionary_t* Make_Query(int fd, char* user, char* friend, arena_t* arena);
 
 
 // Methods for server requests.
 static void serve_request(int fd, const char *body);
-static void Friends(int fd, dictionary_t *query);
-static void Befriend(int fd, dictionary_t *query);
-static void Unfriend(int fd, dictionary_t *query);
-static void Introduce(int fd, dictionary_t *query);
+static void Friends(int fd, dictionary_t *query, arena_t *arena);
+static void Befriend(int fd, dictionary_t *query, arena_t *arena);
+static void Unfriend(int fd, dictionary_t *query, arena_t *arena);
+static void Introduce(int fd, dictionary_t *query, arena_t *arena);
 
 // Methods for Networking
 static int Connect_To_Server(const char* host, const char* port);
-static char** Get_Remote_Friends(int fd, const char* friend, const char* host, const char* port);
+static char** Get_Remote_Friends(int fd, const char* friend, const char* host, const char* port, arena_t* arena);
 static dictionary_t* Decode_Server_Response(int fd, int conn, rio_t* rio);
 
 
@@ -66,6 +69,13 @@ dictionary_t* friendlist_dict;
 // Use a lock so multiple requests can be served concurrently.
 pthread_mutex_t lock;
 
+// Everything a request allocates lives in an arena. Finished requests leave their arenas here (reset) for the next
+// ones, so a request only maps memory when it is bigger than any before it.
+#define SPARE_ARENAS 8
+arena_t* spare_arenas[SPARE_ARENAS];
+int spare_arena_count;
+pthread_mutex_t arena_lock;
+
 // ================================================================================================ High Level Flow
 void sigint_handler(int sig){ free_dictionary(friendlist_dict); exit(0); }
 
@@ -86,6 +96,7 @@ int main(int argc, char **argv) {
 
   // Initialize the lock then listen for connections.
   pthread_mutex_init(&lock, NULL);
+  pthread_mutex_init(&arena_lock, NULL);
   listenfd = Open_listenfd(argv[1]);
 
   
@@ -131,17 +142,52 @@ void* drive_doit(void* p_thread) {
   int fd = *(int*) p_thread;
   free(p_thread);
 
-  doit(fd);
+  arena_t* arena = Get_Arena();
+  if (arena != NULL) {
+    doit(fd, arena);
+    Put_Arena(arena);
+  }
 
   close(fd);
 
   return NULL;
 }
 
+/**
+ * Returns a spare arena, or a new one if there are none. Returns NULL if memory runs out.
+*/
+static arena_t* Get_Arena(void) {
+  arena_t* arena = NULL;
+
+  pthread_mutex_lock(&arena_lock);
+  if (spare_arena_count > 0)
+    arena = spare_arenas[--spare_arena_count];
+  pthread_mutex_unlock(&arena_lock);
+
+  return (arena != NULL)? arena : arena_create(0);
+}
+
+/**
+ * Frees everything a request allocated in "arena" and keeps the arena for another request if there is room.
+*/
+static void Put_Arena(arena_t* arena) {
+  arena_reset(arena);
+
+  pthread_mutex_lock(&arena_lock);
+  if (spare_arena_count < SPARE_ARENAS) {
+    spare_arenas[spare_arena_count++] = arena;
+    arena = NULL;
+  }
+  pthread_mutex_unlock(&arena_lock);
+
+  arena_destroy(arena);
+}
+
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - handle one HTTP request/response transaction. Everything the
+ * request needs is allocated in "arena", which the caller resets after.
  */
-void doit(int fd) {
+void doit(int fd, arena_t *arena) {
 
   char buf[MAXLINE], *method, *uri, *version;
   rio_t rio;
@@ -152,7 +198,7 @@ void doit(int fd) {
   if (Rio_readlineb(&rio, buf, MAXLINE) <= 0)
     return;
   printf("%s", buf);
-  if (!parse_request_line(buf, &method, &uri, &version)) {
+  if (!parse_request_line_in(arena, buf, &method, &uri, &version)) {
     clienterror(fd, method, "400", "Bad Request", "Friendlist did not recognize the request");
   } else {
     if (strcasecmp(version, "HTTP/1.0") && strcasecmp(version, "HTTP/1.1")) {
@@ -160,13 +206,13 @@ void doit(int fd) {
     } else if (strcasecmp(method, "GET") && strcasecmp(method, "POST")) {
       clienterror(fd, method, "501", "Not Implemented", "Friendlist does not implement that method");
     } else {
-      headers = read_requesthdrs(&rio);
+      headers = read_requesthdrs(&rio, arena);
 
       /* Parse all query arguments into a dictionary */
-      query = make_dictionary(COMPARE_CASE_SENS, free);
-      parse_uriquery(uri, query);
+      query = make_dictionary_in(arena, COMPARE_CASE_SENS);
+      parse_uriquery_in(arena, uri, query);
       if (!strcasecmp(method, "POST"))
-        read_postquery(&rio, headers, query);
+        read_postquery(&rio, headers, query, arena);
 
       /* For debugging, print the dictionary */
       printf("The Query is:");
@@ -178,36 +224,29 @@ printf("\n=============about to see what it starts with===========\n");
       // Handle each of the different queries here, undefined queries send an empty string.
       if (starts_with("/friends", uri)) {printf("\n===========a=============\n");
             pthread_mutex_lock(&lock);
-            Friends(fd, query);
+            Friends(fd, query, arena);
             pthread_mutex_unlock(&lock); // TODO: "keep your critical sections tight. Do not lock an entire method."
         }
         else if (starts_with("/befriend", uri)) { printf("\n=============b===========\n");
           pthread_mutex_lock(&lock);
-          Befriend(fd, query);
+          Befriend(fd, query, arena);
           pthread_mutex_unlock(&lock);
         }
         else if (starts_with("/unfriend", uri)) { printf("\n==============c==========\n");
             pthread_mutex_lock(&lock);
-            Unfriend(fd, query);
+            Unfriend(fd, query, arena);
             pthread_mutex_unlock(&lock);
         }
         else if (starts_with("/introduce", uri)) {printf("\n================d========\n");
             // Introduce shouldn't lock because it calls other methods that use locks. It would deadlock.
-            Introduce(fd, query);
+            Introduce(fd, query, arena);
         }
         else {printf("\n==========e==============\n");
             pthread_mutex_lock(&lock);
             clienterror(fd, "Bad Query", "400", "Not Implemented", "The query was not one of the four implemented ones.");
             pthread_mutex_unlock(&lock);
         }
-      /* Clean up */
-      free_dictionary(query);
-      free_dictionary(headers);
     }
-    /* Clean up status line */
-    free(method);
-    free(uri);
-    free(version);
   }
 }
 
@@ -234,21 +273,21 @@ static void serve_request(int fd, const char *body) {
 /*
 * Undocumented methods that were provided. Looks like they handle printing things to the terminal.
 */
-dictionary_t *read_requesthdrs(rio_t *rp) {
+dictionary_t *read_requesthdrs(rio_t *rp, arena_t *arena) {
   char buf[MAXLINE];
-  dictionary_t *d = make_dictionary(COMPARE_CASE_INSENS, free);
+  dictionary_t *d = make_dictionary_in(arena, COMPARE_CASE_INSENS);
 
   Rio_readlineb(rp, buf, MAXLINE);
   printf("%s", buf);
   while(strcmp(buf, "\r\n")) {
     Rio_readlineb(rp, buf, MAXLINE);
     printf("%s", buf);
-    parse_header_line(buf, d);
+    parse_header_line_in(arena, buf, d);
   }
   
   return d;
 }
-void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest) {
+void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest, arena_t *arena) {
   char *len_str, *type, *buffer;
   int len;
   
@@ -257,15 +296,13 @@ void read_postquery(rio_t *rp, dictionary_t *headers, dictionary_t *dest) {
 
   type = dictionary_get(headers, "Content-Type");
   
-  buffer = malloc(len+1);
+  buffer = arena_alloc(arena, len+1);
   Rio_readnb(rp, buffer, len);
   buffer[len] = 0;
 
   if (!strcasecmp(type, "application/x-www-form-urlencoded")) {
-    parse_query(buffer, dest);
+    parse_query_in(arena, buffer, dest);
   }
-
-  free(buffer);
 }
 static char *ok_header(size_t len, const char *content_type) {
   char *len_str, *header;
@@ -332,7 +369,7 @@ static void print_stringdictionary(dictionary_t *d) {
  * The friends may be listed in any order.
  * txt/plain; charset=utf-8
 */
-static void Friends(int fd, dictionary_t *query) {
+static void Friends(int fd, dictionary_t *query, arena_t *arena) {
   // Make sure the Friends method was called in the right circumstance.
   if(dictionary_count(query) != 1) {
     clienterror(fd, "Friends", "400", "Bad Request", "Query has more than one parameter which means it is not a GET request."); 
@@ -345,7 +382,7 @@ static void Friends(int fd, dictionary_t *query) {
     return;
   }
   // Send the enumerate request to the server.
-  Enumerate_Friends(fd, username);
+  Enumerate_Friends(fd, username, arena);
 }
 
 /**
@@ -356,7 +393,7 @@ static void Friends(int fd, dictionary_t *query) {
  * 
  * After that, all of "user"'s friends are listed separated by "\n" as if the Friends() method was called.
 */
-static void Befriend(int fd, dictionary_t *query) {
+static void Befriend(int fd, dictionary_t *query, arena_t *arena) {
   
 printf("\n<<<<<<<<<<<<<<<<<<<<<in befriend<<<<<<<<<<<<<<<<<<<<<<<<\n");
   // Make sure Befriend was called in the right circumstance.
@@ -369,7 +406,7 @@ printf("\n<<<<<<<<<<<<<<<<<<<<<in befriend<<<<<<<<<<<<<<<<<<<<<<<<\n");
     const char* recieving_user = dictionary_get(query, "user");
     char* recipient_copy = (char*) recieving_user;
     char* string_of_friends = dictionary_get(query, "friends");
-    const char** array_of_new_friends = (const char**) split_string(string_of_friends, '\n');
+    const char** array_of_new_friends = (const char**) split_string_in(arena, string_of_friends, '\n');
 
     // Debugging.
     printf("Receiving user is %s\n", recieving_user);
@@ -417,7 +454,7 @@ printf("\n<<<<<<<<<<<<<<<<<<<<<in befriend<<<<<<<<<<<<<<<<<<<<<<<<\n");
     print_stringdictionary((dictionary_t*)dictionary_get(friendlist_dict, recieving_user)); // TODO: the result here suggests yes.
   printf("Now the dictionary starts as:\n"); print_stringdictionary(friendlist_dict);
     // Send the enumerate request to the server.
-    Enumerate_Friends(fd, recipient_copy);
+    Enumerate_Friends(fd, recipient_copy, arena);
   }
 }
 
@@ -426,7 +463,7 @@ printf("\n<<<<<<<<<<<<<<<<<<<<<in befriend<<<<<<<<<<<<<<<<<<<<<<<<\n");
  * 
  * Does nothing if "user" doesn't have the friends. 
 */
-static void Unfriend(int fd, dictionary_t *query) {
+static void Unfriend(int fd, dictionary_t *query, arena_t *arena) {
   
   // Make sure Unfriend was called in the right circumstance.
   if(query == NULL)
@@ -448,7 +485,7 @@ static void Unfriend(int fd, dictionary_t *query) {
 
     // Extract their friends from the query.
     char* string_of_friends = dictionary_get(query, "friends");
-    char** array_of_friends = split_string(string_of_friends, '\n');
+    char** array_of_friends = split_string_in(arena, string_of_friends, '\n');
     if(array_of_friends == NULL) {
       clienterror(fd, "Unfriend", "400", "Bad Request", "A request to remove from an empty friendlist was called.");
     }
@@ -476,7 +513,7 @@ static void Unfriend(int fd, dictionary_t *query) {
     }
 
     // Send the enumerate request to the server.
-    Enumerate_Friends(fd, user);
+    Enumerate_Friends(fd, user, arena);
   }
   
 }
@@ -502,7 +539,7 @@ static void Unfriend(int fd, dictionary_t *query) {
  *         the process, it sends an appropriate HTTP response to the client and
  *         returns immediately. Memory allocated during the process is freed.
  */
-static void Introduce(int fd, dictionary_t* query) {
+static void Introduce(int fd, dictionary_t* query, arena_t* arena) {
 printf("\n_______________________in introduce__________________________\n");
 
 
@@ -538,7 +575,7 @@ printf("\n_______________________in introduce__________________________\n");
     }
 printf("\nabout to get remote friends\n");
     // Extract all of the friends from the remote server.
-    char** array_of_friends = Get_Remote_Friends(fd, friend, host, port);
+    char** array_of_friends = Get_Remote_Friends(fd, friend, host, port, arena);
     if(array_of_friends == NULL) {
       clienterror(fd, port, "400", "Bad Request", "Something went wrong with getting the remote friends.");
       return;
@@ -555,25 +592,20 @@ printf("\nabout to get remote friends\n");
 printf("\n===========current friend is %s=============\n", a_friend);
         // Users cannot be friends with themselves. If the two names are different then befriend the two users.
         if (strcmp(user, a_friend)) {
-          dictionary_t* new_query = Make_Query(fd, user, a_friend);
+          dictionary_t* new_query = Make_Query(fd, user, a_friend, arena);
 
           pthread_mutex_lock(&lock);
-          Befriend(fd, new_query);
+          Befriend(fd, new_query, arena);
           pthread_mutex_unlock(&lock);
         }
-            
-        free(a_friend);
     }
 
-    // Free the array of friends because malloc was used.
-    free(array_of_friends);
-
     // Form and broadcast user's new friendlist to the server.
     dictionary_t* inner_dict = dictionary_get(friendlist_dict, user);
     const char** inner_array = dictionary_keys(inner_dict);
-    char* server_message = join_strings(inner_array, '\n');
+    char* server_message = join_strings_in(arena, inner_array, '\n');
     serve_request(fd, server_message);
-    free(server_message);
+    free(inner_array);
 }
 
 // ================================================================================================ Networking Methods
@@ -614,20 +646,18 @@ static int Connect_To_Server(const char* host, const char* port) {
  * @param hostname The hostname of the server to connect to.
  * @param port The port number of the server.
  *
- * @return A dynamically allocated array of strings representing the list of friends.
- *         The last element of the array is NULL. Memory must be freed by the caller.
+ * @return An array of strings in "arena" representing the list of friends.
+ *         The last element of the array is NULL.
  *         Returns NULL in case of errors or if the response is invalid.
  */
-static char** Get_Remote_Friends(int fd, const char* friend, const char* host, const char* port) {
+static char** Get_Remote_Friends(int fd, const char* friend, const char* host, const char* port, arena_t* arena) {
     // Connect to the external server.
     int conn = Connect_To_Server(host, port);
-    char* request_header = append_strings("GET /friends?user=", friend, " HTTP/1.1\r\n", "Host: ", host, ":", port, "\r\n", "Accept: text/html\r\n\r\n", NULL);
+    char* request_header = append_strings_in(arena, "GET /friends?user=", friend, " HTTP/1.1\r\n", "Host: ", host, ":", port, "\r\n", "Accept: text/html\r\n\r\n", NULL);
     
     // Broadcast the header
-    char* header_copy = strdup(request_header);
-    Rio_writen(conn, header_copy, strlen(header_copy));
+    Rio_writen(conn, request_header, strlen(request_header));
     Shutdown(conn, SHUT_WR);
-    free(header_copy);
 
     // Read the headers from it
     rio_t rio;
@@ -640,10 +670,9 @@ static char** Get_Remote_Friends(int fd, const char* friend, const char* host, c
 
     // Debugging 
     print_stringdictionary(response_headers);
-    char** friendlist = split_string(dictionary_get(response_headers, "body"), '\n');
+    char** friendlist = split_string_in(arena, dictionary_get(response_headers, "body"), '\n');
 
     // Clean up and return
-    free(request_header);
     free_dictionary(response_headers);
     return friendlist;
 }
@@ -734,7 +763,7 @@ static dictionary_t* Decode_Server_Response(int fd, int conn, rio_t* rio) {
  * @param user
  * @return a data structure that 
 */
-static void Enumerate_Friends(int fd, char* user) {
+static void Enumerate_Friends(int fd, char* user, arena_t* arena) {
   
   // Obtain the dictionary of user's friends.
   dictionary_t* inner_dict = dictionary_get(friendlist_dict, user);
@@ -746,10 +775,10 @@ static void Enumerate_Friends(int fd, char* user) {
   // Get an array of all their friends
   const char** friendlist = (dictionary_count(inner_dict) == 0)? NULL : dictionary_keys(inner_dict);
   // Convert it to a \n separated and NULL terminated list.
-  char* server_message = (friendlist == NULL)? "": join_strings(friendlist, '\n');
+  char* server_message = (friendlist == NULL)? "": join_strings_in(arena, friendlist, '\n');
   // Send the result to the server.
   serve_request(fd, server_message);
-  // Free the temporary/local "friendlist" and "server_message" because dictionary_keys and join_strings use malloc.
+  // Free the temporary/local "friendlist" because dictionary_keys uses malloc. "server_message" is in the arena.
   free(friendlist);
 }
 
@@ -773,7 +802,7 @@ static int Dict_Has(const char* target) {
 /**
  * Constructs a BEFRIEND query to add "friend" to "user"'s friendlist.
 */
-static dictionary_t* Make_Query(int fd, char* user, char* friend) {
+static dictionary_t* Make_Query(int fd, char* user, char* friend, arena_t* arena) {
 
   // Check for NULL parameters
   if (user == NULL || friend == NULL) {
@@ -782,14 +811,14 @@ static dictionary_t* Make_Query(int fd, char* user, char* friend) {
   }
 
   // Construct the query string
-  char* query_string = append_strings("/befriend?user=", user, "&friends=", friend, NULL);
+  char* query_string = append_strings_in(arena, "/befriend?user=", user, "&friends=", friend, NULL);
   printf("\n The new query is %s\n", query_string);
 
 
-  dictionary_t* new_query = make_dictionary(COMPARE_CASE_SENS, free); 
+  dictionary_t* new_query = make_dictionary_in(arena, COMPARE_CASE_SENS); 
   char* s = strchr(query_string, '?');
   if (s)
-    parse_query(s+1, new_query);
+    parse_query_in(arena, s+1, new_query);
   
   return new_query;
 }
\ No newline at end of file
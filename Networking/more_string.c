@@ -6,25 +6,39 @@
 #include "dictionary.h"
 #include "more_string.h"
 
-char *append_strings(const char *s, ...) {
+/* Every function that allocates has a variant that allocates in an
+   arena instead; `arena` is NULL for the malloc versions. */
+static void *alloc_in(arena_t *arena, size_t size) {
+  return (arena ? arena_alloc(arena, size) : malloc(size));
+}
+
+static char *strndup_in(arena_t *arena, const char *s, size_t n) {
+  return (arena ? arena_strndup(arena, s, n) : strndup(s, n));
+}
+
+static void free_in(arena_t *arena, void *p) {
+  if (!arena)
+    free(p);
+}
+
+static char *vappend_strings(arena_t *arena, const char *s, va_list ap) {
   const char *s2;
   char *result;
-  va_list ap;
+  va_list ap2;
   size_t len = 0, pos = 0;
 
-  va_start(ap, s);
+  va_copy(ap2, ap);
   s2 = s;
   while (s2 != NULL) {
     len += strlen(s2);
-    s2 = va_arg(ap, const char*);
+    s2 = va_arg(ap2, const char*);
   }
-  va_end(ap);
+  va_end(ap2);
 
-  result = malloc(len + 1);
+  result = alloc_in(arena, len + 1);
 
   pos = 0;
 
-  va_start(ap, s);
   s2 = s;
   while (s2 != NULL) {
     len = strlen(s2);
@@ -32,17 +46,42 @@ char *append_strings(const char *s, ...) {
     pos += len;
     s2 = va_arg(ap, const char*);
   }
-  va_end(ap);
 
   result[pos] = 0;
 
   return result;
 }
 
-char *to_string(long v) {
+char *append_strings(const char *s, ...) {
+  char *result;
+  va_list ap;
+
+  va_start(ap, s);
+  result = vappend_strings(NULL, s, ap);
+  va_end(ap);
+
+  return result;
+}
+
+char *append_strings_in(arena_t *arena, const char *s, ...) {
+  char *result;
+  va_list ap;
+
+  va_start(ap, s);
+  result = vappend_strings(arena, s, ap);
+  va_end(ap);
+
+  return result;
+}
+
+char *to_string_in(arena_t *arena, long v) {
   char buffer[64];
   snprintf(buffer, sizeof(buffer), "%ld", v);
-  return strdup(buffer);
+  return strndup_in(arena, buffer, sizeof(buffer));
+}
+
+char *to_string(long v) {
+  return to_string_in(NULL, v);
 }
 
 int starts_with(char *starts, char *s) {
@@ -51,7 +90,7 @@ int starts_with(char *starts, char *s) {
   return !strncmp(starts, s, len);
 }
 
-char **split_string(const char *str, char sep) {
+char **split_string_in(arena_t *arena, const char *str, char sep) {
   int len = strlen(str);
   int i, j, k;
   int count = 1;
@@ -64,22 +103,26 @@ char **split_string(const char *str, char sep) {
   if (len && (str[len-1] == sep))
     --count; /* because `sep` is acting as a terminator */
 
-  strs = malloc(sizeof(char *) * (count + 1));
+  strs = alloc_in(arena, sizeof(char *) * (count + 1));
   
   for (i = 0, j = 0, k = 0; i < len; i++) {
     if (str[i] == sep) {
-      strs[j++] = strndup(str + k, i - k);
+      strs[j++] = strndup_in(arena, str + k, i - k);
       k = i+1;
     }
   }
   if (k != len)
-    strs[j++] = strndup(str + k, len - k);
+    strs[j++] = strndup_in(arena, str + k, len - k);
   strs[j] = NULL;
 
   return strs;
 }
 
-char *join_strings(const char * const *strs, char sep) {
+char **split_string(const char *str, char sep) {
+  return split_string_in(NULL, str, sep);
+}
+
+char *join_strings_in(arena_t *arena, const char * const *strs, char sep) {
   size_t len = 0;
   int i;
   char *str;
@@ -88,7 +131,7 @@ char *join_strings(const char * const *strs, char sep) {
     len += strlen(strs[i]) + 1;
   }
 
-  str = malloc(len+1);
+  str = alloc_in(arena, len+1);
   len = 0;
 
   for (i = 0; strs[i] != NULL; i++) {
@@ -101,7 +144,11 @@ char *join_strings(const char * const *strs, char sep) {
   return str;
 }
 
-int parse_three(const char *buf,
+char *join_strings(const char * const *strs, char sep) {
+  return join_strings_in(NULL, strs, sep);
+}
+
+static int parse_three_in(arena_t *arena, const char *buf,
                 char **one_p, char **two_p, char **three_p,
                 int extra_space_ok) {
   char *s1, *s2;
@@ -137,32 +184,48 @@ int parse_three(const char *buf,
   len3 = len - len1 - len2 - 2;
 
   if (one_p)
-    *one_p = strndup(buf, len1);
+    *one_p = strndup_in(arena, buf, len1);
   if (two_p)
-    *two_p = strndup(s1+1, len2);
+    *two_p = strndup_in(arena, s1+1, len2);
   if (three_p)
-    *three_p = strndup(s2+1, len3);
+    *three_p = strndup_in(arena, s2+1, len3);
 
   return 1;
 }
 
+int parse_three(const char *buf,
+                char **one_p, char **two_p, char **three_p,
+                int extra_space_ok) {
+  return parse_three_in(NULL, buf, one_p, two_p, three_p, extra_space_ok);
+}
+
 int parse_request_line(const char *buf,
                        char **method_p, char **uri_p, char **version_p) {
-  return parse_three(buf, method_p, uri_p, version_p, 0);
+  return parse_three_in(NULL, buf, method_p, uri_p, version_p, 0);
+}
+
+int parse_request_line_in(arena_t *arena, const char *buf,
+                          char **method_p, char **uri_p, char **version_p) {
+  return parse_three_in(arena, buf, method_p, uri_p, version_p, 0);
 }
 
 int parse_status_line(const char *buf,
                       char **version_p, char **status_p, char **desc_p) {
-  return parse_three(buf, version_p, status_p, desc_p, 1);
+  return parse_three_in(NULL, buf, version_p, status_p, desc_p, 1);
 }
 
-void parse_header_line(char *buf, dictionary_t *d) {
+int parse_status_line_in(arena_t *arena, const char *buf,
+                         char **version_p, char **status_p, char **desc_p) {
+  return parse_three_in(arena, buf, version_p, status_p, desc_p, 1);
+}
+
+void parse_header_line_in(arena_t *arena, char *buf, dictionary_t *d) {
   char *s, *name;
   size_t len;
 
   s = strchr(buf, ':');
   if (s) {
-    name = strndup(buf, s - buf);
+    name = strndup_in(arena, buf, s - buf);
 
     /* skip leading whitespace */
     s++;
@@ -173,16 +236,20 @@ void parse_header_line(char *buf, dictionary_t *d) {
     while (len && isspace(((unsigned char *)s)[len-1]))
       --len;
       
-    dictionary_set(d, name, strndup(s, len));
+    dictionary_set(d, name, strndup_in(arena, s, len));
 
-    free(name);
+    free_in(arena, name);
   }
 }
 
+void parse_header_line(char *buf, dictionary_t *d) {
+  parse_header_line_in(NULL, buf, d);
+}
+
 #define IS_QSEP(c) (((c) == '&') || ((c) == ';'))
 #define IS_END(c)  (((c) == 0) || ((c) == '#'))
 
-void parse_query(const char *buf, dictionary_t *d) {
+void parse_query_in(arena_t *arena, const char *buf, dictionary_t *d) {
   const char *name_start;
   char *name, *d_name;
   const char *data_start;
@@ -194,7 +261,7 @@ void parse_query(const char *buf, dictionary_t *d) {
     while (!IS_END(*buf) && (*buf != '=') && !IS_QSEP(*buf))
       buf++;
 
-    name = strndup(name_start, buf - name_start);
+    name = strndup_in(arena, name_start, buf - name_start);
 
     if (!IS_END(*buf) && !IS_QSEP(*buf))
       buf++;
@@ -203,28 +270,36 @@ void parse_query(const char *buf, dictionary_t *d) {
     while (!IS_END(*buf) && !IS_QSEP(*buf))
       buf++;
 
-    data = strndup(data_start, buf - data_start);
+    data = strndup_in(arena, data_start, buf - data_start);
 
-    d_name = query_decode(name);
-    d_data = query_decode(data);
+    d_name = query_decode_in(arena, name);
+    d_data = query_decode_in(arena, data);
 
     dictionary_set(d, d_name, d_data);
 
-    free(d_name);
-    free(name);
-    free(data);
+    free_in(arena, d_name);
+    free_in(arena, name);
+    free_in(arena, data);
 
     if (!IS_END(*buf))
       buf++;
   }
 }
 
-void parse_uriquery(const char *buf, dictionary_t *d) {
+void parse_query(const char *buf, dictionary_t *d) {
+  parse_query_in(NULL, buf, d);
+}
+
+void parse_uriquery_in(arena_t *arena, const char *buf, dictionary_t *d) {
   char *s;
 
   s = strchr(buf, '?');
   if (s)
-    parse_query(s+1, d);
+    parse_query_in(arena, s+1, d);
+}
+
+void parse_uriquery(const char *buf, dictionary_t *d) {
+  parse_uriquery_in(NULL, buf, d);
 }
 
 static int ishexdigit(int v) {
@@ -242,7 +317,7 @@ static int hex_value(int v) {
     return v - 'a' + 10;
 }
 
-char *query_decode(const char *data) {
+char *query_decode_in(arena_t *arena, const char *data) {
   int i, j;
   char *dest = NULL;
 
@@ -268,10 +343,14 @@ char *query_decode(const char *data) {
       return dest;
     }
 
-    dest = malloc(j + 1);
+    dest = alloc_in(arena, j + 1);
   }
 }
 
+char *query_decode(const char *data) {
+  return query_decode_in(NULL, data);
+}
+
 static int hex_digit(int v) {
   if (v < 10)
     return '0' + v;
@@ -279,7 +358,7 @@ static int hex_digit(int v) {
     return 'a' + (v - 10);
 }
 
-char *query_encode(const char *data) {
+char *query_encode_in(arena_t *arena, const char *data) {
   int i, j;
   char *dest = NULL;
 
@@ -306,11 +385,15 @@ char *query_encode(const char *data) {
       return dest;
     }
 
-    dest = malloc(j + 1);
+    dest = alloc_in(arena, j + 1);
   }
 }
 
-char *entity_encode(const char *data) {
+char *query_encode(const char *data) {
+  return query_encode_in(NULL, data);
+}
+
+char *entity_encode_in(arena_t *arena, const char *data) {
   int i, j;
   char *dest = NULL;
 
@@ -357,6 +440,10 @@ char *entity_encode(const char *data) {
       return dest;
     }
 
-    dest = malloc(j + 1);
+    dest = alloc_in(arena, j + 1);
   }  
 }
+
+char *entity_encode(const char *data) {
+  return entity_encode_in(NULL, data);
+}
@@ -1,3 +1,5 @@
+#include "arena.h"
+
 /* Allocates a new string to append all of the given strings. Any
    number of strings can be provided, and NULL must be provided after
    the last string.
@@ -74,3 +76,23 @@ char *query_decode(const char *);
    except that each `<`, `>`, `&`, and `"` character is converted to
    its `&lt;`, `&gt;`, `&amp;`, and `&quot;` encoding, respectively: */
 char *entity_encode(const char *);
+
+/* Each of the following is like the function without `_in`, except
+   that every string and array it allocates -- including the values it
+   adds to `d` -- lives in `arena`, so nothing needs to be freed before
+   the arena is reset or destroyed. A dictionary passed to one of them
+   should come from make_dictionary_in() with the same arena: */
+char *append_strings_in(arena_t *arena, const char *s, ...);
+char *to_string_in(arena_t *arena, long v);
+char **split_string_in(arena_t *arena, const char *str, char sep);
+char *join_strings_in(arena_t *arena, const char * const *strs, char sep);
+int parse_request_line_in(arena_t *arena, const char *buf,
+                          char **method_p, char **uri_p, char **version_p);
+int parse_status_line_in(arena_t *arena, const char *buf,
+                         char **version_p, char **status_p, char **desc_p);
+void parse_header_line_in(arena_t *arena, char *buf, dictionary_t *d);
+void parse_query_in(arena_t *arena, const char *buf, dictionary_t *d);
+void parse_uriquery_in(arena_t *arena, const char *buf, dictionary_t *d);
+char *query_encode_in(arena_t *arena, const char *);
+char *query_decode_in(arena_t *arena, const char *);
+char *entity_encode_in(arena_t *arena, const char *);
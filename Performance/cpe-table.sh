@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Builds one table out of several driver outputs so that the same
+# kernel version can be compared across build configurations.
+#
+# Usage: ./cpe-table.sh cpe-<config>.txt ...
+#
+# Each row is one kernel version under one configuration. "Mean" is
+# the geometric mean of its CPEs and "Gain" is how much faster that
+# mean is than the same version under the first configuration given.
+
+if [ $# -eq 0 ]
+then
+    echo "Usage: $0 cpe-<config>.txt ..."
+    exit 1
+fi
+
+awk '
+FNR == 1 {
+    config = FILENAME
+    sub(/^.*cpe-/, "", config)
+    sub(/\.txt$/, "", config)
+    configs[++nconfigs] = config
+}
+
+/^(Complex|Motion): Version = / {
+    kernel = ($1 == "Complex:") ? "complex" : "motion"
+    version = $0
+    sub(/^[A-Za-z]+: Version = /, "", version)
+    sub(/:$/, "", version)
+    key = kernel SUBSEP version
+    if (!(key in seen)) {
+        seen[key] = 1
+        keys[++nkeys] = key
+    }
+}
+
+/^Dim\t/ {
+    ndims[kernel] = 0
+    for (i = 2; i <= NF - 1; i++)
+        dims[kernel, ++ndims[kernel]] = $i
+}
+
+/^Your CPEs\t/ {
+    n = split($0, f, "\t")
+    logsum = 0
+    for (i = 2; i <= n; i++) {
+        cpe[key, config, i - 1] = f[i]
+        logsum += log(f[i])
+    }
+    mean[key, config] = exp(logsum / (n - 1))
+}
+
+END {
+    for (k = 1; k <= nkeys; k++) {
+        split(keys[k], parts, SUBSEP)
+        kernel = parts[1]
+        if (kernel != last_kernel) {
+            printf("\n%-48s %-12s", (kernel == "complex") ? "Complex" : "Motion", "Config")
+            for (d = 1; d <= ndims[kernel]; d++)
+                printf(" %7s", dims[kernel, d])
+            printf(" %7s %7s\n", "Mean", "Gain")
+            last_kernel = kernel
+        }
+        for (c = 1; c <= nconfigs; c++) {
+            if (!((keys[k], configs[c]) in mean))
+                continue
+            printf("%-48.48s %-12s", parts[2], configs[c])
+            for (d = 1; d <= ndims[kernel]; d++)
+                printf(" %7.1f", cpe[keys[k], configs[c], d])
+            printf(" %7.2f", mean[keys[k], configs[c]])
+            if ((keys[k], configs[1]) in mean)
+                printf(" %6.2fx", mean[keys[k], configs[1]] / mean[keys[k], configs[c]])
+            printf("\n")
+        }
+    }
+}
+' "$@"
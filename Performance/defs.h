@@ -28,10 +28,18 @@ typedef void (*motion_test_func) (int, pixel*, pixel*);
 void complex(int, pixel *, pixel *);
 void motion(int, pixel *, pixel *);
 
+/* complex with software prefetching, swept over distances by driver -F */
+void complex_prefetch(int, pixel *, pixel *);
+void set_prefetch_distance(int tiles);
+
 void register_complex_functions(void);
 void register_motion_functions(void);
 void add_complex_function(complex_test_func, char*);
 void add_motion_function(motion_test_func, char*);
 
+/* Versions whose channels may be off by up to `tolerance` from the exact result */
+void add_approx_complex_function(complex_test_func, char*, int tolerance);
+void add_approx_motion_function(motion_test_func, char*, int tolerance);
+
 #endif /* _DEFS_H_ */
 
@@ -23,9 +23,13 @@
 #include <time.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
 #include "fcyc.h"
 #include "defs.h"
 #include "config.h"
+#include "pipeline.h"
+#include "tileprof.h"
+#include "fastdiv.h"
 
 /* Student structure that identifies the students */
 extern student_t student; 
@@ -52,6 +56,9 @@ typedef struct {
     double cpes[DIM_CNT]; /* One CPE result for each dimension */
     char *description;    /* ASCII description of the test function */
     unsigned short valid; /* The function is tested if this is non zero */
+    int tolerance;        /* How far off a channel may be (approximate versions) */
+    int max_error;        /* Largest channel error seen in the checks */
+    double inexact;       /* Largest fraction of channels that were off */
 } bench_t;
 
 /* The range of image dimensions that we will be testing */
@@ -100,23 +107,35 @@ int save_all_image_files;
 
 /******************** Functions begin *************************/
 
-void add_motion_function(motion_test_func f, char *description) 
+void add_approx_motion_function(motion_test_func f, char *description, int tolerance) 
 {
     benchmarks_motion[motion_benchmark_count].motion_funct = f;
     benchmarks_motion[motion_benchmark_count].description = description;
     benchmarks_motion[motion_benchmark_count].valid = 0;  
+    benchmarks_motion[motion_benchmark_count].tolerance = tolerance;
     motion_benchmark_count++;
 }
 
+void add_motion_function(motion_test_func f, char *description) 
+{
+    add_approx_motion_function(f, description, 0);
+}
+
 
-void add_complex_function(complex_test_func f, char *description) 
+void add_approx_complex_function(complex_test_func f, char *description, int tolerance) 
 {
     benchmarks_complex[complex_benchmark_count].complex_funct = f;
     benchmarks_complex[complex_benchmark_count].description = description;
     benchmarks_complex[complex_benchmark_count].valid = 0;
+    benchmarks_complex[complex_benchmark_count].tolerance = tolerance;
     complex_benchmark_count++;
 }
 
+void add_complex_function(complex_test_func f, char *description) 
+{
+    add_approx_complex_function(f, description, 0);
+}
+
 /* 
  * random_in_interval - Returns random integer in interval [low, high) 
  */
@@ -130,14 +149,9 @@ static int scale(int i, int from, int to) {
   return (int)(((double)i / from) * to);
 }
 
-static void write_image(int dim, char *variant, char *mode, pixel *img)
+static void write_image_to(FILE *f, int dim, pixel *img)
 {
-  char buf[64];
   int i, j;
-  FILE *f;
-
-  sprintf(buf, "%s_%s_%d.image", variant, mode, dim);
-  f = fopen(buf, "w");
 
   fprintf(f, "%d %d\n", dim, dim);
 
@@ -152,7 +166,16 @@ static void write_image(int dim, char *variant, char *mode, pixel *img)
     }
     fprintf(f, "\n");
   }
+}
 
+static void write_image(int dim, char *variant, char *mode, pixel *img)
+{
+  char buf[64];
+  FILE *f;
+
+  sprintf(buf, "%s_%s_%d.image", variant, mode, dim);
+  f = fopen(buf, "w");
+  write_image_to(f, dim, img);
   fclose(f);
 }
 
@@ -211,42 +234,53 @@ static void set_random(pixel* img, int i, int j, int dim)
 
 
 /*
- * create - creates a dimxdim image aligned to a BSIZE byte boundary
+ * fill_image - fills a dimxdim image according to image_mode
  */
-static void create(int dim)
+static void fill_image(pixel *img, int dim)
 {
   int i, j;
-  
-  /* Align the images to BSIZE byte boundaries */
-  orig = data;
-  while ((long)orig % BSIZE)
-    orig = (pixel *)(((char *)orig) + 1);
-  tmp = orig + dim*dim;
-  result = tmp + dim*dim;
-  copy_of_orig = result + dim*dim;
-  
+
   for (i = 0; i < dim; i++) {
     for (j = 0; j < dim; j++) {
-      
-      
-      /* Initialize original image */
       switch (image_mode) {
       case GRADIENT:
-	set_gradient(orig, i, j, dim);
+	set_gradient(img, i, j, dim);
 	break;
       case SQUARES:
-	set_squares(orig, i, j, dim);
+	set_squares(img, i, j, dim);
 	break;
       case LINES:
-	set_lines(orig, i, j, dim);
+	set_lines(img, i, j, dim);
 	break;
       default:
       case RANDOM:
-	set_random(orig, i, j, dim);
+	set_random(img, i, j, dim);
 	break;
       }
-      
-      
+    }
+  }
+}
+
+/*
+ * create - creates a dimxdim image aligned to a BSIZE byte boundary
+ */
+static void create(int dim)
+{
+  int i, j;
+  
+  /* Align the images to BSIZE byte boundaries */
+  orig = data;
+  while ((long)orig % BSIZE)
+    orig = (pixel *)(((char *)orig) + 1);
+  tmp = orig + dim*dim;
+  result = tmp + dim*dim;
+  copy_of_orig = result + dim*dim;
+
+  /* Initialize original image */
+  fill_image(orig, dim);
+  
+  for (i = 0; i < dim; i++) {
+    for (j = 0; j < dim; j++) {
       /* Copy of original image for checking result */
       copy_of_orig[RIDX(i,j,dim)].red = orig[RIDX(i,j,dim)].red;
       copy_of_orig[RIDX(i,j,dim)].green = orig[RIDX(i,j,dim)].green;
@@ -275,6 +309,34 @@ static int compare_pixels(pixel p1, pixel p2)
 }
 
 
+/* 
+ * pixel_error - Returns the largest difference between the RGB
+ *    values of the two arguments
+ */
+static int pixel_error(pixel p1, pixel p2) 
+{
+    int r = abs((int)p1.red - (int)p2.red);
+    int g = abs((int)p1.green - (int)p2.green);
+    int b = abs((int)p1.blue - (int)p2.blue);
+    return max(r, max(g, b));
+}
+
+/* 
+ * Error statistics of the last check_complex or check_motion call:
+ * the largest channel error and the fraction of inexact channels.
+ */
+static int check_max_error;
+static double check_inexact;
+
+static void count_error(pixel got, pixel want, long *inexact)
+{
+    int e = pixel_error(got, want);
+
+    if (e > check_max_error)
+	check_max_error = e;
+    *inexact += (got.red != want.red) + (got.green != want.green) + (got.blue != want.blue);
+}
+
 /* Make sure the orig array is unchanged */
 static int check_orig(int dim) 
 {
@@ -294,9 +356,10 @@ static int check_orig(int dim)
 /* 
  * check_complex - Make sure the complex actually works. 
  */
-static int check_complex(int dim, int save_images)
+static int check_complex(int dim, int save_images, int tolerance)
 {
     int err = 0;
+    long inexact = 0;
     int i, j;
     int badi = 0;
     int badj = 0;
@@ -333,10 +396,12 @@ static int check_complex(int dim, int save_images)
       write_image(dim, "complex", "expected", tmp);
     }
 
+    check_max_error = 0;
     for (j = 0; j < dim; j++)
       for (i = 0; i < dim; i++) {
-        if (compare_pixels(tmp[RIDX(i,j,dim)],
-                           result[RIDX(i,j,dim)])) {
+        count_error(result[RIDX(i,j,dim)], tmp[RIDX(i,j,dim)], &inexact);
+        if (pixel_error(tmp[RIDX(i,j,dim)],
+                        result[RIDX(i,j,dim)]) > tolerance) {
           err++;
           badi = i;
           badj = j;
@@ -344,6 +409,7 @@ static int check_complex(int dim, int save_images)
           res_should_be = tmp[RIDX(i,j,dim)];
         }
       }
+    check_inexact = (double)inexact / (3.0 * dim * dim);
 
     if (err) {
 	printf("\n");
@@ -389,8 +455,9 @@ static pixel check_weighted_sum(int dim, int i, int j, pixel *src) {
  * check_motion - Make sure the motion function actually works.  The
  * orig array should not have been tampered with!  
  */
-static int check_motion(int dim, int save_images) {
+static int check_motion(int dim, int save_images, int tolerance) {
     int err = 0;
+    long inexact = 0;
     int i, j;
     int badi = 0;
     int badj = 0;
@@ -410,10 +477,12 @@ static int check_motion(int dim, int save_images) {
       write_image(dim, "motion", "expected", tmp);
     }
 
+    check_max_error = 0;
     for (i = 0; i < dim; i++) {
 	for (j = 0; j < dim; j++) {
-	    if (compare_pixels(result[RIDX(i,j,dim)],
-                               tmp[RIDX(i,j,dim)])) {
+	    count_error(result[RIDX(i,j,dim)], tmp[RIDX(i,j,dim)], &inexact);
+	    if (pixel_error(result[RIDX(i,j,dim)],
+                            tmp[RIDX(i,j,dim)]) > tolerance) {
               err++;
               badi = i;
               badj = j;
@@ -422,6 +491,7 @@ static int check_motion(int dim, int save_images) {
 	    }
 	}
     }
+    check_inexact = (double)inexact / (3.0 * dim * dim);
 
     if (err) {
 	printf("\n");
@@ -437,6 +507,49 @@ static int check_motion(int dim, int save_images) {
 }
 
 
+/* 
+ * check_fastdiv - Exhaustively checks the divides in fastdiv.h against
+ *     "/" for every dividend the kernels can produce: DIV_EXACT must
+ *     match everywhere and DIVn_APPROX must stay within 1 for sums of
+ *     n channels. Returns the largest approximate error, or -1 if
+ *     either check fails.
+ */
+static int check_fastdiv(void)
+{
+    static int divisors[] = {2, 3, 4, 6, 9};
+    unsigned x, want, got;
+    int i, d, e, worst = 0;
+
+    for (i = 0; i < sizeof(divisors) / sizeof(divisors[0]); i++) {
+	d = divisors[i];
+	for (x = 0; x <= FASTDIV_MAX; x++) {
+	    want = x / d;
+	    got = DIV_EXACT(x, d);
+	    if (got != want) {
+		printf("Error: DIV_EXACT(%u, %d) = %u, should be %u\n", x, d, got, want);
+		return -1;
+	    }
+	    if (x > d * 65535)
+		continue;
+	    switch (d) {
+	    case 2: got = DIV2_APPROX(x); break;
+	    case 3: got = DIV3_APPROX(x); break;
+	    case 4: got = DIV4_APPROX(x); break;
+	    case 6: got = DIV6_APPROX(x); break;
+	    default: got = DIV9_APPROX(x); break;
+	    }
+	    e = abs((int)got - (int)want);
+	    if (e > 1) {
+		printf("Error: DIV%d_APPROX(%u) = %u, should be within 1 of %u\n", d, x, got, want);
+		return -1;
+	    }
+	    worst = max(worst, e);
+	}
+    }
+    return worst;
+}
+
+
 void complex_wrapper(void *arglist[]) 
 {
   pixel *orig, *result;
@@ -486,7 +599,7 @@ void test_complex(int bench_index)
 	/* Check for odd dimension */
 	create(ODD_DIM);
 	run_complex_benchmark(bench_index, ODD_DIM);
-	if (check_complex(ODD_DIM, save_test_image_files)) {
+	if (check_complex(ODD_DIM, save_test_image_files, benchmarks_complex[bench_index].tolerance)) {
 	    printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 		   benchmarks_complex[bench_index].description, ODD_DIM);
 	    return;
@@ -501,11 +614,13 @@ void test_complex(int bench_index)
 
 	/* Check that the code works */
 	run_complex_benchmark(bench_index, dim);
-	if (check_complex(dim, save_all_image_files)) {
+	if (check_complex(dim, save_all_image_files, benchmarks_complex[bench_index].tolerance)) {
 	    printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 		   benchmarks_complex[bench_index].description, dim);
 	    return;
 	}
+	benchmarks_complex[bench_index].max_error = max(benchmarks_complex[bench_index].max_error, check_max_error);
+	benchmarks_complex[bench_index].inexact = max(benchmarks_complex[bench_index].inexact, check_inexact);
 
 	/* Measure CPE */
 	{
@@ -552,6 +667,12 @@ void test_complex(int bench_index)
     }
     printf("\n");
 
+    if (benchmarks_complex[bench_index].tolerance)
+	printf("Max error\t%d (allowed %d, up to %.1f%% of channels inexact)\n",
+	       benchmarks_complex[bench_index].max_error,
+	       benchmarks_complex[bench_index].tolerance,
+	       100.0 * benchmarks_complex[bench_index].inexact);
+
     /* Compute Speedup */
     {
 	double prod, ratio, mean;
@@ -604,7 +725,7 @@ void test_motion(int bench_index)
 	/* Check correctness for odd (non power of two dimensions */
 	create(ODD_DIM);
 	run_motion_benchmark(bench_index, ODD_DIM);
-	if (check_motion(ODD_DIM, save_test_image_files)) {
+	if (check_motion(ODD_DIM, save_test_image_files, benchmarks_motion[bench_index].tolerance)) {
 	    printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 		   benchmarks_motion[bench_index].description, ODD_DIM);
 	    return;
@@ -619,11 +740,13 @@ void test_motion(int bench_index)
 #endif
 	/* Check that the code works */
 	run_motion_benchmark(bench_index, dim);
-	if (check_motion(dim, save_all_image_files)) {
+	if (check_motion(dim, save_all_image_files, benchmarks_motion[bench_index].tolerance)) {
 	    printf("Benchmark \"%s\" failed correctness check for dimension %d.\n",
 		   benchmarks_motion[bench_index].description, dim);
 	    return;
 	}
+	benchmarks_motion[bench_index].max_error = max(benchmarks_motion[bench_index].max_error, check_max_error);
+	benchmarks_motion[bench_index].inexact = max(benchmarks_motion[bench_index].inexact, check_inexact);
 
 	/* Measure CPE */
 	{
@@ -667,6 +790,12 @@ void test_motion(int bench_index)
     }
     printf("\n");
 
+    if (benchmarks_motion[bench_index].tolerance)
+	printf("Max error\t%d (allowed %d, up to %.1f%% of channels inexact)\n",
+	       benchmarks_motion[bench_index].max_error,
+	       benchmarks_motion[bench_index].tolerance,
+	       100.0 * benchmarks_motion[bench_index].inexact);
+
     /* Compute speedup */
     {
 	double prod, ratio, mean;
@@ -697,10 +826,182 @@ void test_motion(int bench_index)
     return;  
 }
 
+/*
+ * Pipeline stages (see pipeline.h). A frame is generated into img[0],
+ * complex() turns it into img[1], motion() turns that into img[2],
+ * and the result is written out in the same format as the .image
+ * files. Unless -I is given, the output goes to /dev/null so that the
+ * formatting cost is still measured without filling the disk.
+ */
+static FILE *pipeline_out = NULL;
+
+static void generate_stage(frame_t *f)
+{
+  fill_image(f->img[0], f->dim);
+}
+
+static void complex_stage(frame_t *f)
+{
+  complex(f->dim, f->img[0], f->img[1]);
+}
+
+static void motion_stage(frame_t *f)
+{
+  motion(f->dim, f->img[1], f->img[2]);
+}
+
+static void write_stage(frame_t *f)
+{
+  char mode[16];
+
+  if (save_all_image_files) {
+    sprintf(mode, "%d", f->id);
+    write_image(f->dim, "pipeline", mode, f->img[2]);
+  }
+  else
+    write_image_to(pipeline_out, f->dim, f->img[2]);
+}
+
+static stage_t pipeline_stages[] = {
+  {"generate", generate_stage},
+  {"complex", complex_stage},
+  {"motion", motion_stage},
+  {"write", write_stage},
+};
+
+static int test_pipeline(int frames, int dim, int depth)
+{
+  int status;
+
+  pipeline_out = fopen("/dev/null", "w");
+  if (pipeline_out == NULL) {
+    printf("Can't open /dev/null\n");
+    return -1;
+  }
+  status = run_pipeline(pipeline_stages,
+                        sizeof(pipeline_stages) / sizeof(pipeline_stages[0]),
+                        frames, dim, depth);
+  fclose(pipeline_out);
+  return status;
+}
+
+/*
+ * profile_tiles - Runs complex() and motion() on every test dimension
+ *     with the per-tile profiler on and writes a "<kernel>_<dim>.heat"
+ *     heatmap next to the "<kernel>_result_<dim>.image" it belongs to.
+ *     View them with: racket show-image.rkt --heat <heat> <image>
+ */
+#define TILE_PROFILE_RUNS 5
+static int profile_tiles(void)
+{
+#ifdef PROFILE_TILES
+  char path[64];
+  int i, run, dim;
+
+  for (i = 0; i < DIM_CNT; i++) {
+    dim = test_dim_complex[i];
+    create(dim);
+    tileprof_reset();
+    for (run = 0; run < TILE_PROFILE_RUNS; run++)
+      complex(dim, orig, result);
+    sprintf(path, "complex_%d.heat", dim);
+    if (tileprof_dump(path, "complex", dim) < 0)
+      return -1;
+    write_image(dim, "complex", "result", result);
+  }
+
+  for (i = 0; i < DIM_CNT; i++) {
+    dim = test_dim_motion[i];
+    create(dim);
+    tileprof_reset();
+    for (run = 0; run < TILE_PROFILE_RUNS; run++)
+      motion(dim, orig, result);
+    sprintf(path, "motion_%d.heat", dim);
+    if (tileprof_dump(path, "motion", dim) < 0)
+      return -1;
+    write_image(dim, "motion", "result", result);
+  }
+  return 0;
+#else
+  printf("The kernels were built without tile profiling; use \"make profile\" and run driver-profile.\n");
+  return -1;
+#endif
+}
+
+/*
+ * sweep_prefetch - Runs complex_prefetch once for every prefetch
+ *     distance in the comma-separated `list` and prints one table with
+ *     the CPE of each distance and its speedup over the first one.
+ *     Returns -1 without running anything if a distance is not a
+ *     non-negative number or there are none or more than MAX_SWEEP.
+ */
+#define MAX_SWEEP 16
+static int sweep_prefetch(char *list)
+{
+    static char descriptions[MAX_SWEEP][80];
+    double cpes[MAX_SWEEP][DIM_CNT];
+    int distances[MAX_SWEEP];
+    double means[MAX_SWEEP];
+    int n = 0, idx, i, k;
+    char *tok, *end;
+    long distance;
+
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ","), n++) {
+	if (n == MAX_SWEEP) {
+	    fprintf(stderr, "at most %d prefetch distances can be swept\n", MAX_SWEEP);
+	    return -1;
+	}
+	distance = strtol(tok, &end, 10);
+	if (end == tok || *end != '\0' || distance < 0 || distance > INT_MAX) {
+	    fprintf(stderr, "bad prefetch distance: %s\n", tok);
+	    return -1;
+	}
+	distances[n] = distance;
+    }
+    if (n == 0) {
+	fprintf(stderr, "no prefetch distances to sweep\n");
+	return -1;
+    }
+
+    for (idx = 0; idx < complex_benchmark_count; idx++)
+	if (benchmarks_complex[idx].complex_funct == complex_prefetch)
+	    break;
+    if (idx == complex_benchmark_count)
+	add_complex_function(&complex_prefetch, "complex_prefetch");
+
+    for (k = 0; k < n; k++) {
+	set_prefetch_distance(distances[k]);
+	sprintf(descriptions[k], "complex_prefetch: distance %d tiles", distances[k]);
+	benchmarks_complex[idx].description = descriptions[k];
+	test_complex(idx);
+
+	means[k] = 1.0;
+	for (i = 0; i < DIM_CNT; i++) {
+	    cpes[k][i] = benchmarks_complex[idx].cpes[i];
+	    means[k] *= cpes[k][i];
+	}
+	means[k] = pow(means[k], 1.0/(double) DIM_CNT);
+    }
+
+    printf("Prefetch distance sweep (complex_prefetch):\n");
+    printf("Distance");
+    for (i = 0; i < DIM_CNT; i++)
+	printf("\t%d", test_dim_complex[i]);
+    printf("\tMean\tSpeedup\n");
+    for (k = 0; k < n; k++) {
+	printf("%d", distances[k]);
+	for (i = 0; i < DIM_CNT; i++)
+	    printf("\t%.1f", cpes[k][i]);
+	printf("\t%.2f\t%.2f\n", means[k], means[0] / means[k]);
+    }
+    printf("\n");
+    return 0;
+}
+
 
 void usage(char *progname) 
 {
-    fprintf(stderr, "Usage: %s [-hqg] [-f <func_file>] [-d <dump_file>]\n", progname);    
+    fprintf(stderr, "Usage: %s [-hqgH] [-f <func_file>] [-d <dump_file>] [-p <frames>]\n", progname);    
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h         Print this message\n");
     fprintf(stderr, "  -i         Save test images as \".image\" files\n");
@@ -710,6 +1011,14 @@ void usage(char *progname)
     fprintf(stderr, "  -g         Autograder mode: checks only complex() and motion()\n");
     fprintf(stderr, "  -f <file>  Get test function names from dump file <file>\n");
     fprintf(stderr, "  -d <file>  Emit a dump file <file> for later use with -f\n");
+    fprintf(stderr, "  -p <n>     Stream <n> frames through the overlapped generate,\n");
+    fprintf(stderr, "             complex, motion, write pipeline and report each stage\n");
+    fprintf(stderr, "  -P <dim>   Frame dimension for -p, a multiple of 64 (default 512)\n");
+    fprintf(stderr, "  -Q <n>     Frames that may wait between two stages for -p (default 2)\n");
+    fprintf(stderr, "  -F <list>  Sweep complex_prefetch over comma-separated prefetch\n");
+    fprintf(stderr, "             distances in tiles (at most 16), e.g. -F 0,1,2,4,8\n");
+    fprintf(stderr, "  -H         Write per-tile cycle heatmaps of complex() and motion()\n");
+    fprintf(stderr, "             (needs a \"make profile\" build)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -725,13 +1034,18 @@ int main(int argc, char *argv[])
     char c = '0';
     char *bench_func_file = NULL;
     char *func_dump_file = NULL;
+    int pipeline_frames = 0;
+    int pipeline_dim = 512;
+    int pipeline_depth = 2;
+    int heatmaps = 0;
+    char *prefetch_sweep = NULL;
 
     /* register all the defined functions */
     register_complex_functions();
     register_motion_functions();
 
     /* parse command line args */
-    while ((c = getopt(argc, argv, "iIm:tgqf:d:s:h")) != -1)
+    while ((c = getopt(argc, argv, "iIm:tgqf:d:s:p:P:Q:HF:h")) != -1)
 	switch (c) {
 
         case 'i':
@@ -798,6 +1112,30 @@ int main(int argc, char *argv[])
 	    }
 	    break;
 
+	case 'p': /* run the frame pipeline instead of the CPE tests */
+	    pipeline_frames = atoi(optarg);
+	    break;
+
+	case 'P':
+	    pipeline_dim = atoi(optarg);
+	    if (pipeline_dim < 1 || pipeline_dim % PIPELINE_DIM_MULTIPLE != 0) {
+		fprintf(stderr, "frame dimension must be a positive multiple of %d: %s\n", PIPELINE_DIM_MULTIPLE, optarg);
+		usage(argv[0]);
+	    }
+	    break;
+
+	case 'Q':
+	    pipeline_depth = atoi(optarg);
+	    break;
+
+	case 'F': /* sweep the prefetch distance of complex_prefetch */
+	    prefetch_sweep = optarg;
+	    break;
+
+	case 'H': /* per-tile cycle heatmaps instead of the CPE tests */
+	    heatmaps = 1;
+	    break;
+
 	case 'h': /* print help message */
 	    usage(argv[0]);
 
@@ -820,8 +1158,24 @@ int main(int argc, char *argv[])
 	printf("\n");
     }
 
+    /* The fixed-point kernels are only valid if their divides are */
+    {
+	int approx_error = check_fastdiv();
+	if (approx_error < 0)
+	    exit(1);
+	if (!autograder)
+	    printf("Fixed-point divides: exact for all %d dividends, approximate error <= %d\n\n",
+		   FASTDIV_MAX + 1, approx_error);
+    }
+
     srand(seed);
 
+    if (pipeline_frames > 0)
+	return test_pipeline(pipeline_frames, pipeline_dim, pipeline_depth) ? 1 : 0;
+
+    if (heatmaps)
+	return profile_tiles() ? 1 : 0;
+
     /* 
      * If we are running in autograder mode, we will only test
      * the complex() and bench() functions.
@@ -898,6 +1252,12 @@ int main(int argc, char *argv[])
     set_fcyc_compensate(1); /* try to compensate for timer overhead */
 #endif
 
+    if (prefetch_sweep != NULL) {
+	if (sweep_prefetch(prefetch_sweep) < 0)
+	    usage(argv[0]);
+	return 0;
+    }
+
     for (i = 0; i < complex_benchmark_count; i++) {
 	if (benchmarks_complex[i].valid)
 	    test_complex(i);
@@ -0,0 +1,41 @@
+/*
+ * fastdiv.h - Fixed-point reciprocals for the averaging divides.
+ *
+ * complex() divides a sum of three 16-bit channels by 3 and motion()
+ * divides a sum of up to nine 16-bit channels by 9, 6, 4, 3 or 2, so
+ * every dividend is at most 9 * 65535 = FASTDIV_MAX.
+ *
+ * DIV_EXACT multiplies by RECIP_EXACT(d) = floor(2^32 / d) + 1 and
+ * keeps the high 32 bits. That constant is (2^32 + e) / d for some
+ * 1 <= e <= d, so the product overshoots x / d by x * e / (d * 2^32),
+ * which stays below 1/d while x * e < 2^32. For d <= 9 that holds for
+ * every x <= FASTDIV_MAX, so the result always equals x / d. driver.c
+ * re-checks this exhaustively.
+ *
+ * The DIVn_APPROX forms stay in 32-bit arithmetic (half the width of
+ * DIV_EXACT, so twice as many lanes per vector register) by dropping
+ * low bits of x first. They only hold for a sum of n channels, that is
+ * x <= n * 65535: above that DIV3_APPROX overflows 32 bits. In that
+ * range their result is within 1 of x / n; driver.c checks every such
+ * x and measures the actual error.
+ */
+#ifndef _FASTDIV_H_
+#define _FASTDIV_H_
+
+#define FASTDIV_MAX (9 * 65535)
+
+#define RECIP_EXACT(d) ((unsigned)(0x100000000ULL / (d)) + 1)
+#define DIV_EXACT(x, d) ((unsigned)(((unsigned long long)(x) * RECIP_EXACT(d)) >> 32))
+
+#define DIV2_APPROX(x) ((unsigned)(x) >> 1)
+#define DIV3_APPROX(x) (((unsigned)(x) * 21845u) >> 16)
+#define DIV4_APPROX(x) ((unsigned)(x) >> 2)
+#define DIV6_APPROX(x) ((((unsigned)(x) >> 1) * 21845u) >> 16)
+#define DIV9_APPROX(x) ((((unsigned)(x) >> 2) * 29127u) >> 16)
+
+/* How the kernels divide (see divide() in kernels.c) */
+#define DIVIDE_PLAIN      0 /* the C "/" operator */
+#define DIVIDE_RECIPROCAL 1 /* DIV_EXACT */
+#define DIVIDE_APPROX     2 /* DIVn_APPROX, off by at most 1 */
+
+#endif /* _FASTDIV_H_ */
@@ -5,6 +5,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "defs.h"
+#include "tileprof.h"
+#include "fastdiv.h"
+
+/* Helpers that are specialized per divide mode must always be inlined */
+#define INLINE static inline __attribute__((always_inline))
 
 /* 
  * Please fill in the following student struct 
@@ -15,11 +20,12 @@ student_t student = {
 };
 
 // Helper Methods that I added. Each one operates on a portion of the matrices.
-static void All_Nine_Neighbors(int dim, int i, int j, pixel *src, pixel *dst);
-static void Six_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst);
-static void Six_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst);
-static void Three_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst);
-static void Three_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst);
+INLINE void All_Nine_Neighbors(int dim, int i, int j, pixel *src, pixel *dst, int mode);
+INLINE void Six_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode);
+INLINE void Six_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode);
+INLINE void Three_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode);
+INLINE void Three_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode);
+INLINE int divide(int sum, int divisor, int mode);
 
 /***************
  * COMPLEX KERNEL
@@ -65,12 +71,22 @@ void naive_complex(int dim, pixel *src, pixel *dest)
  * Readability note:
  *  - destination has j - 1 because the lookup loop subtracts from the end and the next j (not current) moves too far.
  *  - source has j + 1 because that's the right way to do it.
+ *
+ * Like motion, the body lives in complex_divide() so "mode" can swap in the faster divides from fastdiv.h.
+ *
+ * Each row of a tile writes one pixel into "width" different destination rows, so at dim >= 512 every one of those
+ * writes misses. With a "prefetch" distance above 0, while row r of the current tile is processed, row r of the tile
+ * that comes "prefetch" tiles later is prefetched: its source row and the destination row that source row will be
+ * written into. Spreading the prefetches over the rows keeps them from all arriving at once. The callers pass a constant
+ * 0 except complex_prefetch, so the prefetching compiles away everywhere else.
  */
-char complex_descr[] = "Final optimization of complex";
-void complex(int dim, pixel *src, pixel *dest)
+#define CACHE_LINE 64
+
+INLINE void complex_divide(int dim, pixel *src, pixel *dest, int mode, int prefetch)
 {
   // Eliminate repeated variable instantiations
-  int i, j, ii, jj;
+  int i, j, ii, jj, row;
+  int ahead_i, ahead_j, ahead_tile;
   unsigned short average;
 
   // Perform all the repeated calculation.
@@ -79,34 +95,106 @@ void complex(int dim, pixel *src, pixel *dest)
 
   // Reduce the number of lookups
   pixel lookupPix;
+  char *line, *end;
   
   // Set the block width according to how I explained in the contract of my fourth implementation.
   int width = (dim > 512)? 64 : (dim > 256)? 32: 16;
+  int tiles_per_row = dim / width;
+  int tile = 0;
 
   // Apply a blocking loop with 2x2 loop unrolling.
   for(i = 0; i < dim; i+=width) {
-    for(j = 0; j < dim; j+=width) {
-      for(ii = i; ii < i + width; ii++) {
+    for(j = 0; j < dim; j+=width, tile++) {
+      TILE_START(tile_start);
+
+      // Find the tile to prefetch, going across the same tile order as the loops.
+      ahead_tile = tile + prefetch;
+      ahead_i = (ahead_tile / tiles_per_row) * width;
+      ahead_j = (ahead_tile % tiles_per_row) * width;
+      if (prefetch <= 0 || ahead_i >= dim)
+        ahead_i = -1;
+
+      for(ii = i, row = 0; ii < i + width; ii++, row++) {
+        if (ahead_i >= 0) {
+          // Source row "row" of the tile ahead.
+          line = (char *)(src + RIDX(ahead_i + row, ahead_j, dim));
+          end = (char *)(src + RIDX(ahead_i + row, ahead_j + width, dim));
+          for (; line < end; line += CACHE_LINE)
+            __builtin_prefetch(line, 0, 3);
+
+          // The destination row that source column ahead_j + row of that tile is written into.
+          line = (char *)(dest + RIDX(dim_minus_1 - (ahead_j + row), dim - ahead_i - width, dim));
+          end = (char *)(dest + RIDX(dim_minus_1 - (ahead_j + row), dim - ahead_i, dim));
+          for (; line < end; line += CACHE_LINE)
+            __builtin_prefetch(line, 1, 3);
+        }
+
         dim_minus_1_minus_ii = dim_minus_1 - ii;
         for(jj = j; jj < j + width; jj+=2) {
           
           // **************************** First Iteration ****************************
           lookupPix = *(src + RIDX(ii, jj, dim)); 
-          average = ((unsigned short)lookupPix.red + (unsigned short)lookupPix.green + (unsigned short)lookupPix.blue) / 3;
+          average = divide((unsigned short)lookupPix.red + (unsigned short)lookupPix.green + (unsigned short)lookupPix.blue, 3, mode);
           lookupPix.red = lookupPix.green = lookupPix.blue = average;
           dest[RIDX(dim_minus_1 - jj, dim_minus_1_minus_ii, dim)] = lookupPix;
 
           // **************************** Second Iteration ****************************
           lookupPix = *(src + RIDX(ii, jj + 1, dim));
-          average = ((unsigned short)lookupPix.red + (unsigned short)lookupPix.green + (unsigned short)lookupPix.blue) / 3;
+          average = divide((unsigned short)lookupPix.red + (unsigned short)lookupPix.green + (unsigned short)lookupPix.blue, 3, mode);
           lookupPix.red = lookupPix.green = lookupPix.blue = average;
           dest[RIDX(dim_minus_1 - (jj + 1), dim_minus_1_minus_ii, dim)] = lookupPix;
         }
       }
+      // Only does anything in "make profile" builds. The tile lands transposed in dest.
+      TILE_STOP(tile_start, "complex", dim,
+                (i == 0 || j == 0 || i + width >= dim || j + width >= dim)? TILE_EDGE : TILE_INTERIOR,
+                dim - j - width, dim - i - width, width, width);
     }
   }
 }
 
+char complex_descr[] = "Final optimization of complex";
+void complex(int dim, pixel *src, pixel *dest)
+{
+  complex_divide(dim, src, dest, DIVIDE_PLAIN, 0);
+}
+
+/*
+ * complex_reciprocal - complex with the divide by 3 done by a fixed-point reciprocal multiply. Exact (see fastdiv.h).
+ */
+char complex_reciprocal_descr[] = "complex_reciprocal: Fixed-point reciprocal divide";
+void complex_reciprocal(int dim, pixel *src, pixel *dest)
+{
+  complex_divide(dim, src, dest, DIVIDE_RECIPROCAL, 0);
+}
+
+/*
+ * complex_approx - complex with a 32-bit approximate divide by 3. Each average may be 1 too small.
+ */
+char complex_approx_descr[] = "complex_approx: 32-bit approximate divide";
+void complex_approx(int dim, pixel *src, pixel *dest)
+{
+  complex_divide(dim, src, dest, DIVIDE_APPROX, 0);
+}
+
+/*
+ * complex_prefetch - complex with software prefetching for the column-wise writes (see complex_divide).
+ * A distance of 0 turns the prefetches off.
+ */
+static int prefetch_distance = 2;
+
+/* Negative distances would prefetch outside src and dest, so they count as 0 */
+void set_prefetch_distance(int tiles)
+{
+  prefetch_distance = (tiles < 0)? 0 : tiles;
+}
+
+char complex_prefetch_descr[] = "complex_prefetch: Prefetches the tile prefetch_distance tiles ahead";
+void complex_prefetch(int dim, pixel *src, pixel *dest)
+{
+  complex_divide(dim, src, dest, DIVIDE_PLAIN, prefetch_distance);
+}
+
 /******************************************************************************************************************************
 UNUSED VERSIONS OF MY CODE.
 
@@ -330,6 +418,9 @@ End of unused versions.
 void register_complex_functions() {
   add_complex_function(&complex, complex_descr);
   add_complex_function(&naive_complex, naive_complex_descr);
+  add_complex_function(&complex_reciprocal, complex_reciprocal_descr);
+  add_approx_complex_function(&complex_approx, complex_approx_descr, 1);
+  add_complex_function(&complex_prefetch, complex_prefetch_descr);
 }
 
 
@@ -378,6 +469,29 @@ static pixel weighted_combo(int dim, int i, int j, pixel *src)
 
 
 
+/*
+ * divide - Divides the sum of a pixel's neighbors by how many there are, the way "mode" asks for (see fastdiv.h).
+ * Both "divisor" and "mode" are constants at every call site, so once inlined only one kind of divide is left.
+ */
+INLINE int divide(int sum, int divisor, int mode)
+{
+  if (mode == DIVIDE_RECIPROCAL)
+    return DIV_EXACT(sum, divisor);
+
+  if (mode == DIVIDE_APPROX) {
+    switch (divisor) {
+      case 2: return DIV2_APPROX(sum);
+      case 3: return DIV3_APPROX(sum);
+      case 4: return DIV4_APPROX(sum);
+      case 6: return DIV6_APPROX(sum);
+      default: return DIV9_APPROX(sum);
+    }
+  }
+
+  return sum / divisor;
+}
+
+
 /* 
  * "weighted_combo" was separated into a few different methods for each possibility.
  * This method handles the case where the target pixel has all nine surrounding neighbors.
@@ -387,7 +501,7 @@ static pixel weighted_combo(int dim, int i, int j, pixel *src)
  *      - Replaced the current_pixel variable with a pointer to the destination pixel and changed this to a void function.
  *      - Removed the 3x3 for-loops and just manually iterated 9 times.
  */
- static void All_Nine_Neighbors(int dim, int i, int j, pixel *src, pixel *dst) 
+ INLINE void All_Nine_Neighbors(int dim, int i, int j, pixel *src, pixel *dst, int mode) 
 {
   // Instantiate reused variables.
   int read_location;
@@ -459,9 +573,9 @@ static pixel weighted_combo(int dim, int i, int j, pixel *src)
   blue += (int) src[read_location].blue;
   
   // Calculate the average RGB values and save them into the destination pixel.
-  dst->red = (unsigned short) (red / 9);
-  dst->green = (unsigned short) (green / 9);
-  dst->blue = (unsigned short) (blue / 9);
+  dst->red = (unsigned short) divide(red, 9, mode);
+  dst->green = (unsigned short) divide(green, 9, mode);
+  dst->blue = (unsigned short) divide(blue, 9, mode);
 }
 
 
@@ -469,7 +583,7 @@ static pixel weighted_combo(int dim, int i, int j, pixel *src)
 * The following four helper methods all calculate the weighted average of the number of neighbors specified in the 
 * method name.
 */
-static void Six_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst) {
+INLINE void Six_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode) {
   
   // Instantiate reused variables.
   int read_location;
@@ -522,11 +636,11 @@ static void Six_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *d
   blue += (int) src[read_location].blue;
 
   // Calculate the average RGB values and save them into the destination pixel.
-  (*(pixel*)dst).red = (unsigned short) (red / 6);
-  (*(pixel*)dst).green = (unsigned short) (green / 6);
-  (*(pixel*)dst).blue = (unsigned short) (blue / 6);
+  (*(pixel*)dst).red = (unsigned short) divide(red, 6, mode);
+  (*(pixel*)dst).green = (unsigned short) divide(green, 6, mode);
+  (*(pixel*)dst).blue = (unsigned short) divide(blue, 6, mode);
 }
-static void Six_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst) {
+INLINE void Six_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode) {
   
   // Instantiate reused variables.
   int read_location;
@@ -579,11 +693,11 @@ static void Six_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *
   blue += (int) src[read_location].blue;
 
   // Calculate the average RGB values and save them into the destination pixel.
-  (*(pixel*)dst).red = (unsigned short) (red / 6);
-  (*(pixel*)dst).green = (unsigned short) (green / 6);
-  (*(pixel*)dst).blue = (unsigned short) (blue / 6);
+  (*(pixel*)dst).red = (unsigned short) divide(red, 6, mode);
+  (*(pixel*)dst).green = (unsigned short) divide(green, 6, mode);
+  (*(pixel*)dst).blue = (unsigned short) divide(blue, 6, mode);
 }
-static void Three_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst) {
+INLINE void Three_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode) {
   
   // Instantiate reused variables.
   int read_location;
@@ -617,11 +731,11 @@ static void Three_Neighbors_Right_Edge(int dim, int i, int j, pixel *src, pixel
   blue += (int) src[read_location].blue;
 
   // Calculate the average RGB values and save them into the destination pixel.
-  (*(pixel*)dst).red = (unsigned short) (red / 3);
-  (*(pixel*)dst).green = (unsigned short) (green / 3);
-  (*(pixel*)dst).blue = (unsigned short) (blue / 3);
+  (*(pixel*)dst).red = (unsigned short) divide(red, 3, mode);
+  (*(pixel*)dst).green = (unsigned short) divide(green, 3, mode);
+  (*(pixel*)dst).blue = (unsigned short) divide(blue, 3, mode);
 }
-static void Three_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst) {
+INLINE void Three_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel *dst, int mode) {
   
   // Instantiate reused variables.
   int read_location;
@@ -655,9 +769,9 @@ static void Three_Neighbors_Bottom_Edge(int dim, int i, int j, pixel *src, pixel
   blue += (int) src[read_location].blue;
 
   // Calculate the average RGB values and save them into the destination pixel.
-  (*(pixel*)dst).red = (unsigned short) (red / 3);
-  (*(pixel*)dst).green = (unsigned short) (green / 3);
-  (*(pixel*)dst).blue = (unsigned short) (blue / 3);
+  (*(pixel*)dst).red = (unsigned short) divide(red, 3, mode);
+  (*(pixel*)dst).green = (unsigned short) divide(green, 3, mode);
+  (*(pixel*)dst).blue = (unsigned short) divide(blue, 3, mode);
 }
 /******************************************************
  * Your different versions of the motion kernel go here
@@ -687,9 +801,11 @@ void naive_motion(int dim, pixel *src, pixel *dst)
  *          3_bottom_edge, 2_right_edge, 2_bottom_edge, 1)
  *          then I wrote a "weighted_combo" helper method for each named based on the number and position of their neighbors.
  *      - Replaced array lookups with pointers that accumulate (called src_i_j and dst_i_j).
+ *
+ * The body lives in motion_divide() so it can also be built with the faster divides from fastdiv.h
+ * (motion_reciprocal and motion_approx below). "mode" picks the divide.
  */
-char motion_descr[] = "motion: Current working version";
-void motion(int dim, pixel *src, pixel *dst) 
+INLINE void motion_divide(int dim, pixel *src, pixel *dst, int mode)
 { 
   int i, j;
 
@@ -709,30 +825,37 @@ void motion(int dim, pixel *src, pixel *dst)
   for (i = 0; i < N_minus_2; i++) {
 
     // Operate on all the elements with nine neighbors. This exludes the last two rows and columns.
+    TILE_START(band_start);
     for (j = 0; j < N_minus_2; j++) {
-      All_Nine_Neighbors(dim, i, j, src, &dst[RIDX(i, j, dim)]);
+      All_Nine_Neighbors(dim, i, j, src, &dst[RIDX(i, j, dim)], mode);
     }
+    TILE_STOP(band_start, "motion", dim, TILE_INTERIOR, i, 0, 1, N_minus_2);
       
       
     // Operate on all the elements with 6 neigbors on the right edge.
-    Six_Neighbors_Right_Edge(dim, i, N_minus_2, src, &dst[RIDX(i, N_minus_2, dim)]);
+    TILE_START(edge_start);
+    Six_Neighbors_Right_Edge(dim, i, N_minus_2, src, &dst[RIDX(i, N_minus_2, dim)], mode);
 
     // Operate on all the elements with 3 neigbors on the right edge.
-    Three_Neighbors_Right_Edge(dim, i, N_minus_1, src, &dst[RIDX(i, N_minus_1, dim)]);
+    Three_Neighbors_Right_Edge(dim, i, N_minus_1, src, &dst[RIDX(i, N_minus_1, dim)], mode);
+    TILE_STOP(edge_start, "motion", dim, TILE_RIGHT_EDGE, i, N_minus_2, 1, 2);
   }
 
   // Operate on the two bottom rows
+  TILE_START(bottom_start);
   for (j = 0; j < N_minus_2; j++) {
 
     // Operate on all the elements with 6 neighbors on the bottom edge.
-    Six_Neighbors_Bottom_Edge(dim, N_minus_2, j, src, &dst[RIDX(N_minus_2, j, dim)]);
+    Six_Neighbors_Bottom_Edge(dim, N_minus_2, j, src, &dst[RIDX(N_minus_2, j, dim)], mode);
         
     // Operate on all the elements with 3 neighbors on the bottom edge.
-    Three_Neighbors_Bottom_Edge(dim, N_minus_1, j, src, &dst[RIDX(N_minus_1, j, dim)]);
+    Three_Neighbors_Bottom_Edge(dim, N_minus_1, j, src, &dst[RIDX(N_minus_1, j, dim)], mode);
   }
+  TILE_STOP(bottom_start, "motion", dim, TILE_BOTTOM_EDGE, N_minus_2, 0, 2, N_minus_2);
   
 
   // At this point, only the 4 bottom-right nodes are uncalculated. 
+  TILE_START(corner_start);
 
   // Manually accumulate each of their RGB values.
   int red, blue, green;
@@ -748,14 +871,14 @@ void motion(int dim, pixel *src, pixel *dst)
   dst[N_squared_minus_1].blue = blue;
 
   // [1,0]
-  dst[N_squared_minus_2].red = (int) ((red + src[N_squared_minus_2].red)/2);
-  dst[N_squared_minus_2].green = (int) ((green + src[N_squared_minus_2].green)/2);
-  dst[N_squared_minus_2].blue = (int) ((blue + src[N_squared_minus_2].blue)/2);
+  dst[N_squared_minus_2].red = divide(red + src[N_squared_minus_2].red, 2, mode);
+  dst[N_squared_minus_2].green = divide(green + src[N_squared_minus_2].green, 2, mode);
+  dst[N_squared_minus_2].blue = divide(blue + src[N_squared_minus_2].blue, 2, mode);
 
   // [0,1]
-  dst[N_squared_minus_N_minus_1].red = (int) ((red + src[N_squared_minus_N_minus_1].red)/2);
-  dst[N_squared_minus_N_minus_1].green = (int) ((green + src[N_squared_minus_N_minus_1].green)/2);
-  dst[N_squared_minus_N_minus_1].blue = (int) ((blue + src[N_squared_minus_N_minus_1].blue)/2);
+  dst[N_squared_minus_N_minus_1].red = divide(red + src[N_squared_minus_N_minus_1].red, 2, mode);
+  dst[N_squared_minus_N_minus_1].green = divide(green + src[N_squared_minus_N_minus_1].green, 2, mode);
+  dst[N_squared_minus_N_minus_1].blue = divide(blue + src[N_squared_minus_N_minus_1].blue, 2, mode);
 
   // [0,0]
   red += src[N_squared_minus_N_minus_1].red;
@@ -766,9 +889,35 @@ void motion(int dim, pixel *src, pixel *dst)
   green += src[N_squared_minus_2].green;
   blue += src[N_squared_minus_2].blue;
 
-  dst[N_squared_minus_N_minus_2].red = (int) ((red + src[N_squared_minus_N_minus_2].red)/4);
-  dst[N_squared_minus_N_minus_2].green = (int) ((green + src[N_squared_minus_N_minus_2].green)/4);
-  dst[N_squared_minus_N_minus_2].blue = (int) ((blue + src[N_squared_minus_N_minus_2].blue)/4);
+  dst[N_squared_minus_N_minus_2].red = divide(red + src[N_squared_minus_N_minus_2].red, 4, mode);
+  dst[N_squared_minus_N_minus_2].green = divide(green + src[N_squared_minus_N_minus_2].green, 4, mode);
+  dst[N_squared_minus_N_minus_2].blue = divide(blue + src[N_squared_minus_N_minus_2].blue, 4, mode);
+  TILE_STOP(corner_start, "motion", dim, TILE_CORNER, N_minus_2, N_minus_2, 2, 2);
+}
+
+char motion_descr[] = "motion: Current working version";
+void motion(int dim, pixel *src, pixel *dst) 
+{
+  motion_divide(dim, src, dst, DIVIDE_PLAIN);
+}
+
+/*
+ * motion_reciprocal - motion with every average computed by multiplying with a precomputed fixed-point reciprocal
+ * instead of dividing. Gives exactly the same pixels as motion (see fastdiv.h for why).
+ */
+char motion_reciprocal_descr[] = "motion_reciprocal: Fixed-point reciprocal divides";
+void motion_reciprocal(int dim, pixel *src, pixel *dst) 
+{
+  motion_divide(dim, src, dst, DIVIDE_RECIPROCAL);
+}
+
+/*
+ * motion_approx - motion with 32-bit approximate divides. Each channel may be 1 below the exact average.
+ */
+char motion_approx_descr[] = "motion_approx: 32-bit approximate divides";
+void motion_approx(int dim, pixel *src, pixel *dst) 
+{
+  motion_divide(dim, src, dst, DIVIDE_APPROX);
 }
 
 /********************************************************************* 
@@ -782,4 +931,6 @@ void motion(int dim, pixel *src, pixel *dst)
 void register_motion_functions() {
   add_motion_function(&motion, motion_descr);
   add_motion_function(&naive_motion, naive_motion_descr);
+  add_motion_function(&motion_reciprocal, motion_reciprocal_descr);
+  add_approx_motion_function(&motion_approx, motion_approx_descr, 1);
 }
\ No newline at end of file
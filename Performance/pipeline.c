@@ -0,0 +1,271 @@
+/*******************************************************************
+ *
+ * pipeline.c - Overlapped multi-stage image pipeline
+ *
+ * Each stage runs on its own thread and pulls frames from a bounded
+ * queue filled by the stage before it. Frames are recycled through a
+ * free queue, so the memory in use is fixed no matter how many
+ * frames are streamed.
+ *
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+/* A bounded FIFO of frame pointers. NULL marks the end of the stream. */
+typedef struct {
+  frame_t **slots;
+  int capacity;
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} frame_queue_t;
+
+/* Everything one stage thread needs */
+typedef struct {
+  stage_t *stage;
+  int index;               /* position of the stage in the pipeline */
+  int frames;              /* only used by the first stage */
+  frame_queue_t *in, *out;
+  double busy;             /* seconds spent inside stage->run */
+  double stalled;          /* seconds spent waiting on the queues */
+  int done;                /* frames processed */
+  double *latency;         /* last stage only: end-to-end time per frame */
+} stage_worker_t;
+
+/*
+ * now - Returns a monotonic timestamp in seconds
+ */
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void queue_init(frame_queue_t *q, int capacity)
+{
+  q->slots = malloc(capacity * sizeof(frame_t *));
+  q->capacity = capacity;
+  q->head = q->count = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(frame_queue_t *q)
+{
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  free(q->slots);
+}
+
+static void queue_push(frame_queue_t *q, frame_t *f)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  q->slots[(q->head + q->count) % q->capacity] = f;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static frame_t *queue_pop(frame_queue_t *q)
+{
+  frame_t *f;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  f = q->slots[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return f;
+}
+
+/*
+ * stage_main - Body of every stage thread. The first stage takes
+ *     empty frames from the free queue until it has started `frames`
+ *     of them, then passes NULL down to shut the pipeline down. The
+ *     last stage hands finished frames back to the free queue.
+ */
+static void *stage_main(void *arg)
+{
+  stage_worker_t *w = arg;
+  frame_t *f;
+  double t;
+  int first = (w->index == 0);
+
+  while (!first || w->done < w->frames) {
+    t = now();
+    f = queue_pop(w->in);
+    w->stalled += now() - t;
+    if (f == NULL)
+      break;
+
+    if (first)
+      f->id = w->done;
+    f->start[w->index] = now();
+    w->stage->run(f);
+    f->end[w->index] = now();
+    w->busy += f->end[w->index] - f->start[w->index];
+    w->done++;
+    if (w->latency != NULL)
+      w->latency[f->id] = f->end[w->index] - f->start[0];
+
+    t = now();
+    queue_push(w->out, f);
+    w->stalled += now() - t;
+  }
+
+  /* Tell the next stage that the stream has ended */
+  queue_push(w->out, NULL);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * run_sequential - Runs every frame through all stages on this thread,
+ *     one after another. Returns the elapsed time in seconds.
+ */
+static double run_sequential(stage_t *stages, int nstages, frame_t *f, int frames)
+{
+  int i, s;
+  double t = now();
+
+  for (i = 0; i < frames; i++) {
+    f->id = i;
+    for (s = 0; s < nstages; s++)
+      stages[s].run(f);
+  }
+  return now() - t;
+}
+
+int run_pipeline(stage_t *stages, int nstages, int frames, int dim, int depth)
+{
+  stage_worker_t workers[PIPELINE_MAX_STAGES];
+  pthread_t threads[PIPELINE_MAX_STAGES];
+  frame_queue_t queues[PIPELINE_MAX_STAGES];
+  frame_t *pool;
+  pixel *images;
+  double *latency;
+  double wall, seq_wall, mean, slowest;
+  int npool, i, s, bottleneck;
+
+  if (nstages < 1 || nstages > PIPELINE_MAX_STAGES || frames < 1 || dim < 1 || depth < 1) {
+    fprintf(stderr, "run_pipeline: bad arguments\n");
+    return -1;
+  }
+  if (dim % PIPELINE_DIM_MULTIPLE != 0) {
+    fprintf(stderr, "run_pipeline: dim %d is not a multiple of %d\n", dim, PIPELINE_DIM_MULTIPLE);
+    return -1;
+  }
+
+  /*
+   * Enough frames that every stage can hold one and every inter-stage
+   * queue can be full at the same time.
+   */
+  npool = nstages + (nstages - 1) * depth;
+  pool = calloc(npool, sizeof(frame_t));
+  images = malloc((size_t)npool * PIPELINE_IMAGES * dim * dim * sizeof(pixel));
+  latency = malloc(frames * sizeof(double));
+  if (pool == NULL || images == NULL || latency == NULL) {
+    fprintf(stderr, "run_pipeline: out of memory\n");
+    free(pool);
+    free(images);
+    free(latency);
+    return -1;
+  }
+
+  for (i = 0; i < npool; i++) {
+    pool[i].dim = dim;
+    for (s = 0; s < PIPELINE_IMAGES; s++)
+      pool[i].img[s] = images + ((size_t)i * PIPELINE_IMAGES + s) * dim * dim;
+  }
+
+  /* Sequential reference run over the same number of frames */
+  seq_wall = run_sequential(stages, nstages, &pool[0], frames);
+
+  /*
+   * queues[0] is the free queue: it feeds the first stage and the last
+   * stage puts finished frames back into it. In between, queues[s]
+   * feeds stage s. The free queue also has room for the final NULL.
+   */
+  queue_init(&queues[0], npool + 1);
+  for (s = 1; s < nstages; s++)
+    queue_init(&queues[s], depth);
+  for (i = 0; i < npool; i++)
+    queue_push(&queues[0], &pool[i]);
+
+  for (s = 0; s < nstages; s++) {
+    workers[s].stage = &stages[s];
+    workers[s].index = s;
+    workers[s].frames = frames;
+    workers[s].in = &queues[s];
+    workers[s].out = (s == nstages - 1) ? &queues[0] : &queues[s + 1];
+    workers[s].busy = workers[s].stalled = 0.0;
+    workers[s].done = 0;
+    workers[s].latency = (s == nstages - 1) ? latency : NULL;
+  }
+
+  wall = now();
+  for (s = 0; s < nstages; s++)
+    pthread_create(&threads[s], NULL, stage_main, &workers[s]);
+
+  for (s = 0; s < nstages; s++)
+    pthread_join(threads[s], NULL);
+  wall = now() - wall;
+
+  for (s = 0; s < nstages; s++)
+    queue_destroy(&queues[s]);
+
+  qsort(latency, frames, sizeof(double), compare_doubles);
+  mean = 0.0;
+  for (i = 0; i < frames; i++)
+    mean += latency[i];
+  mean /= frames;
+
+  /* Print results as a table */
+  printf("Pipeline: %d frames of %dx%d, %d stages, queue depth %d\n",
+         frames, dim, dim, nstages, depth);
+  printf("Stage\t\tFrames\tBusy(ms)\tMean(ms)\tFrames/s\tStalled(ms)\tUtil\n");
+
+  bottleneck = 0;
+  slowest = 0.0;
+  for (s = 0; s < nstages; s++) {
+    double per_frame = workers[s].busy / workers[s].done;
+    printf("%-12s\t%d\t%.1f\t\t%.2f\t\t%.1f\t\t%.1f\t\t%.0f%%\n",
+           stages[s].name, workers[s].done, workers[s].busy * 1e3,
+           per_frame * 1e3, 1.0 / per_frame, workers[s].stalled * 1e3,
+           100.0 * workers[s].busy / wall);
+    if (per_frame > slowest) {
+      slowest = per_frame;
+      bottleneck = s;
+    }
+  }
+
+  printf("Bottleneck stage: %s (%.2f ms/frame)\n", stages[bottleneck].name, slowest * 1e3);
+  printf("End-to-end latency (ms): min %.2f  mean %.2f  p50 %.2f  p99 %.2f  max %.2f\n",
+         latency[0] * 1e3, mean * 1e3, latency[frames / 2] * 1e3,
+         latency[(frames * 99) / 100] * 1e3, latency[frames - 1] * 1e3);
+  printf("Throughput: %.1f frames/s pipelined, %.1f frames/s sequential (%.2fx)\n\n",
+         frames / wall, frames / seq_wall, seq_wall / wall);
+
+  free(pool);
+  free(images);
+  free(latency);
+  return 0;
+}
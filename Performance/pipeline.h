@@ -0,0 +1,46 @@
+/*
+ * pipeline.h - Runs a sequence of image stages concurrently across a
+ * stream of frames.
+ *
+ * Every stage gets its own thread. Consecutive stages are connected by
+ * bounded queues, so while one frame is in motion() the next one can
+ * already be in complex() and a third one can be generated.
+ */
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include "defs.h"
+
+#define PIPELINE_MAX_STAGES 8
+#define PIPELINE_IMAGES 3
+/* complex() and motion() walk whole tiles of up to 64 pixels, so dim must be a multiple of this */
+#define PIPELINE_DIM_MULTIPLE 64
+
+/* One frame travelling through the pipeline */
+typedef struct {
+  int id;                          /* frame number, starting at 0 */
+  int dim;                         /* frames are dim x dim */
+  pixel *img[PIPELINE_IMAGES];     /* working images owned by the frame */
+  double start[PIPELINE_MAX_STAGES]; /* when each stage began (seconds) */
+  double end[PIPELINE_MAX_STAGES];   /* when each stage finished (seconds) */
+} frame_t;
+
+typedef void (*stage_func)(frame_t *frame);
+
+typedef struct {
+  char *name;
+  stage_func run;
+} stage_t;
+
+/*
+ * run_pipeline - Pushes `frames` frames of size dim x dim through the
+ *     stages, with at most `depth` frames waiting between two stages.
+ *     The same frames are first run through the stages sequentially
+ *     so that the report can show what the overlap buys. Prints
+ *     per-stage throughput, end-to-end latency and the bottleneck
+ *     stage. Returns 0 on success and -1 if it could not start, which
+ *     includes a dim that is not a multiple of PIPELINE_DIM_MULTIPLE.
+ */
+int run_pipeline(stage_t *stages, int nstages, int frames, int dim, int depth);
+
+#endif /* _PIPELINE_H_ */
@@ -0,0 +1,126 @@
+/*
+ * tileprof.c - Ring buffer and heatmap writer for the per-tile profiler.
+ *
+ * Writers claim a slot with one atomic fetch-and-add on the write
+ * index and then fill it in, so recording never takes a lock. When the
+ * buffer wraps, the oldest samples are overwritten. Dumping is only
+ * done while no kernel is running.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tileprof.h"
+
+const char *tile_kind_names[TILE_KINDS] = {
+  "interior", "edge", "right-edge", "bottom-edge", "corner"
+};
+
+static tile_sample_t samples[TILEPROF_CAPACITY];
+static unsigned long next_sample = 0;
+
+/* Cycles that reading the counter twice costs by itself */
+static unsigned long long overhead = 0;
+
+void tileprof_record(const char *kernel, int dim, int kind,
+                     int row, int col, int rows, int cols,
+                     unsigned long long cycles)
+{
+  unsigned long slot = __atomic_fetch_add(&next_sample, 1, __ATOMIC_RELAXED);
+  tile_sample_t *s = &samples[slot % TILEPROF_CAPACITY];
+
+  s->kernel = kernel;
+  s->dim = dim;
+  s->kind = kind;
+  s->row = row;
+  s->col = col;
+  s->rows = rows;
+  s->cols = cols;
+  s->cycles = (cycles > overhead) ? cycles - overhead : 0;
+}
+
+void tileprof_reset(void)
+{
+  int i;
+  unsigned long long t, best = ~0ULL;
+
+  for (i = 0; i < 1000; i++) {
+    t = tileprof_now();
+    t = tileprof_now() - t;
+    if (t < best)
+      best = t;
+  }
+  overhead = best;
+  __atomic_store_n(&next_sample, 0, __ATOMIC_RELAXED);
+}
+
+/* Orders samples by region so repeats of one region end up together */
+static int compare_regions(const void *a, const void *b)
+{
+  const tile_sample_t *x = a, *y = b;
+
+  if (x->row != y->row)
+    return x->row - y->row;
+  if (x->col != y->col)
+    return x->col - y->col;
+  return x->kind - y->kind;
+}
+
+int tileprof_dump(const char *path, const char *kernel, int dim)
+{
+  unsigned long total = __atomic_load_n(&next_sample, __ATOMIC_RELAXED);
+  unsigned long n = (total < TILEPROF_CAPACITY) ? total : TILEPROF_CAPACITY;
+  unsigned long i, j, count = 0;
+  unsigned long long kind_cycles[TILE_KINDS] = {0};
+  long kind_pixels[TILE_KINDS] = {0};
+  unsigned long long sum, all = 0;
+  tile_sample_t *mine;
+  int regions = 0;
+  FILE *f;
+
+  /* Pick out this kernel's samples */
+  mine = malloc(n * sizeof(tile_sample_t) + 1);
+  if (mine == NULL)
+    return -1;
+  for (i = 0; i < n; i++)
+    if (samples[i].kernel != NULL && !strcmp(samples[i].kernel, kernel) && samples[i].dim == dim)
+      mine[count++] = samples[i];
+  qsort(mine, count, sizeof(tile_sample_t), compare_regions);
+
+  f = fopen(path, "w");
+  if (f == NULL) {
+    free(mine);
+    return -1;
+  }
+  fprintf(f, "%d %d\n", dim, dim);
+
+  /* One line per region, averaged over the runs that were recorded */
+  for (i = 0; i < count; i = j) {
+    sum = 0;
+    for (j = i; j < count && !compare_regions(&mine[i], &mine[j]); j++)
+      sum += mine[j].cycles;
+    sum /= (j - i);
+
+    fprintf(f, "%d %d %d %d %llu %s\n", mine[i].row, mine[i].col,
+            mine[i].rows, mine[i].cols, sum, tile_kind_names[mine[i].kind]);
+    kind_cycles[mine[i].kind] += sum;
+    kind_pixels[mine[i].kind] += (long)mine[i].rows * mine[i].cols;
+    all += sum;
+    regions++;
+  }
+  fclose(f);
+  free(mine);
+
+  /* Print where the cycles went */
+  printf("Tile profile: %s, dim %d -> %s (%d regions)\n", kernel, dim, path, regions);
+  printf("Region\t\tPixels\tCycles\t\tCycles/pixel\tShare\n");
+  for (i = 0; i < TILE_KINDS; i++) {
+    if (kind_pixels[i] == 0)
+      continue;
+    printf("%-12s\t%ld\t%llu\t\t%.2f\t\t%.1f%%\n", tile_kind_names[i], kind_pixels[i],
+           kind_cycles[i], (double)kind_cycles[i] / kind_pixels[i],
+           all ? 100.0 * kind_cycles[i] / all : 0.0);
+  }
+  printf("\n");
+
+  return regions;
+}
@@ -604,9 +604,6 @@ void do_fg(int jid)
  */
 void waitfg(pid_t pid)
 {
-  // Create a pointer to the specified job
-  struct job_t *job = getjobpid(jobs, pid);
-
   // Block incoming signals in the current process.
   sigset_t mask;
   sigemptyset(&mask);
@@ -614,8 +611,11 @@ void waitfg(pid_t pid)
   sigset_t prev_mask;
   sigprocmask(SIG_BLOCK, &mask, &prev_mask);
 
-  // Wait until the specified job is no longer in the foreground.
-  while (job->state == FG)
+  // Create a pointer to the specified job. A quick job may already have been reaped and deleted, and then there is nothing to wait for.
+  struct job_t *job = getjobpid(jobs, pid);
+
+  // Wait until the specified job is no longer in the foreground (or has been deleted from the job list).
+  while (job != NULL && job->pid == pid && job->state == FG)
     sigsuspend(&prev_mask);
 
   // Then unblock incoming signals in the current process.